@@ -0,0 +1,57 @@
+#include "alloc_stats.hpp"
+
+#include <cstdlib>
+#include <new>
+
+thread_local uint64_t AllocStats::count = 0;
+thread_local uint64_t AllocStats::bytes = 0;
+
+#ifdef YADDA_ALLOC_STATS
+
+// replaces the global operator new so every allocation gets counted
+static void *allocate(size_t size) {
+	AllocStats::count++;
+	AllocStats::bytes += size;
+	void *pointer = malloc(size ? size : 1);
+	if (pointer == nullptr) {
+		throw std::bad_alloc();
+	}
+	return pointer;
+}
+
+void *operator new(size_t size) {
+	return allocate(size);
+}
+
+void *operator new[](size_t size) {
+	return allocate(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+	AllocStats::count++;
+	AllocStats::bytes += size;
+	return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+	AllocStats::count++;
+	AllocStats::bytes += size;
+	return malloc(size ? size : 1);
+}
+
+void operator delete(void *pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+	free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+	free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept {
+	free(pointer);
+}
+#endif
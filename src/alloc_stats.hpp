@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* AllocStats
+ * Counts the calls to operator new, and the bytes they asked for,
+ * made by the current thread. Diff them around a piece of code to
+ * see what it allocates. Only builds with YADDA_ALLOC_STATS defined
+ * replace operator new, in the rest both stay at zero.
+ * enabled: whether allocations are being counted
+ */
+struct AllocStats {
+#ifdef YADDA_ALLOC_STATS
+	static constexpr bool enabled = true;
+#else
+	static constexpr bool enabled = false;
+#endif
+	static thread_local uint64_t count;
+	static thread_local uint64_t bytes;
+};
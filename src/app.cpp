@@ -1,12 +1,18 @@
 #include "app.hpp"
 
+#include "alloc_stats.hpp"
 #include "logger.hpp"
+#include "terminal.hpp"
+#include "trace.hpp"
 
+#include <algorithm>
 #include <cstdio>
 #include <cctype>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
+#include <sys/stat.h>
 
 const char *MODE_STRINGS[] = {
 	" NORMAL ",
@@ -16,6 +22,218 @@ const char *MODE_STRINGS[] = {
 	" COMMAND "
 };
 
+struct CommandName {
+	const char *name;
+	Command command;
+};
+
+const CommandName COMMAND_NAMES[] = {
+	{"w", Command::WRITE},
+	{"q", Command::QUIT},
+	{"waq", Command::WRITE_QUIT},
+	{"e", Command::EDIT},
+	{"stats", Command::STATS},
+	{"map", Command::MAP},
+	{"follow", Command::FOLLOW},
+	{"ls", Command::LIST_BUFFERS},
+	{"b", Command::BUFFER},
+	{"bn", Command::NEXT_BUFFER},
+	{"bp", Command::PREVIOUS_BUFFER},
+	{"sp", Command::SPLIT},
+	{"split", Command::SPLIT},
+	{"vs", Command::VERTICAL_SPLIT},
+	{"vsplit", Command::VERTICAL_SPLIT},
+	{"close", Command::CLOSE_VIEW},
+	{"only", Command::ONLY_VIEW},
+};
+
+// the line range in front of a :{range}!cmd, as many of its characters as there are
+static size_t rangeLength(const char *text, size_t length) {
+	size_t range_length = 0;
+	while (range_length < length && (isdigit((unsigned char)text[range_length]) || strchr(".,$%", text[range_length]) != nullptr)) {
+		range_length++;
+	}
+	return range_length;
+}
+
+/*
+ * Turns the name at the start of a command line into its token,
+ * and points argument at whatever follows the name. A line range
+ * followed by '!' is a filter, with the shell command as its argument.
+ */
+Command internCommand(const char *text, size_t length, const char *&argument) {
+	size_t range_length = rangeLength(text, length);
+	if (range_length < length && text[range_length] == '!') {
+		argument = &text[range_length + 1];
+		while (*argument == ' ') {
+			argument++;
+		}
+		return Command::FILTER;
+	}
+	size_t name_length = 0;
+	while (name_length < length && text[name_length] != ' ') {
+		name_length++;
+	}
+	argument = &text[name_length];
+	while (*argument == ' ') {
+		argument++;
+	}
+	for (const CommandName &name : COMMAND_NAMES) {
+		if (strlen(name.name) == name_length && memcmp(name.name, text, name_length) == 0) {
+			return name.command;
+		}
+	}
+	return Command::NONE;
+}
+
+// one end of a line range, a number, '.' for the cursor's line or '$' for the last, as SIZE_MAX
+static const char *parseAddress(const char *text, size_t cursor_line, size_t &line) {
+	if (*text == '.' || *text == '$') {
+		line = *text == '.' ? cursor_line : SIZE_MAX;
+		return text + 1;
+	}
+	if (!isdigit((unsigned char)*text)) {
+		return nullptr;
+	}
+	char *end;
+	line = strtoull(text, &end, 10);
+	return end;
+}
+
+/*
+ * The lines, from 1, of the range at the start of text: one line, two
+ * separated by a comma, or '%' for the whole file. No range is the
+ * cursor's line.
+ */
+static void parseRange(const char *text, size_t cursor_line, size_t &first, size_t &last) {
+	first = last = cursor_line;
+	if (*text == '%') {
+		first = 1;
+		last = SIZE_MAX;
+		return;
+	}
+	const char *end = parseAddress(text, cursor_line, first);
+	if (end == nullptr) {
+		return;
+	}
+	last = first;
+	if (*end == ',') {
+		parseAddress(end + 1, cursor_line, last);
+	}
+	if (first > last) {
+		std::swap(first, last);
+	}
+	first = std::max<size_t>(first, 1);
+}
+
+constexpr Binding GLOBAL_BINDINGS[] = {
+	{"\033", Action::ESCAPE},
+	{"\033[H", Action::HOME},
+	{"\033[F", Action::END},
+	{"\033[A", Action::UP},
+	{"\033[B", Action::DOWN},
+	{"\033[C", Action::RIGHT},
+	{"\033[D", Action::LEFT},
+	{"\033]52;c;", Action::PASTE_RESPONSE},
+	{"\x03", Action::INTERRUPT},
+};
+
+#define COUNT_BINDINGS \
+	{"0", Action::COUNT_DIGIT}, {"1", Action::COUNT_DIGIT}, {"2", Action::COUNT_DIGIT}, \
+	{"3", Action::COUNT_DIGIT}, {"4", Action::COUNT_DIGIT}, {"5", Action::COUNT_DIGIT}, \
+	{"6", Action::COUNT_DIGIT}, {"7", Action::COUNT_DIGIT}, {"8", Action::COUNT_DIGIT}, \
+	{"9", Action::COUNT_DIGIT}
+
+// prefix followed by a register name, a to z
+#define REGISTER_BINDINGS(prefix, action) \
+	{prefix "a", action}, {prefix "b", action}, {prefix "c", action}, {prefix "d", action}, \
+	{prefix "e", action}, {prefix "f", action}, {prefix "g", action}, {prefix "h", action}, \
+	{prefix "i", action}, {prefix "j", action}, {prefix "k", action}, {prefix "l", action}, \
+	{prefix "m", action}, {prefix "n", action}, {prefix "o", action}, {prefix "p", action}, \
+	{prefix "q", action}, {prefix "r", action}, {prefix "s", action}, {prefix "t", action}, \
+	{prefix "u", action}, {prefix "v", action}, {prefix "w", action}, {prefix "x", action}, \
+	{prefix "y", action}, {prefix "z", action}
+
+#define MOTION_BINDINGS \
+	{"j", Action::DOWN}, {"k", Action::UP}, {"h", Action::LEFT}, {"l", Action::RIGHT}, \
+	{"m", Action::GOTO_LINE}
+
+constexpr Binding NORMAL_BINDINGS[] = {
+	COUNT_BINDINGS,
+	MOTION_BINDINGS,
+	{"y", Action::YANK},
+	{"p", Action::PASTE},
+	{"a", Action::APPEND},
+	{"i", Action::INSERT},
+	{"d", Action::DELETE},
+	{"r", Action::REPLACE},
+	{"%", Action::MATCH_BRACKET},
+	{":", Action::COMMAND},
+	{"\x17w", Action::NEXT_VIEW},
+	{"\x17\x17", Action::NEXT_VIEW},
+	{"u", Action::UNDO},
+	{"\x12", Action::REDO},
+	REGISTER_BINDINGS("\"", Action::REGISTER),
+	{"*", Action::CURSOR_MATCHES},
+	{"\x0e", Action::CURSOR_BELOW},
+	REGISTER_BINDINGS("q", Action::RECORD_MACRO),
+	{"q", Action::STOP_RECORDING},
+	REGISTER_BINDINGS("@", Action::RUN_MACRO),
+};
+
+constexpr Binding INSERT_BINDINGS[] = {
+	{"\033[3~", Action::DELETE_FORWARD},
+	{"\r", Action::NEWLINE},
+	{"\x7f", Action::BACKSPACE},
+};
+
+constexpr Binding SELECT_BINDINGS[] = {
+	COUNT_BINDINGS,
+	MOTION_BINDINGS,
+	{"\r", Action::CONFIRM_SELECTION},
+	{"\x7f", Action::DELETE_SELECTION},
+};
+
+constexpr Binding REPLACE_BINDINGS[] = {
+	{"\x7f", Action::LEFT},
+};
+
+constexpr Binding COMMAND_BINDINGS[] = {
+	{"\r", Action::RUN_COMMAND},
+	{"\x7f", Action::COMMAND_BACKSPACE},
+};
+
+#undef COUNT_BINDINGS
+#undef REGISTER_BINDINGS
+#undef MOTION_BINDINGS
+
+#define MODE_TRIE(bindings) buildTrie<trieSize(bindings, GLOBAL_BINDINGS)>(bindings, GLOBAL_BINDINGS)
+
+// built by the compiler, dispatch only ever indexes into them
+constexpr auto NORMAL_TRIE = MODE_TRIE(NORMAL_BINDINGS);
+constexpr auto INSERT_TRIE = MODE_TRIE(INSERT_BINDINGS);
+constexpr auto SELECT_TRIE = MODE_TRIE(SELECT_BINDINGS);
+constexpr auto REPLACE_TRIE = MODE_TRIE(REPLACE_BINDINGS);
+constexpr auto COMMAND_TRIE = MODE_TRIE(COMMAND_BINDINGS);
+
+#undef MODE_TRIE
+
+const KeyNode *const MODE_TRIES[] = {
+	NORMAL_TRIE.data(),
+	INSERT_TRIE.data(),
+	SELECT_TRIE.data(),
+	REPLACE_TRIE.data(),
+	COMMAND_TRIE.data(),
+};
+
+const char *MODE_NAMES[] = {
+	"normal",
+	"insert",
+	"select",
+	"replace",
+	"command",
+};
+
 const CharColor MODE_COLORS[] = {
 	CharColor::GREEN,
 	CharColor::GREEN,
@@ -25,29 +243,41 @@ const CharColor MODE_COLORS[] = {
 };
 
 Application::~Application() {
-	write(STDOUT_FILENO, "\033[?1049l", sizeof("\033[?1049l") - 1);
-	tcsetattr(STDIN_FILENO, TCSANOW, &terminal_settings);
+	Terminal::deinit();
 	Logger::deinit();
-	if (text_buffer != nullptr) delete text_buffer;
+}
+
+/*
+ * How much memory loaded buffers can use before the least recently
+ * used ones are evicted. Half of RAM, or YADDA_BUFFER_MEMORY bytes.
+ */
+static size_t bufferMemoryCap() {
+	const char *value = getenv("YADDA_BUFFER_MEMORY");
+	if (value != nullptr) {
+		return strtoull(value, nullptr, 10);
+	}
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (pages <= 0 || page_size <= 0) {
+		return 1ull << 30;
+	}
+	return (size_t)pages * page_size / 2;
 }
 
 Result Application::init(const char *filename) {
 	Result result = SUCCESS;
-	TextBufferSettings settings;
-	winsize w;
-	ioctl(0, TIOCGWINSZ, &w);
-
-	tcgetattr(STDIN_FILENO, &terminal_settings);
-	termios new_settings = terminal_settings;
-	cfmakeraw(&new_settings);
-	new_settings.c_cc[VMIN] = 0;
-	new_settings.c_cc[VTIME] = 1;
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_settings);
+	// a batch run never draws anything
+	if (Terminal::headless()) {
+		Frame::held = true;
+	}
+	TextBufferSettings &settings = buffer_settings;
+	unsigned int width, height;
+	Terminal::getSize(width, height);
 
 	settings.x = 0;
 	settings.y = 0;
-	settings.width = w.ws_col;
-	settings.height = w.ws_row - 2;
+	settings.width = width;
+	settings.height = height - 2;
 	settings.fg = CharColor::WHITE;
 	settings.bg = CharColor::BLACK;
 	settings.tab_width = 4;
@@ -55,452 +285,1364 @@ Result Application::init(const char *filename) {
 	settings.tab_char[1] = '\x84';
 	settings.tab_char[2] = '\x81';
 
-	text_buffer = new TextBuffer(settings);
-	if (text_buffer == nullptr) {
-		Logger::fatal("Failed to allocate memory! Aborting...");
-		return MEMORY_ERROR;
-	}
-
-	printf("\033[?1049h");
+	// there's always a current buffer, even before any file is open
+	buffers.push_back(std::make_unique<BufferEntry>());
+	buffers[0]->text_buffer = std::make_unique<TextBuffer>(settings);
+	buffers[0]->last_used = ++buffer_clock;
+	text_buffer = buffers[0]->text_buffer.get();
+	watcher = &buffers[0]->watcher;
+	buffer_memory_cap = bufferMemoryCap();
 
 	modeline.x = 0;
-	modeline.y = w.ws_row - 2;
-	modeline.width = w.ws_col;
+	modeline.y = height - 2;
+	modeline.width = width;
 	modeline.height = 1;
 	modeline.init();
 	updateModeline();
 
 	command_line.x = 0;
-	command_line.y = w.ws_row - 1;
-	command_line.width = w.ws_col;
+	command_line.y = height - 1;
+	command_line.width = width;
 	command_line.height = 1;
 	command_line.init();
 	command_line.draw();
 
+	stats_frame.x = 0;
+	stats_frame.y = 0;
+	stats_frame.width = width;
+	stats_frame.height = std::min<unsigned int>(TRACE_COUNT + 1, settings.height);
+	stats_frame.init();
+
+	buffer_frame.x = 0;
+	buffer_frame.y = 0;
+	buffer_frame.width = width;
+
+	for (int i = 0; i < 5; i++) {
+		keymaps[i] = Keymap(MODE_TRIES[i]);
+	}
+
 	if (filename != nullptr) {
 		debug("File opened: ", filename);
 		this->filename = filename;
+		buffers[0]->filename = filename;
 		result = text_buffer->loadBuffer(filename);
 		if (result != SUCCESS) {
 			return MEMORY_ERROR;
 		}
+		watchFile();
+		recover();
 		updateModeline();
 	}
 	
 	return SUCCESS;
 }
 
+// flushes the filesystems the files are on, once each, rather than every file on its own or every filesystem there is
+static void syncFilesystems(const std::vector<const char *> &files) {
+	std::vector<dev_t> synced;
+	for (const char *file : files) {
+		struct stat status;
+		if (stat(file, &status) != 0 || std::find(synced.begin(), synced.end(), status.st_dev) != synced.end()) {
+			continue;
+		}
+		int fd = open(file, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		if (syncfs(fd) != 0) {
+			Logger::text<LogLevel::ERROR>("failed to sync the filesystem of", file);
+		}
+		close(fd);
+		synced.push_back(status.st_dev);
+	}
+}
+
+/*
+ * Runs a script against each of the files, or against stdin when there
+ * are none, writing the text to stdout once it's done. Each line of the
+ * script is typed in normal mode, with special keys written as for
+ * :map, or run as a command line if it starts with ':'. Nothing is
+ * drawn while batch is set, and files are only written if the script
+ * saves them.
+ */
+Result Application::runBatch(const std::string &script, const std::vector<const char *> &files) {
+	// the keys are read once, for every file
+	std::vector<std::string> lines;
+	for (size_t start = 0; start < script.size();) {
+		size_t end = std::min(script.find('\n', start), script.size());
+		std::string line = script.substr(start, end - start);
+		start = end + 1;
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+		if (line.empty() || line[0] == ':') {
+			lines.push_back(std::move(line));
+			continue;
+		}
+		std::string keys(line.size(), '\0');
+		size_t length = Keymap::parseKeys(line.c_str(), keys.data(), keys.size(), '\0');
+		if (length == 0) {
+			fprintf(stderr, "yadda: can't read the keys \"%s\"\n", line.c_str());
+			return INVALID_INPUT;
+		}
+		keys.resize(length);
+		lines.push_back(std::move(keys));
+	}
+	Result result = SUCCESS;
+	batch = true;
+	// syncing every save would take longer than the edits, so each filesystem is synced once at the end
+	sync_on_save = false;
+	if (files.empty()) {
+		result = text_buffer->loadStream(STDIN_FILENO);
+		if (result == SUCCESS) {
+			result = runScript(lines);
+		}
+		if (result == SUCCESS && filter_result != SUCCESS) {
+			fprintf(stderr, "yadda: a filter failed\n");
+			result = filter_result;
+		}
+		Snapshot text = text_buffer->snapshot();
+		for (int i = 0; i < 2; i++) {
+			fwrite(text.data[i], 1, text.length[i], stdout);
+		}
+		fflush(stdout);
+	}
+	for (const char *file : files) {
+		filename = file;
+		buffers[current_buffer]->filename = file;
+		if (text_buffer->loadBuffer(filename) != SUCCESS) {
+			fprintf(stderr, "yadda: failed to open %s\n", file);
+			result = IO_ERROR;
+			continue;
+		}
+		if (runScript(lines) != SUCCESS) {
+			fprintf(stderr, "yadda: failed to save %s\n", file);
+			result = IO_ERROR;
+		}
+		if (filter_result != SUCCESS) {
+			fprintf(stderr, "yadda: a filter failed on %s\n", file);
+			result = filter_result;
+		}
+	}
+	syncFilesystems(files);
+	batch = false;
+	return result;
+}
+
+// runs the lines of a batch script on the current buffer, until the end or a :q
+Result Application::runScript(const std::vector<std::string> &lines) {
+	running = true;
+	modified = false;
+	save_result = SUCCESS;
+	filter_result = SUCCESS;
+	text_buffer->clearCursors();
+	for (size_t i = 0; i < lines.size() && running; i++) {
+		const std::string &line = lines[i];
+		if (line.empty()) {
+			continue;
+		}
+		if (line[0] == ':') {
+			command_length = std::min(line.size() - 1, sizeof(command) - 1);
+			memcpy(command, &line[1], command_length);
+			command[command_length] = '\0';
+			processCommand();
+			// the next line works on what the filter leaves
+			while (filter_engine.busy()) {
+				pollFilter(true);
+			}
+		} else {
+			dispatch(line.data(), line.size());
+			recordInput(input_length);
+			record_from = 0;
+		}
+		// every line starts from normal mode
+		if (mode != Mode::NORMAL) {
+			dispatch("\033", 1);
+			recordInput(input_length);
+			record_from = 0;
+		}
+	}
+	if (save_engine.busy()) {
+		saveFinished(save_engine.wait());
+	}
+	return save_result;
+}
+
 void Application::run() {
 	running = true;
-	while (running) {
+	text_buffer->getCursorPosition();
+	while (running && !Terminal::finished()) {
 		processInput();
+		uint64_t now = Logger::now();
+		for (std::unique_ptr<BufferEntry> &entry : buffers) {
+			if (entry->text_buffer) {
+				entry->text_buffer->flushSwap(now);
+			}
+		}
+		if (following) {
+			pollFollow();
+		} else if (!filter_engine.busy()) {
+			pollChanges();
+		}
+		if (filter_engine.busy()) {
+			pollFilter();
+		}
+		Result result;
+		if (save_engine.poll(result)) {
+			saveFinished(result);
+			text_buffer->getCursorPosition();
+		}
+	}
+	if (save_engine.busy()) {
+		saveFinished(save_engine.wait());
+	}
+	const char *stats_file = getenv("YADDA_STATS");
+	if (stats_file != nullptr) {
+		Trace::writeJson(stats_file);
 	}
 }
 
-void Application::updateModeline() {
-	std::string mode_string = MODE_STRINGS[static_cast<int>(mode)];
-	std::string filename_string = " " + filename + " ";
-	for (unsigned long i = 0; i < mode_string.length(); i++) {
-		modeline.contents[i] = Character{CharColor::BLACK, MODE_COLORS[static_cast<int>(mode)], {mode_string[i]}};
+Result Application::save() {
+	// a replay shouldn't write over the file it was recorded on
+	if (Terminal::replaying()) {
+		Logger::info("not saving during a replay");
+		return SUCCESS;
 	}
-	for (unsigned long i = 0; i < filename_string.length(); i++) {
-		modeline.contents[i + mode_string.length()] = Character{MODE_COLORS[static_cast<int>(mode)], CharColor::BLACK, {filename_string[i]}};
+	Result result = text_buffer->saveFile(save_engine, filename, sync_on_save);
+	if (result != SUCCESS) {
+		save_result = result;
 	}
-	unsigned int modified_length = 0;
-	if (modified) {
-		modified_length = 3;
-		char mod_string[] = "[+]";
-		for (unsigned long i = 0; i < 3; i++) {
-			modeline.contents[i + mode_string.length() + filename_string.length()] =
-				Character{MODE_COLORS[static_cast<int>(mode)], CharColor::BLACK, {mod_string[i]}};
+	return result;
+}
+
+void Application::saveFinished(Result result) {
+	if (result != SUCCESS) {
+		Logger::error("failed to save file!");
+		save_result = result;
+		return;
+	}
+	debug("wrote to ", save_engine.filename.c_str());
+	// the buffer may not be current any more, or may have been evicted
+	BufferEntry *entry = findBuffer(save_engine.filename);
+	if (entry != nullptr && entry != buffers[current_buffer].get()) {
+		if (entry->text_buffer) {
+			entry->text_buffer->saved();
+		}
+		if (entry->text_buffer && entry->text_buffer->getEditCount() == save_engine.edit_count) {
+			entry->modified = false;
+		}
+		// what the watcher saw is from before the save
+		if (entry->watcher.watch(entry->filename) == SUCCESS) {
+			entry->watcher.stop();
 		}
+		return;
+	}
+	if (save_engine.filename == filename) {
+		text_buffer->saved();
+	}
+	// the save replaced the file, so that's the one to watch now
+	if (save_engine.filename == filename && !following) {
+		watchFile();
+	}
+	// edits made while the save was running still need saving
+	if (modified && text_buffer->getEditCount() == save_engine.edit_count) {
+		modified = false;
+		updateModeline();
+	}
+}
+
+void Application::updateModeline() {
+	// a running macro draws it once, when it's done
+	if (macro_depth > 0) {
+		return;
+	}
+	CharColor color = MODE_COLORS[static_cast<int>(mode)];
+	unsigned int x = 0;
+	auto put = [&](const char *string, size_t length, CharColor fg, CharColor bg) {
+		for (size_t i = 0; i < length && x < modeline.width; i++) {
+			modeline.contents[x++] = Character{fg, bg, {string[i]}};
+		}
+	};
+	const char *mode_string = MODE_STRINGS[static_cast<int>(mode)];
+	put(mode_string, strlen(mode_string), CharColor::BLACK, color);
+	put(" ", 1, color, CharColor::BLACK);
+	put(filename.data(), filename.length(), color, CharColor::BLACK);
+	put(" ", 1, color, CharColor::BLACK);
+	if (modified) {
+		put("[+]", 3, color, CharColor::BLACK);
+	}
+	if (following) {
+		put("[follow]", 8, color, CharColor::BLACK);
+	}
+	if (filter_engine.busy()) {
+		put("[filtering]", 11, color, CharColor::BLACK);
+	}
+	if (recording != '\0') {
+		char recording_string[] = "[recording @?]";
+		recording_string[sizeof(recording_string) - 3] = recording;
+		put(recording_string, sizeof(recording_string) - 1, color, CharColor::BLACK);
+	}
+	shown_cursors = text_buffer != nullptr ? text_buffer->cursorCount() : 1;
+	if (shown_cursors > 1) {
+		char cursors[32];
+		int length = snprintf(cursors, sizeof(cursors), "[%zu cursors]", shown_cursors);
+		put(cursors, length, color, CharColor::BLACK);
 	}
 	Character c;
-	for (unsigned int i = mode_string.length() + filename_string.length() // comment
-		 + modified_length; i < modeline.width - 1; i++) {
-		modeline.contents[i] = c;
+	for (; x < modeline.width - 1; x++) {
+		modeline.contents[x] = c;
 	}
 	modeline.draw();
 }
 
+// a bar in insert mode, an underline in replace mode and a block otherwise
+void Application::showCursorShape() {
+	if (macro_depth > 0) {
+		return;
+	}
+	Terminal::print(mode == Mode::INSERT ? "\033[5 q" : mode == Mode::REPLACE ? "\033[3 q" : "\033[1 q");
+	Terminal::flush();
+}
+
 void Application::processInput() {
-	text_buffer->getCursorPosition();
-	long length = read(STDIN_FILENO, input, 4095);
-	input[length] = '\0';
-	if (length == 0) {
+	long length = Terminal::read(input, sizeof(input) - 1);
+	if (length < 0) {
+		length = 0;
+	}
+	// an empty read still has to end a sequence left pending
+	if (length == 0 && !keymaps[static_cast<int>(mode)].pending()) {
 		return;
 	}
-	bool handled;
-	switch (mode) {
-		case Mode::NORMAL: handled = processNormalInput(); break;
-		case Mode::INSERT: handled = processInsertInput(); break;
-		case Mode::SELECT: handled = processSelectInput(); break;
-		case Mode::REPLACE: handled = processReplaceInput(); break;
-		case Mode::COMMAND: handled = processCommandInput(); break;
+	input[length] = '\0';
+	Trace::beginKey();
+	uint64_t allocations = AllocStats::count;
+	Mode key_mode = mode;
+
+	{
+		Trace::Scope scope(TRACE_DISPATCH);
+		if (overlay_shown) {
+			overlay_shown = false;
+			text_buffer->redraw();
+		}
+		dispatch(input, length);
+	}
+	recordInput(input_length);
+	record_from = 0;
+	text_buffer->getCursorPosition();
+	Trace::endKey(key_mode == Mode::INSERT);
+
+	// the first key in each mode warms up the buffers it uses
+	int mode_index = static_cast<int>(key_mode);
+	if (mode_keys[mode_index]++ > 0 && AllocStats::count != allocations) {
+		allocating_keys[mode_index]++;
+	}
+}
+
+/*
+ * Draws the latency histograms over the top of the text area, until
+ * the next key redraws it.
+ */
+void Application::showStats() {
+	char line[256];
+	unsigned short x = 0, y = 0;
+	int length = snprintf(line, sizeof(line), "%-10s %8s %9s %9s %9s %9s %9s   (us)",
+		"", "count", "p50", "p90", "p99", "p99.9", "max");
+	stats_frame.loadString(line, length, x, y, CharColor::BLACK, CharColor::GREEN);
+	for (unsigned int i = 0; i < TRACE_COUNT && i + 1 < stats_frame.height; i++) {
+		const Histogram &histogram = Trace::histogram((TracePoint)i);
+		length = snprintf(line, sizeof(line), "%-10s %8llu %9.1f %9.1f %9.1f %9.1f %9.1f",
+			TRACE_POINT_NAMES[i], (unsigned long long)histogram.count,
+			histogram.percentile(50) / 1000.0, histogram.percentile(90) / 1000.0,
+			histogram.percentile(99) / 1000.0, histogram.percentile(99.9) / 1000.0,
+			histogram.max / 1000.0);
+		x = 0;
+		y = i + 1;
+		stats_frame.loadString(line, length, x, y, CharColor::GREEN, CharColor::BLACK);
+	}
+	stats_frame.draw();
+	overlay_shown = true;
+}
+
+// bytes that insert mode types, and command mode appends, when unbound
+static bool selfInserts(Mode mode, uint8_t byte) {
+	if (mode == Mode::INSERT) {
+		return (byte >= 0x20 && byte != 0x7F) || byte == '\t';
 	}
-	if (handled == false) {
-		processGlobalInput();
+	if (mode == Mode::COMMAND) {
+		return byte >= 0x20 && byte != 0x7F;
 	}
+	return false;
 }
 
-const char base_64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static int base64Value(char c) {
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return -1;
+}
 
-void toBytes(const char *base_64, char *bytes) {
-	int index = 0;
-	for (int i = 0; base_64[i] != '\0' && base_64[i] != '=' && base_64[i] != '\\'; i++) {
-		char byte = 0;
-		for (; (unsigned long)byte < sizeof(base_64_chars) - 1; byte++) {
-			if (base_64_chars[(int)byte] == base_64[i]) {
-				break;
+/*
+ * Puts the text of the register that was named in at the cursor, count
+ * times. This is the only time the bytes of a register are copied.
+ */
+void Application::pasteRegister() {
+	// its own reference, the storage it shares has to outlive the inserts
+	Snapshot text = registers[register_name - 'a'];
+	register_name = '\0';
+	for (size_t steps = takeCount(); steps > 0 && !text.empty(); steps--) {
+		for (int i = 0; i < 2; i++) {
+			if (text.length[i] > 0) {
+				markModified(text_buffer->insert(text.data[i], text.length[i]));
 			}
 		}
-		if (i % 4 == 0) {
-			bytes[index] = (byte << 2) & 0b11111100;
-		} else if (i % 4 == 1) {
-			bytes[index] |= (byte >> 4) & 0b00000011;
-			// debug(bytes[index]);
-			index++;
-			bytes[index] = (byte << 4) & 0b11110000;
-		} else if (i % 4 == 2) {
-			bytes[index] |= (byte >> 2) & 0b00001111;
-			// debug(bytes[index]);
-			index++;
-			bytes[index] = (byte << 6) & 0b11000000;
-		} else if (i % 4 == 3) {
-			bytes[index] |= byte & 0b00111111;
-			// debug(bytes[index]);
-			index++;
-		}
-	}
-	bytes[index] = '\0';
-}
-
-bool Application::processNormalInput() {
-	switch (input[0]) {
-		case 'j': {
-			if (command_number == "") {
-				text_buffer->down(1);
-			} else {
-				text_buffer->down(std::stoul(command_number, nullptr));
-				command_number = "";
+	}
+}
+
+// adds what was read up to end to the macro being recorded
+void Application::recordInput(size_t end) {
+	if (recording != '\0' && end > record_from) {
+		macro.append(input_bytes + record_from, end - record_from);
+	}
+	record_from = end;
+}
+
+/*
+ * Ends the recording, into the register it was started with, leaving
+ * out the last keys, which stopped it.
+ */
+void Application::stopRecording(size_t keys) {
+	recordInput(input_position);
+	macro.resize(macro.size() - std::min(keys, macro.size()));
+	registers[recording - 'a'] = Snapshot::copyOf(macro.data(), macro.size());
+	recording = '\0';
+}
+
+/*
+ * Keeps text in a register. A slice of a buffer keeps all of the
+ * storage it's in alive, which a few bytes aren't worth, so selections
+ * under REGISTER_COPY_SIZE are copied, and only big ones are shared.
+ */
+void Application::setRegister(char name, const Snapshot &text) {
+	registers[name - 'a'] = text.size() < REGISTER_COPY_SIZE ? Snapshot::copyOf(text) : text;
+}
+
+/*
+ * Runs the keys in a register times times, as if they had been typed,
+ * but with drawing held until the last one is done, so running a
+ * macro over thousands of lines draws one frame instead of thousands.
+ */
+void Application::runMacro(char name, size_t times) {
+	if (macro_depth >= MAX_MACRO_DEPTH) {
+		Logger::warn("macros are nested too deep");
+		return;
+	}
+	// in one piece, so no key sequence is split where the register's spans meet
+	const Snapshot &text = registers[name - 'a'];
+	std::string keys(text.size(), '\0');
+	text.copy(0, keys.size(), keys.data());
+	const char *saved_bytes = input_bytes;
+	size_t saved_position = input_position;
+	size_t saved_length = input_length;
+	macro_depth++;
+	Frame::held = true;
+	for (; times > 0 && !keys.empty() && running; times--) {
+		dispatch(keys.data(), keys.size());
+	}
+	macro_depth--;
+	input_bytes = saved_bytes;
+	input_position = saved_position;
+	input_length = saved_length;
+	if (macro_depth == 0) {
+		// a batch run never draws
+		Frame::held = batch;
+		updateModeline();
+		showCursorShape();
+		text_buffer->redraw();
+		command_line.draw();
+	}
+}
+
+/*
+ * Feeds the bytes read to the current mode's keymap. Runs of plain
+ * text in insert and command mode skip the keymap and go in whole.
+ * Actions can switch modes, so every byte goes to the keymap of the
+ * mode at the time, and can consume more input themselves by moving
+ * input_position along. bytes is either what was read, or the keys of
+ * a macro.
+ */
+void Application::dispatch(const char *bytes, size_t length) {
+	input_bytes = bytes;
+	input_length = length;
+	input_position = 0;
+	while (input_position < input_length) {
+		Keymap &keymap = keymaps[static_cast<int>(mode)];
+		uint8_t byte = input_bytes[input_position];
+		// 'q' starts "qa" too, so the keymap would hold on to it and take the next key with it
+		if (byte == 'q' && recording != '\0' && mode == Mode::NORMAL && macro_depth == 0 && !keymap.pending()) {
+			stopRecording(0);
+			updateModeline();
+			input_position++;
+			continue;
+		}
+		if (!keymap.pending() && selfInserts(mode, byte) && !keymap.startsSequence(byte)) {
+			size_t run = 1;
+			while (input_position + run < input_length &&
+				selfInserts(mode, input_bytes[input_position + run]) && !keymap.startsSequence(input_bytes[input_position + run])) {
+				run++;
 			}
-		} break;
-		case 'k': {
-			if (command_number == "") {
-				text_buffer->up(1);
-			} else {
-				text_buffer->up(std::stoul(command_number, nullptr));
-				command_number = "";
+			insertText(&input_bytes[input_position], run);
+			input_position += run;
+			continue;
+		}
+		input_position++;
+		Action action = Action::NONE;
+		switch (keymap.feed(byte, action)) {
+			case KeyResult::PENDING: break;
+			case KeyResult::MATCHED: execute(action, keymap.last); break;
+			case KeyResult::MATCHED_BEFORE: {
+				input_position--;
+				execute(action, keymap.last);
+			} break;
+			case KeyResult::UNBOUND: unbound(keymap); break;
+		}
+	}
+	// terminals send escape sequences in one write, so one that is
+	// still pending once the read runs out was just the escape key
+	Keymap &keymap = keymaps[static_cast<int>(mode)];
+	if (keymap.pending() && (length == 0 || keymap.sequence[0] == '\033')) {
+		Action action = Action::NONE;
+		if (keymap.flush(action)) {
+			execute(action, keymap.last);
+		} else {
+			unbound(keymap);
+		}
+	}
+}
+
+// a sequence the keymap doesn't know, typed as text where text goes
+void Application::unbound(const Keymap &keymap) {
+	if (keymap.sequence[0] == '\033' || !selfInserts(mode, keymap.sequence[0])) {
+		debug("invalid input: ", keymap.sequence[0]);
+		return;
+	}
+	for (size_t i = 0; i < keymap.length; i++) {
+		if (selfInserts(mode, keymap.sequence[i])) {
+			insertText(&keymap.sequence[i], 1);
+		}
+	}
+}
+
+void Application::insertText(const char *text, size_t length) {
+	if (mode == Mode::INSERT) {
+		markModified(text_buffer->insert(text, length));
+		return;
+	}
+	if (mode != Mode::COMMAND) {
+		return;
+	}
+	for (size_t i = 0; i < length; i++) {
+		// the last byte stays free for the terminator
+		if (command_length + 2 < sizeof(command) && command_length + 1 < command_line.width) {
+			command[command_length++] = text[i];
+			command[command_length] = '\0';
+			command_line.contents[command_length] = Character{CharColor::GREEN, CharColor::BLACK, {text[i]}};
+		}
+	}
+	command_line.draw();
+}
+
+void Application::markModified(size_t char_diff) {
+	if (char_diff && !modified) {
+		modified = true;
+		updateModeline();
+	}
+}
+
+// actions that would change the text, which following a file or running a filter doesn't allow
+static bool editsText(Action action) {
+	switch (action) {
+		case Action::DELETE:
+		case Action::INSERT:
+		case Action::APPEND:
+		case Action::REPLACE:
+		case Action::PASTE:
+		case Action::PASTE_RESPONSE:
+		case Action::UNDO:
+		case Action::REDO:
+		case Action::DELETE_SELECTION:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// whether the buffer can't be edited right now, warning about it if so
+bool Application::editRefused() {
+	if (following) {
+		Logger::warn("the buffer is read-only while following the file");
+		return true;
+	}
+	// the filter's output goes in at offsets an edit would move
+	if (filter_engine.busy()) {
+		Logger::warn("the buffer can't be edited while a filter runs, Ctrl-C cancels it");
+		return true;
+	}
+	return false;
+}
+
+void Application::execute(Action action, uint8_t key) {
+	if (editsText(action) && editRefused()) {
+		return;
+	}
+	// everything typed in one go of insert mode is undone together, anything else on its own
+	// a running filter's output is undone in one go too
+	if (mode != Mode::INSERT && !filter_engine.busy()) {
+		text_buffer->sealUndo();
+	}
+	switch (action) {
+		case Action::NONE:
+		case Action::COUNT: break;
+		case Action::COUNT_DIGIT: {
+			if (key >= '0' && key <= '9') {
+				count = std::min<size_t>(count * 10 + key - '0', MAX_COUNT);
 			}
 		} break;
-		case 'h': {
-			if (command_number.empty()) {
-				text_buffer->retreat(1);
-			} else {
-				text_buffer->retreat(std::stoul(command_number, nullptr));
-				command_number = "";
+		case Action::DOWN: text_buffer->down(takeCount()); break;
+		case Action::UP: text_buffer->up(takeCount()); break;
+		case Action::LEFT: text_buffer->retreat(takeCount()); break;
+		case Action::RIGHT: text_buffer->advance(takeCount()); break;
+		case Action::HOME: text_buffer->home(); break;
+		case Action::END: text_buffer->end(); break;
+		case Action::GOTO_LINE: {
+			if (count > 0) {
+				text_buffer->move(takeCount());
 			}
 		} break;
-		case 'l': {
-			if (command_number.empty()) {
-				text_buffer->advance(1);
-			} else {
-				text_buffer->advance(std::stoul(command_number, nullptr));
-				command_number = "";
+		case Action::MATCH_BRACKET: text_buffer->matchBracket(); break;
+		case Action::NEXT_VIEW: text_buffer->nextView(); break;
+		case Action::UNDO:
+		case Action::REDO: {
+			size_t edits = 0;
+			for (size_t steps = takeCount(); steps > 0; steps--) {
+				edits += action == Action::UNDO ? text_buffer->undo() : text_buffer->redo();
 			}
+			markModified(edits);
 		} break;
-		case 'y': {
+		case Action::YANK:
+		case Action::DELETE: {
 			mode = Mode::SELECT;
 			updateModeline();
-			command = "y";
+			select_command = action == Action::YANK ? Command::YANK : Command::DELETE;
 			text_buffer->beginSelection();
 		} break;
-		case 'p': {
-			printf("\033]52;c;?\033\\");
-			fflush(stdout);
+		case Action::PASTE: {
+			if (register_name != '\0') {
+				pasteRegister();
+				break;
+			}
+			// the clipboard's answer was recorded along with the macro, and a batch run has no clipboard
+			if (macro_depth > 0 || batch) {
+				break;
+			}
+			Terminal::print("\033]52;c;?\033\\");
+			Terminal::flush();
+		} break;
+		case Action::REGISTER: register_name = key; break;
+		case Action::CURSOR_MATCHES: text_buffer->addCursorsAtMatches(); break;
+		case Action::CURSOR_BELOW: text_buffer->addCursorsBelow(takeCount()); break;
+		case Action::RECORD_MACRO:
+		case Action::STOP_RECORDING: {
+			// a macro's keys can't start or stop a recording
+			if (macro_depth > 0) {
+				break;
+			}
+			// a key :map bound to it, 'q' itself is caught in dispatch
+			if (recording != '\0') {
+				stopRecording(1);
+			} else if (action == Action::RECORD_MACRO) {
+				recording = key;
+				macro.clear();
+				record_from = input_position;
+			}
+			updateModeline();
 		} break;
-		case 'a':
+		case Action::RUN_MACRO: runMacro(key, takeCount()); break;
+		case Action::APPEND:
 			text_buffer->advance(1);
 			[[fallthrough]];
-		case 'i': {
+		case Action::INSERT: {
 			mode = Mode::INSERT;
 			updateModeline();
-			printf("\033[5 q");
-			fflush(stdout);
-		} break;
-		case 'd': {
-			mode = Mode::SELECT;
-			updateModeline();
-			command = "d";
-			text_buffer->beginSelection();
+			showCursorShape();
 		} break;
-		case 'r': {
+		case Action::REPLACE: {
 			mode = Mode::REPLACE;
 			updateModeline();
-			printf("\033[3 q");
-			fflush(stdout);
-		} break;
-		case 'm': {
-			if (!command_number.empty()) {
-				text_buffer->move(std::stoul(command_number, nullptr));
-				command_number = "";
-			}
+			showCursorShape();
 		} break;
-		case ':': {
+		case Action::COMMAND: {
 			mode = Mode::COMMAND;
 			updateModeline();
 			command_line.contents[0] = Character{CharColor::GREEN, CharColor::BLACK, ":"};
 			command_line.draw();
 		} break;
-		case '0':
-		case '1':
-		case '2':
-		case '3':
-		case '4':
-		case '5':
-		case '6':
-		case '7':
-		case '8':
-		case '9':
-			command_number += input[0];
-			break;
-		default: {
-			return false;
-		}
-	}
-	return true;
-}
-
-bool Application::processInsertInput() {
-	size_t char_diff = 0;
-	switch (input[0]) {
-		case 27: {
-			if (strcmp(input, "\033[3~") == 0) {
-				char_diff = text_buffer->removeFront(1);
-			} else {
-				return false;
+		case Action::ESCAPE: {
+			// escape in normal mode drops the extra cursors, leaving insert mode keeps them
+			if (mode == Mode::NORMAL) {
+				text_buffer->clearCursors();
 			}
+			mode = Mode::NORMAL;
+			updateModeline();
+			showCursorShape();
+			clearCommand();
+			count = 0;
+			register_name = '\0';
+			select_command = Command::NONE;
+			text_buffer->cancelSelection();
+			command_line.draw();
 		} break;
-		default: {
-			if (!iscntrl(input[0])) {
-				char_diff = text_buffer->insert(input, 1);
-			} else if (input[0] == '\t') {
-				char_diff = text_buffer->insert(input, 1);
-			} else if (input[0] == 0x0D) {
-				size_t scope_count = text_buffer->scopeCount();
-				if (scope_count > 0) {
-					char ins_string[32] = "\n";
-					memset(&ins_string[1], (int)'\t', scope_count);
-					char_diff += text_buffer->insert(ins_string, scope_count + 1);
-				} else {
-					char_diff += text_buffer->insert("\n", 1);
-				}
-			} else if (input[0] == 127) {
-				char_diff = text_buffer->removeBack(1);
-			} else {
-				return false;
+		case Action::DELETE_FORWARD: markModified(text_buffer->removeFront(1)); break;
+		case Action::BACKSPACE: markModified(text_buffer->removeBack(1)); break;
+		case Action::NEWLINE: {
+			size_t scope_count = std::min<size_t>(text_buffer->scopeCount(), 30);
+			char ins_string[32] = "\n";
+			memset(&ins_string[1], (int)'\t', scope_count);
+			markModified(text_buffer->insert(ins_string, scope_count + 1));
+		} break;
+		case Action::CONFIRM_SELECTION: {
+			// confirming a delete edits the text, confirming a yank doesn't
+			if (select_command == Command::DELETE && editRefused()) {
+				break;
 			}
-		}
-	}
-	if (char_diff && !modified) {
-		modified = true;
-		updateModeline();
-	}
-	return true;
-}
-
-bool Application::processSelectInput() {
-	switch (input[0]) {
-		case 0x0D: {
-			if (command == "y") {
+			// a named register keeps the text here, otherwise it goes to the clipboard
+			if (select_command == Command::YANK && register_name != '\0') {
+				setRegister(register_name, text_buffer->selectedText());
+				text_buffer->cancelSelection();
+			} else if (select_command == Command::YANK) {
 				text_buffer->getSelection();
 				text_buffer->cancelSelection();
-			} else if (command == "d") {
+			} else if (select_command == Command::DELETE && register_name != '\0') {
+				setRegister(register_name, text_buffer->cutSelection());
+				text_buffer->cancelSelection();
+				modified = true;
+			} else if (select_command == Command::DELETE) {
 				text_buffer->getSelection();
 				text_buffer->deleteSelection();
 				text_buffer->cancelSelection();
 				modified = true;
 			}
+			register_name = '\0';
 			mode = Mode::NORMAL;
 			updateModeline();
-			command = "";
+			select_command = Command::NONE;
 		} break;
-		case 127: {
-			text_buffer->deleteSelection();
+		case Action::DELETE_SELECTION: {
+			if (register_name != '\0') {
+				setRegister(register_name, text_buffer->cutSelection());
+				register_name = '\0';
+			} else {
+				text_buffer->deleteSelection();
+			}
 			text_buffer->cancelSelection();
 			modified = true;
 			mode = Mode::NORMAL;
 			updateModeline();
-			command = "";
+			select_command = Command::NONE;
 		} break;
-		case 'j': {
-			if (command_number == "") {
-				text_buffer->down(1);
+		case Action::RUN_COMMAND: processCommand(); break;
+		case Action::COMMAND_BACKSPACE: {
+			command_line.contents[command_length] = Character{};
+			if (command_length == 0) {
+				mode = Mode::NORMAL;
+				updateModeline();
 			} else {
-				text_buffer->down(std::stoul(command_number, nullptr));
-				command_number = "";
+				command[--command_length] = '\0';
 			}
+			command_line.draw();
 		} break;
-		case 'k': {
-			if (command_number == "") {
-				text_buffer->up(1);
-			} else {
-				text_buffer->up(std::stoul(command_number, nullptr));
-				command_number = "";
+		case Action::PASTE_RESPONSE: pasteResponse(); break;
+		case Action::INTERRUPT: {
+			if (filter_engine.busy()) {
+				filter_engine.cancel();
+				finishFilter(false);
 			}
 		} break;
-		case 'h': {
-			if (command_number.empty()) {
-				text_buffer->retreat(1);
-			} else {
-				text_buffer->retreat(std::stoul(command_number, nullptr));
-				command_number = "";
+	}
+	// extra cursors also go away on their own, once the main one moves
+	if (text_buffer != nullptr && text_buffer->cursorCount() != shown_cursors) {
+		updateModeline();
+	}
+}
+
+/*
+ * The terminal's reply to a paste request: the rest of this read, and
+ * as many reads as it takes, are the clipboard in base 64, up to the
+ * ST or BEL that ends it. Decodes as it goes, so the reads can split
+ * it anywhere.
+ */
+void Application::pasteResponse() {
+	char bytes[sizeof(input)];
+	uint32_t bits = 0;
+	int bit_count = 0;
+	bool ended = false;
+	while (true) {
+		size_t byte_count = 0;
+		for (; input_position < input_length && !ended; input_position++) {
+			char c = input_bytes[input_position];
+			if (c == '\033' || c == '\a') {
+				ended = true;
+				if (c == '\033' && input_position + 1 < input_length && input_bytes[input_position + 1] == '\\') {
+					input_position++;
+				}
+				continue;
+			}
+			int value = base64Value(c);
+			if (value < 0) {
+				continue;
+			}
+			bits = ((bits << 6) | value) & 0xFFFF;
+			bit_count += 6;
+			if (bit_count >= 8) {
+				bit_count -= 8;
+				bytes[byte_count++] = bits >> bit_count;
+			}
+		}
+		if (byte_count > 0) {
+			text_buffer->insert(bytes, byte_count);
+			markModified(byte_count);
+		}
+		// a macro has the whole response in its keys, and a batch run has no terminal to read more from
+		if (ended || macro_depth > 0 || batch) {
+			return;
+		}
+		recordInput(input_length);
+		record_from = 0;
+		long length = Terminal::read(input, sizeof(input) - 1, true);
+		if (length <= 0) {
+			input_position = input_length = 0;
+			return;
+		}
+		input_bytes = input;
+		input_position = 0;
+		input_length = length;
+	}
+}
+
+/*
+ * :map {mode} {keys} {action}, binds keys in a mode on top of the
+ * compiled keymap.
+ */
+Result Application::mapKeys(const char *argument) {
+	const char *keys = strchr(argument, ' ');
+	if (keys == nullptr) {
+		return INVALID_INPUT;
+	}
+	int mode_index = -1;
+	for (int i = 0; i < 5; i++) {
+		if (strlen(MODE_NAMES[i]) == (size_t)(keys - argument) && memcmp(MODE_NAMES[i], argument, keys - argument) == 0) {
+			mode_index = i;
+		}
+	}
+	keys++;
+	const char *name = strchr(keys, ' ');
+	if (mode_index < 0 || name == nullptr) {
+		return INVALID_INPUT;
+	}
+	name++;
+	Action action = internAction(name, strlen(name));
+	char bytes[Keymap::MAX_SEQUENCE];
+	size_t length = Keymap::parseKeys(keys, bytes, sizeof(bytes));
+	if (action == Action::COUNT || length == 0) {
+		return INVALID_INPUT;
+	}
+	return keymaps[mode_index].map(bytes, length, action);
+}
+
+// commands that need the buffer to stay as it is, which a running filter doesn't allow
+static bool waitsForFilter(Command command) {
+	switch (command) {
+		case Command::WRITE:
+		case Command::WRITE_QUIT:
+		case Command::EDIT:
+		case Command::FOLLOW:
+		case Command::BUFFER:
+		case Command::NEXT_BUFFER:
+		case Command::PREVIOUS_BUFFER:
+		case Command::FILTER:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void Application::processCommand() {
+	const char *argument = nullptr;
+	Command name = internCommand(command, command_length, argument);
+	if (filter_engine.busy() && waitsForFilter(name)) {
+		Logger::warn("wait for the filter to finish, or Ctrl-C to cancel it");
+		clearCommand();
+		mode = Mode::NORMAL;
+		updateModeline();
+		command_line.draw();
+		return;
+	}
+	switch (name) {
+		case Command::WRITE: {
+			save();
+		} break;
+		case Command::QUIT: {
+			running = false;
+		} break;
+		case Command::WRITE_QUIT: {
+			if (save() == SUCCESS) {
+				saveFinished(save_engine.wait());
+			}
+			running = false;
+		} break;
+		case Command::STATS: {
+			if (*argument == '\0') {
+				showStats();
+			} else if (strcmp(argument, "reset") == 0) {
+				Trace::reset();
+			} else if (Trace::writeJson(argument) != SUCCESS) {
+				Logger::error("failed to write the stats!");
 			}
 		} break;
-		case 'l': {
-			if (command_number.empty()) {
-				text_buffer->advance(1);
+		case Command::MAP: {
+			if (mapKeys(argument) != SUCCESS) {
+				Logger::text<LogLevel::WARN>("bad mapping", argument);
+			}
+		} break;
+		case Command::FOLLOW: {
+			if (following) {
+				stopFollowing();
 			} else {
-				text_buffer->advance(std::stoul(command_number, nullptr));
-				command_number = "";
+				follow();
 			}
 		} break;
-		case 'm': {
-			if (!command_number.empty()) {
-				text_buffer->move(std::stoul(command_number, nullptr));
-				command_number = "";
+		case Command::EDIT: {
+			stopFollowing();
+			// the same file again only needs what changed
+			if (argument[0] == '\0' || filename == argument) {
+				reload();
+				break;
+			}
+			openBuffer(argument);
+		} break;
+		case Command::LIST_BUFFERS: {
+			showBuffers();
+		} break;
+		case Command::BUFFER: {
+			char *end;
+			unsigned long number = strtoul(argument, &end, 10);
+			if (end == argument || number == 0 || switchBuffer(number - 1) == OUT_OF_BOUNDS) {
+				Logger::text<LogLevel::WARN>("no such buffer", argument);
+			}
+		} break;
+		case Command::NEXT_BUFFER: {
+			switchBuffer((current_buffer + 1) % buffers.size());
+		} break;
+		case Command::PREVIOUS_BUFFER: {
+			switchBuffer((current_buffer + buffers.size() - 1) % buffers.size());
+		} break;
+		case Command::SPLIT: {
+			text_buffer->split(false);
+		} break;
+		case Command::VERTICAL_SPLIT: {
+			text_buffer->split(true);
+		} break;
+		case Command::CLOSE_VIEW: {
+			text_buffer->closeView();
+		} break;
+		case Command::ONLY_VIEW: {
+			text_buffer->onlyView();
+		} break;
+		case Command::FILTER: {
+			Result result = startFilter(argument);
+			if (result != SUCCESS) {
+				Logger::text<LogLevel::WARN>("couldn't filter through", argument);
+				filter_result = result;
 			}
 		} break;
-		case '0':
-		case '1':
-		case '2':
-		case '3':
-		case '4':
-		case '5':
-		case '6':
-		case '7':
-		case '8':
-		case '9':
-			command_number += input[0];
-			break;
 		default: {
-			return false;
-		}
+			Logger::text<LogLevel::WARN>("unknown command", command);
+		} break;
 	}
-	return true;
+	clearCommand();
+	mode = Mode::NORMAL;
+	updateModeline();
+	command_line.draw();
 }
 
-bool Application::processReplaceInput() {
-	switch (input[0]) {
-		default: {
-			return false;
+/*
+ * :{range}!cmd, replaces the lines in the range with what they come out
+ * of cmd as. The lines are handed to cmd straight from the buffer's
+ * storage, and its output goes in after them as it arrives while the
+ * editor carries on, so nothing the size of the range is copied. The
+ * lines only go once cmd exits successfully. Until then the buffer
+ * can't be edited, and Ctrl-C cancels.
+ */
+Result Application::startFilter(const char *shell_command) {
+	if (following) {
+		Logger::warn("the buffer is read-only while following the file");
+		return INVALID_INPUT;
+	}
+	if (*shell_command == '\0') {
+		return INVALID_INPUT;
+	}
+	size_t first, last;
+	parseRange(command, text_buffer->getCursorLine(), first, last);
+	filter_start = text_buffer->lineOffset(first);
+	filter_end = last == SIZE_MAX ? text_buffer->fileSize() : text_buffer->lineOffset(last + 1);
+	filter_inserted = 0;
+	text_buffer->clearCursors();
+	text_buffer->sealUndo();
+	std::vector<iovec> segments;
+	std::shared_ptr<const void> keep_alive;
+	text_buffer->rangeSegments(filter_start, filter_end - filter_start, segments, keep_alive);
+	return filter_engine.start(shell_command, std::move(segments), std::move(keep_alive));
+}
+
+// puts in whatever the filter has written since the last poll, and finishes it once it's exited
+void Application::pollFilter(bool wait) {
+	bool done = filter_engine.take(filter_output, wait);
+	if (!filter_output.empty()) {
+		filter_inserted += text_buffer->insertAt(filter_end + filter_inserted, filter_output.data(), filter_output.size());
+		filter_output.clear();
+		if (!done) {
+			text_buffer->redraw();
 		}
 	}
-	return true;
+	if (done) {
+		finishFilter(filter_engine.status() == 0);
+	}
 }
 
-bool Application::processCommandInput() {
-	switch (input[0]) {
-		case 0x0D: processCommand(); break;
-		default: {
-			if (!iscntrl(input[0])) {
-				command += input[0];
-				command_line.contents[command.length()] = 
-					Character{CharColor::GREEN, CharColor::BLACK, {input[0]}};
-			} else if (input[0] == 127) {
-				command_line.contents[command.length()] = Character{};
-				if (command.length() == 0) {
-					mode = Mode::NORMAL;
-					updateModeline();
-				} else {
-					command.pop_back();
-				}
-			} else {
-				return false;
-			}
+/*
+ * Replaces the range with the output of a filter that succeeded, or
+ * takes its output back out otherwise, leaving the text as it was.
+ */
+void Application::finishFilter(bool succeeded) {
+	if (succeeded) {
+		markModified(text_buffer->removeAt(filter_start, filter_end - filter_start) + filter_inserted);
+	} else {
+		text_buffer->removeAt(filter_end, filter_inserted);
+		Logger::warn("the filter failed or was cancelled, the text is unchanged");
+		filter_result = IO_ERROR;
+	}
+	text_buffer->sealUndo();
+	filter_output.shrink_to_fit();
+	updateModeline();
+	text_buffer->redraw();
+}
+
+/*
+ * Follows the file like tail -f: jumps to the end, and from then on
+ * adds whatever gets appended to the file. Only works on an unmodified
+ * buffer, since the file is what's being shown.
+ */
+Result Application::follow() {
+	if (modified) {
+		Logger::warn("save the buffer before following the file");
+		return INVALID_INPUT;
+	}
+	Result result = watcher->watch(filename, text_buffer->fileSize());
+	if (result != SUCCESS) {
+		return result;
+	}
+	follow_buffer.resize(FOLLOW_READ_SIZE);
+	following = true;
+	text_buffer->jumpToEnd();
+	updateModeline();
+	return SUCCESS;
+}
+
+void Application::stopFollowing() {
+	if (!following) {
+		return;
+	}
+	following = false;
+	watchFile();
+	updateModeline();
+}
+
+/*
+ * Reads what was appended since the last poll, a bounded amount at a
+ * time so the editor stays responsive to a file that grows faster than
+ * it can be drawn. A truncated or replaced file, as log rotation
+ * leaves behind, is loaded again from the start.
+ */
+void Application::pollFollow() {
+	int events = watcher->poll();
+	if (events & (WATCH_CHANGED | WATCH_REPLACED)) {
+		Logger::info("the followed file was truncated or replaced, reloading it");
+		if (text_buffer->loadBuffer(filename) != SUCCESS || watcher->watch(filename, text_buffer->fileSize()) != SUCCESS) {
+			Logger::error("failed to reload the followed file!");
+			stopFollowing();
+			return;
 		}
+		text_buffer->jumpToEnd();
+		return;
+	}
+	if (!(events & WATCH_GREW)) {
+		return;
+	}
+	// every append moves the text after the cursor, so the whole poll goes in one
+	size_t total = 0;
+	while (total < FOLLOW_POLL_LIMIT) {
+		if (follow_buffer.size() < total + FOLLOW_READ_SIZE) {
+			follow_buffer.resize(total + FOLLOW_READ_SIZE);
+		}
+		size_t length = watcher->readAppended(&follow_buffer[total], FOLLOW_READ_SIZE);
+		if (length == 0) {
+			break;
+		}
+		total += length;
+	}
+	if (total == 0) {
+		return;
+	}
+	text_buffer->append(follow_buffer.data(), total);
+	text_buffer->redraw();
+	// a burst shouldn't hold on to a poll's worth of memory
+	if (follow_buffer.size() > FOLLOW_READ_SIZE) {
+		follow_buffer.resize(FOLLOW_READ_SIZE);
+		follow_buffer.shrink_to_fit();
 	}
-	command_line.draw();
-	return true;
 }
 
-void Application::processCommand() {
-	if (command == "w") {
-		FILE *file = fopen(filename.c_str(), "w");
-		if (file) {
-			text_buffer->saveFile(file);
-			fclose(file);
-			modified = false;
-			debug("wrote to ", filename.c_str());
-		}
-	} else if (command == "q") {
-		running = false;
-	} else if (command == "waq") {
-		FILE *file = fopen(filename.c_str(), "w");
-		text_buffer->saveFile(file);
-		fclose(file);
-		debug("wrote to ", filename.c_str());
-		running = false;
-	} else if (command[0] == 'e') {
-		std::string file_name = command.substr(2);
-		this->filename = file_name;
+// watches the file for changes made outside the editor, if there is one yet
+void Application::watchFile() {
+	// a batch run is gone before anything could change, and inotify is slow to set up and tear down
+	if (Terminal::headless()) {
+		return;
+	}
+	watcher->stop();
+	if (!filename.empty() && access(filename.c_str(), F_OK) == 0) {
+		watcher->watch(filename);
+	}
+}
+
+/*
+ * Reloads the file when something else changes it, as long as there
+ * are no edits that would be lost. Otherwise it only warns, once per
+ * change. Nothing is polled while a save is running, since the save
+ * changes the file too.
+ */
+void Application::pollChanges() {
+	if (save_engine.busy() || !watcher->watching()) {
+		return;
+	}
+	if (watcher->poll() == WATCH_NONE) {
+		return;
+	}
+	if (modified) {
+		Logger::warn("the file changed on disk, ':e' loads it and drops the edits");
+		watchFile();
+		return;
+	}
+	reload();
+}
+
+// loads the file again, only replacing what changed in it
+Result Application::reload() {
+	// watching first means a change made while reading shows up at the next poll
+	watchFile();
+	Result result = text_buffer->reload(filename);
+	if (result != SUCCESS) {
+		Logger::error("failed to reload the file!");
+		watcher->stop();
+		return result;
+	}
+	debug("reloaded ", filename.c_str());
+	modified = false;
+	updateModeline();
+	return SUCCESS;
+}
+
+/*
+ * Opens filename in a buffer of its own and switches to it, or just
+ * switches if it's already open. The empty buffer there is before any
+ * file is opened gets the file instead.
+ */
+Result Application::openBuffer(const std::string &filename) {
+	for (size_t i = 0; i < buffers.size(); i++) {
+		if (buffers[i]->filename == filename) {
+			return switchBuffer(i);
+		}
+	}
+	if (this->filename.empty() && !modified) {
 		Result result = text_buffer->loadBuffer(filename);
 		if (result != SUCCESS) {
 			Logger::error("failed to open file!");
+			return result;
 		}
+		this->filename = filename;
+		buffers[current_buffer]->filename = filename;
+		watchFile();
+		recover();
+		updateModeline();
+		return SUCCESS;
 	}
-	command = "";
-	for (unsigned int i = 0; i < command_line.width * command_line.height; i++) {
-		command_line.contents[i] = Character{};
+	auto entry = std::make_unique<BufferEntry>();
+	entry->filename = filename;
+	entry->text_buffer = std::make_unique<TextBuffer>(buffer_settings);
+	if (entry->text_buffer->loadBuffer(filename) != SUCCESS) {
+		Logger::error("failed to open file!");
+		return IO_ERROR;
 	}
-	mode = Mode::NORMAL;
+	buffers.push_back(std::move(entry));
+	Result result = switchBuffer(buffers.size() - 1);
+	if (result == SUCCESS) {
+		recover();
+		updateModeline();
+	}
+	return result;
+}
+
+// replays whatever edits an editor that died left in the file's swap journal
+void Application::recover() {
+	// a replay has to start from the file it was recorded on
+	if (Terminal::replaying()) {
+		return;
+	}
+	size_t edits = text_buffer->recover();
+	if (edits > 0) {
+		Logger::warn("recovered %lu unsaved edits from the swap file, 'u' undoes them", (unsigned long)edits);
+		modified = true;
+	}
+}
+
+/*
+ * Makes the buffer at index current. A resident buffer comes back
+ * exactly as it was left, with nothing read from disk unless the file
+ * changed meanwhile, an evicted one is loaded again at the line it
+ * was on.
+ */
+Result Application::switchBuffer(size_t index) {
+	if (index >= buffers.size()) {
+		return OUT_OF_BOUNDS;
+	}
+	if (index == current_buffer) {
+		return SUCCESS;
+	}
+	BufferEntry &entry = *buffers[index];
+	bool loaded = false;
+	if (!entry.text_buffer) {
+		entry.text_buffer = std::make_unique<TextBuffer>(buffer_settings);
+		if (entry.text_buffer->loadBuffer(entry.filename) != SUCCESS) {
+			Logger::error("failed to open file!");
+			entry.text_buffer.reset();
+			return IO_ERROR;
+		}
+		entry.text_buffer->move(entry.line);
+		loaded = true;
+	}
+	stopFollowing();
+	BufferEntry &previous = *buffers[current_buffer];
+	previous.modified = modified;
+	previous.watcher.stop();
+
+	current_buffer = index;
+	entry.last_used = ++buffer_clock;
+	text_buffer = entry.text_buffer.get();
+	filename = entry.filename;
+	modified = entry.modified;
+	watcher = &entry.watcher;
+	if (loaded) {
+		watchFile();
+	} else if (watcher->resume() != WATCH_NONE) {
+		if (modified) {
+			Logger::warn("the file changed on disk, ':e' loads it and drops the edits");
+		} else {
+			reload();
+		}
+	}
+	text_buffer->redraw();
 	updateModeline();
-	command_line.draw();
+	evictBuffers();
+	return SUCCESS;
 }
 
-bool Application::processGlobalInput() {
-	if (strcmp(input, "\033") == 0) {
-		mode = Mode::NORMAL;
-		updateModeline();
-		write(STDOUT_FILENO, "\033[1 q", sizeof("\033[1 q") - 1);
-		command = "";
-		for (unsigned int i = 0; i < command_line.width * command_line.height; i++) {
-			command_line.contents[i] = Character{};
+BufferEntry *Application::findBuffer(const std::string &filename) {
+	for (std::unique_ptr<BufferEntry> &entry : buffers) {
+		if (entry->filename == filename) {
+			return entry.get();
 		}
-		text_buffer->cancelSelection();
-		command_line.draw();
-	} else if (strcmp(input, "\033[H") == 0) {
-		text_buffer->home();
-	} else if (strcmp(input, "\033[F") == 0) {
-		text_buffer->end();
-	} else if (strcmp(input, "\033[A") == 0) {
-		text_buffer->up(1);
-	} else if (strcmp(input, "\033[B") == 0) {
-		text_buffer->down(1);
-	} else if (strcmp(input, "\033[C") == 0) {
-		text_buffer->advance(1);
-	} else if (strcmp(input, "\033[D") == 0) {
-		text_buffer->retreat(1);
-	} else if (strncmp(input, "\033]52;c;", sizeof("\033]52;c;") - 1) == 0) {
-		char buffer[4096] = {0};
-		size_t len = sizeof("\033]52;c;") - 1;
-		long length = strlen(input);
-		memmove(input, &input[len], 4095 - len);
-		length += read(STDIN_FILENO, &input[4095 - len], len - 3);
-		input[length] = '\0';
-		toBytes(input, buffer);
-		text_buffer->insert(buffer, strlen(buffer));
-		length = read(STDIN_FILENO, input, 4092);
-		while (length > 0) {
-			input[length] = '\0';
-			toBytes(input, buffer);
-			text_buffer->insert(buffer, strlen(buffer));
-			length = read(STDIN_FILENO, input, 4092);
+	}
+	return nullptr;
+}
+
+/*
+ * Evicts the least recently used buffers until the loaded ones fit
+ * under the memory cap. Only buffers that can be loaded again as they
+ * were are evicted: not the current one, any with unsaved edits, or
+ * one that's still being saved.
+ */
+void Application::evictBuffers() {
+	size_t total = 0;
+	for (std::unique_ptr<BufferEntry> &entry : buffers) {
+		if (entry->text_buffer) {
+			total += entry->text_buffer->memoryUsage();
 		}
-		modified = true;
-		updateModeline();
-	} else {
-		debug("invalid input: ", input);
 	}
-	return true;
-}
\ No newline at end of file
+	while (total > buffer_memory_cap) {
+		BufferEntry *victim = nullptr;
+		for (size_t i = 0; i < buffers.size(); i++) {
+			BufferEntry *entry = buffers[i].get();
+			if (i == current_buffer || !entry->text_buffer || entry->modified ||
+				(save_engine.busy() && save_engine.filename == entry->filename)) {
+				continue;
+			}
+			if (victim == nullptr || entry->last_used < victim->last_used) {
+				victim = entry;
+			}
+		}
+		if (victim == nullptr) {
+			return;
+		}
+		total -= victim->text_buffer->memoryUsage();
+		victim->line = victim->text_buffer->getCursorLine();
+		victim->text_buffer.reset();
+		debug("evicted ", victim->filename.c_str());
+	}
+}
+
+// draws the buffer list over the text, until the next key
+void Application::showBuffers() {
+	buffer_frame.height = std::min<size_t>(buffers.size(), buffer_settings.height);
+	if (buffer_frame.init() != SUCCESS) {
+		return;
+	}
+	char line[512];
+	for (size_t i = 0; i < buffer_frame.height; i++) {
+		const BufferEntry &entry = *buffers[i];
+		bool current = i == current_buffer;
+		bool modified = current ? this->modified : entry.modified;
+		size_t cursor_line = entry.text_buffer ? entry.text_buffer->getCursorLine() : entry.line;
+		int length = snprintf(line, sizeof(line), "%3zu %c %-3s \"%s\" line %zu%s", i + 1, current ? '%' : ' ',
+			modified ? "[+]" : "", entry.filename.c_str(), cursor_line, entry.text_buffer ? "" : " (evicted)");
+		unsigned short x = 0, y = i;
+		buffer_frame.loadString(line, std::min<size_t>(length, sizeof(line) - 1), x, y,
+			current ? CharColor::BLACK : CharColor::GREEN, current ? CharColor::GREEN : CharColor::BLACK);
+	}
+	buffer_frame.draw();
+	overlay_shown = true;
+}
+
+void Application::clearCommand() {
+	command_length = 0;
+	command[0] = '\0';
+	for (unsigned int i = 0; i < command_line.width * command_line.height; i++) {
+		command_line.contents[i] = Character{};
+	}
+}
+
+// the count typed before a key, or 1 if there wasn't one
+size_t Application::takeCount() {
+	size_t result = count > 0 ? count : 1;
+	count = 0;
+	return result;
+}
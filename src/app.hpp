@@ -2,10 +2,14 @@
 
 #include "defines.hpp"
 
+#include "file_watcher.hpp"
+#include "filter.hpp"
+#include "keymap.hpp"
 #include "text_buffer.hpp"
 
-#include <termios.h>
+#include <memory>
 #include <string>
+#include <vector>
 
 enum class Mode {
 	NORMAL,
@@ -15,34 +19,168 @@ enum class Mode {
 	COMMAND,
 };
 
+extern const char *MODE_STRINGS[];
+
+// commands, interned when a command line is run
+enum class Command {
+	NONE,
+	WRITE,
+	QUIT,
+	WRITE_QUIT,
+	EDIT,
+	STATS,
+	MAP,
+	FOLLOW,
+	LIST_BUFFERS,
+	BUFFER,
+	NEXT_BUFFER,
+	PREVIOUS_BUFFER,
+	SPLIT,
+	VERTICAL_SPLIT,
+	CLOSE_VIEW,
+	ONLY_VIEW,
+	YANK,
+	DELETE,
+	FILTER,
+};
+
+Command internCommand(const char *text, size_t length, const char *&argument);
+
+/* BufferEntry
+ * A file in the buffer list, kept in memory with its cursor and screen
+ * so switching to it doesn't touch the disk.
+ * text_buffer: the loaded buffer, or null once it's been evicted to
+ *   stay under the memory cap. It's loaded again, at line, when it's
+ *   switched to.
+ * watcher: watches the file while the buffer is current, and keeps
+ *   what it last saw otherwise, so changes made in the meantime show
+ *   up when the buffer is switched back to.
+ * modified: whether there are unsaved edits, kept while the buffer
+ *   isn't current. Modified buffers are never evicted.
+ * last_used: when the buffer was last current, the least recently
+ *   used buffers are evicted first.
+ */
+struct BufferEntry {
+	std::string filename;
+	std::unique_ptr<TextBuffer> text_buffer;
+	FileWatcher watcher;
+	bool modified = false;
+	size_t line = 1;
+	uint64_t last_used = 0;
+};
+
 class Application {
 public:
 	~Application();
 
 	Result init(const char *filename);
 	void run();
+	Result follow();
+	Result runBatch(const std::string &script, const std::vector<const char *> &files);
+	size_t allocatingKeys(Mode mode) { return allocating_keys[static_cast<int>(mode)]; }
 
 private:
 	void updateModeline();
+	void showCursorShape();
 	void processInput();
-	bool processNormalInput();
-	bool processInsertInput();
-	bool processSelectInput();
-	bool processReplaceInput();
-	bool processCommandInput();
+	void dispatch(const char *bytes, size_t length);
+	void recordInput(size_t end);
+	void stopRecording(size_t keys);
+	void setRegister(char name, const Snapshot &text);
+	void runMacro(char name, size_t times);
+	void execute(Action action, uint8_t key);
+	void unbound(const Keymap &keymap);
+	void insertText(const char *text, size_t length);
+	void pasteResponse();
+	void pasteRegister();
+	void markModified(size_t char_diff);
+	bool editRefused();
 	void processCommand();
-	bool processGlobalInput();
+	Result mapKeys(const char *argument);
+	void stopFollowing();
+	void pollFollow();
+	void watchFile();
+	void pollChanges();
+	Result reload();
+	void recover();
+	Result openBuffer(const std::string &filename);
+	Result switchBuffer(size_t index);
+	BufferEntry *findBuffer(const std::string &filename);
+	void evictBuffers();
+	void showBuffers();
+	Result runScript(const std::vector<std::string> &lines);
+	Result startFilter(const char *shell_command);
+	void pollFilter(bool wait = false);
+	void finishFilter(bool succeeded);
+	Result save();
+	void saveFinished(Result result);
+	void showStats();
+	void clearCommand();
+	size_t takeCount();
 
 	bool running = false;
 	Mode mode = Mode::NORMAL;
 	Frame modeline;
 	Frame command_line;
+	Frame stats_frame;
+	Frame buffer_frame;
+	// stats or the buffer list are drawn over the text until the next key
+	bool overlay_shown = false;
 
-	termios terminal_settings;
-	std::string command;
+	static constexpr size_t MAX_COUNT = 1000000000;
+	char command[256] = {0};
+	size_t command_length = 0;
+	Command select_command = Command::NONE;
+	// the registers a to z, each a slice of the buffer it was yanked from, or a copy if it's small
+	static constexpr size_t REGISTER_COPY_SIZE = 64 << 10;
+	Snapshot registers[26];
+	// the register named for the next yank, delete or paste, or '\0'
+	char register_name = '\0';
+	// the register a macro is being recorded into, or '\0', and its keys so far
+	char recording = '\0';
+	std::string macro;
+	// where in the last read the recording picks up
+	size_t record_from = 0;
+	// how many macros are running inside each other, drawing is held while any are
+	size_t macro_depth = 0;
+	static constexpr size_t MAX_MACRO_DEPTH = 100;
+	// running a script with no terminal, see runBatch
+	bool batch = false;
+	// how many cursors the modeline shows
+	size_t shown_cursors = 1;
 	std::string filename;
-	std::string command_number;
+	size_t count = 0;
+	TextBufferSettings buffer_settings;
+	std::vector<std::unique_ptr<BufferEntry>> buffers;
+	size_t current_buffer = 0;
+	uint64_t buffer_clock = 0;
+	size_t buffer_memory_cap = 0;
+	// the current buffer's
 	TextBuffer *text_buffer = nullptr;
+	SaveEngine save_engine;
+	bool sync_on_save = true;
+	// set by any save that fails, a batch run exits with it
+	Result save_result = SUCCESS;
+	// set by any filter that fails to run or exits with an error, which a batch run exits with too
+	Result filter_result = SUCCESS;
 	char input[4096] = {0};
+	// what dispatch is going through, input or the keys of a macro
+	const char *input_bytes = input;
+	size_t input_position = 0;
+	size_t input_length = 0;
+	Keymap keymaps[5];
 	bool modified = false;
+	static constexpr size_t FOLLOW_READ_SIZE = 1 << 16;
+	static constexpr size_t FOLLOW_POLL_LIMIT = 16 << 20;
+	FileWatcher *watcher = nullptr;
+	std::vector<char> follow_buffer;
+	bool following = false;
+	// a :{range}!cmd running, with the range it replaces and how much of its output is in so far
+	FilterEngine filter_engine;
+	std::vector<char> filter_output;
+	size_t filter_start = 0;
+	size_t filter_end = 0;
+	size_t filter_inserted = 0;
+	size_t mode_keys[5] = {0};
+	size_t allocating_keys[5] = {0};
 };
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include "block_diff.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <string_view>
+#include <unordered_map>
+
+constexpr size_t MIN_BLOCK = 2 << 10;
+constexpr size_t MAX_BLOCK = 64 << 10;
+// about one boundary every 8K
+constexpr uint64_t BOUNDARY_MASK = 0x1FFFull << 51;
+
+constexpr std::array<uint64_t, 256> makeGearTable() {
+	std::array<uint64_t, 256> table{};
+	uint64_t state = 0x9E3779B97F4A7C15ull;
+	for (uint64_t &value : table) {
+		// splitmix64
+		state += 0x9E3779B97F4A7C15ull;
+		uint64_t z = state;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		value = z ^ (z >> 31);
+	}
+	return table;
+}
+
+constexpr std::array<uint64_t, 256> GEAR = makeGearTable();
+
+struct Block {
+	size_t offset;
+	size_t length;
+	size_t hash;
+};
+
+static void cutBlocks(const char *data, size_t length, std::vector<Block> &blocks) {
+	size_t start = 0;
+	while (start < length) {
+		size_t end = std::min(length, start + MAX_BLOCK);
+		size_t cut = end;
+		uint64_t gear = 0;
+		for (size_t i = start + std::min(MIN_BLOCK, end - start); i < end; i++) {
+			gear = (gear << 1) + GEAR[(unsigned char)data[i]];
+			if ((gear & BOUNDARY_MASK) == 0) {
+				cut = i + 1;
+				break;
+			}
+		}
+		blocks.push_back(Block{start, cut - start, std::hash<std::string_view>{}(std::string_view(&data[start], cut - start))});
+		start = cut;
+	}
+}
+
+static void addEdit(const char *old_data, size_t old_offset, size_t old_end,
+	const char *new_data, size_t new_offset, size_t new_end, std::vector<BlockEdit> &edits) {
+	while (old_offset < old_end && new_offset < new_end && old_data[old_offset] == new_data[new_offset]) {
+		old_offset++;
+		new_offset++;
+	}
+	while (old_end > old_offset && new_end > new_offset && old_data[old_end - 1] == new_data[new_end - 1]) {
+		old_end--;
+		new_end--;
+	}
+	if (old_end > old_offset || new_end > new_offset) {
+		edits.push_back(BlockEdit{old_offset, old_end - old_offset, new_offset, new_end - new_offset});
+	}
+}
+
+void diffBlocks(const char *old_data, size_t old_length, const char *new_data, size_t new_length,
+	std::vector<BlockEdit> &edits) {
+	std::vector<Block> old_blocks, new_blocks;
+	cutBlocks(old_data, old_length, old_blocks);
+	cutBlocks(new_data, new_length, new_blocks);
+	std::unordered_map<size_t, std::vector<size_t>> positions;
+	for (size_t j = 0; j < new_blocks.size(); j++) {
+		positions[new_blocks[j].hash].push_back(j);
+	}
+	auto same = [&](size_t i, size_t j) {
+		const Block &a = old_blocks[i], &b = new_blocks[j];
+		return a.hash == b.hash && a.length == b.length && memcmp(&old_data[a.offset], &new_data[b.offset], a.length) == 0;
+	};
+
+	size_t i = 0, j = 0;
+	while (i < old_blocks.size() && j < new_blocks.size()) {
+		if (same(i, j)) {
+			i++;
+			j++;
+			continue;
+		}
+		// the next old block that turns up again later in the new text is where they line up again
+		size_t k = i, l = new_blocks.size();
+		for (; k < old_blocks.size(); k++) {
+			auto found = positions.find(old_blocks[k].hash);
+			if (found == positions.end()) {
+				continue;
+			}
+			auto next = std::lower_bound(found->second.begin(), found->second.end(), j);
+			if (next != found->second.end() && same(k, *next)) {
+				l = *next;
+				break;
+			}
+		}
+		size_t old_end = k < old_blocks.size() ? old_blocks[k].offset : old_length;
+		size_t new_end = l < new_blocks.size() ? new_blocks[l].offset : new_length;
+		addEdit(old_data, old_blocks[i].offset, old_end, new_data, new_blocks[j].offset, new_end, edits);
+		i = k;
+		j = l;
+	}
+	if (i < old_blocks.size() || j < new_blocks.size()) {
+		size_t old_start = i < old_blocks.size() ? old_blocks[i].offset : old_length;
+		size_t new_start = j < new_blocks.size() ? new_blocks[j].offset : new_length;
+		addEdit(old_data, old_start, old_length, new_data, new_start, new_length, edits);
+	}
+}
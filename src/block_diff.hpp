@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* BlockEdit
+ * Replaces old_length bytes at old_offset in the old text with the
+ * new_length bytes at new_offset in the new one.
+ */
+struct BlockEdit {
+	size_t old_offset;
+	size_t old_length;
+	size_t new_offset;
+	size_t new_length;
+};
+
+/*
+ * Finds the ranges that differ between two texts, by cutting both into
+ * content-defined blocks and matching up the blocks whose hashes (and
+ * bytes) agree. Block boundaries only depend on the bytes around them,
+ * so an insertion or deletion only changes the blocks it touches,
+ * instead of shifting every block after it. The edits come out in
+ * order, and each is trimmed to the bytes that actually differ.
+ */
+void diffBlocks(const char *old_data, size_t old_length, const char *new_data, size_t new_length,
+	std::vector<BlockEdit> &edits);
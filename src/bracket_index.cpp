@@ -0,0 +1,235 @@
+#include "bracket_index.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+
+void BracketIndex::summarize(const char *data, size_t length, int &delta, int &min) {
+	for (size_t i = 0; i < length; i++) {
+		switch (data[i]) {
+			case '(':
+			case '[':
+			case '{':
+				delta++;
+				break;
+			case ')':
+			case ']':
+			case '}':
+				delta--;
+				min = std::min(min, delta);
+				break;
+		}
+	}
+}
+
+uint32_t BracketIndex::newNode(GapBuffer &gap_buffer, size_t line) {
+	uint32_t node;
+	if (free_nodes.empty()) {
+		node = nodes.size();
+		nodes.emplace_back();
+	} else {
+		// a freed subtree gives up its root, its children are freed in its place
+		node = free_nodes.back();
+		free_nodes.pop_back();
+		if (nodes[node].left != NIL) {
+			free_nodes.push_back(nodes[node].left);
+		}
+		if (nodes[node].right != NIL) {
+			free_nodes.push_back(nodes[node].right);
+		}
+		nodes[node] = Node{};
+	}
+	// xorshift, treap priorities only need to be well spread
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	nodes[node].priority = seed;
+
+	const char *data[2];
+	size_t length[2];
+	int span_count = gap_buffer.get_line(line, data, length);
+	int delta = 0, min = 0;
+	for (int i = 0; i < span_count; i++) {
+		summarize(data[i], length[i], delta, min);
+	}
+	nodes[node].delta = delta;
+	nodes[node].min = min;
+	nodes[node].sum_delta = delta;
+	nodes[node].sum_min = min;
+	return node;
+}
+
+// frees the whole subtree at once, its nodes are only taken apart as newNode reuses them
+void BracketIndex::release(uint32_t node) {
+	if (node != NIL) {
+		free_nodes.push_back(node);
+	}
+}
+
+void BracketIndex::pull(uint32_t node) {
+	Node &n = nodes[node];
+	long left_delta = sumDelta(n.left);
+	n.size = 1 + size(n.left) + size(n.right);
+	n.sum_delta = left_delta + n.delta + sumDelta(n.right);
+	n.sum_min = std::min({sumMin(n.left), left_delta + n.min, left_delta + n.delta + sumMin(n.right)});
+}
+
+void BracketIndex::pullAll(uint32_t node) {
+	if (node == NIL) {
+		return;
+	}
+	pullAll(nodes[node].left);
+	pullAll(nodes[node].right);
+	pull(node);
+}
+
+/*
+ * Splits the lines of node into the first count lines, and the rest.
+ */
+void BracketIndex::split(uint32_t node, size_t count, uint32_t &left, uint32_t &right) {
+	if (node == NIL) {
+		left = right = NIL;
+		return;
+	}
+	if (size(nodes[node].left) < count) {
+		split(nodes[node].right, count - size(nodes[node].left) - 1, nodes[node].right, right);
+		left = node;
+	} else {
+		split(nodes[node].left, count, left, nodes[node].left);
+		right = node;
+	}
+	pull(node);
+}
+
+uint32_t BracketIndex::merge(uint32_t left, uint32_t right) {
+	if (left == NIL) return right;
+	if (right == NIL) return left;
+	if (nodes[left].priority > nodes[right].priority) {
+		nodes[left].right = merge(nodes[left].right, right);
+		pull(left);
+		return left;
+	}
+	nodes[right].left = merge(left, nodes[right].left);
+	pull(right);
+	return right;
+}
+
+/*
+ * Builds the treap in one pass, by keeping the right spine on a
+ * stack (the usual cartesian tree construction).
+ */
+void BracketIndex::build(GapBuffer &gap_buffer) {
+	nodes.clear();
+	free_nodes.clear();
+	size_t line_count = gap_buffer.line_count();
+	// leave room for new lines, so editing doesn't have to allocate
+	nodes.reserve(line_count + line_count / 8 + 1024);
+	free_nodes.reserve(64);
+	std::vector<uint32_t> spine;
+	for (size_t line = 0; line < line_count; line++) {
+		uint32_t node = newNode(gap_buffer, line);
+		uint32_t last = NIL;
+		while (!spine.empty() && nodes[spine.back()].priority < nodes[node].priority) {
+			last = spine.back();
+			spine.pop_back();
+		}
+		nodes[node].left = last;
+		if (!spine.empty()) {
+			nodes[spine.back()].right = node;
+		}
+		spine.push_back(node);
+	}
+	root = spine.empty() ? NIL : spine.front();
+	pullAll(root);
+}
+
+void BracketIndex::edit(GapBuffer &gap_buffer, size_t line, long line_delta) {
+	size_t removed = 1 + (line_delta < 0 ? -line_delta : 0);
+	size_t added = 1 + (line_delta > 0 ? line_delta : 0);
+	if (line + removed > size(root) || size(root) - removed + added != gap_buffer.line_count()) {
+		Logger::warn("bracket index lost track of the line count, rebuilding");
+		build(gap_buffer);
+		return;
+	}
+	uint32_t before, edited, after;
+	split(root, line, before, edited);
+	split(edited, removed, edited, after);
+	release(edited);
+	edited = NIL;
+	for (size_t i = 0; i < added; i++) {
+		edited = merge(edited, newNode(gap_buffer, line + i));
+	}
+	root = merge(merge(before, edited), after);
+}
+
+long BracketIndex::depthAt(size_t line) {
+	long depth = 0;
+	uint32_t node = root;
+	while (node != NIL) {
+		size_t left_size = size(nodes[node].left);
+		if (line <= left_size) {
+			if (line == left_size) {
+				return depth + sumDelta(nodes[node].left);
+			}
+			node = nodes[node].left;
+		} else {
+			depth += sumDelta(nodes[node].left) + nodes[node].delta;
+			line -= left_size + 1;
+			node = nodes[node].right;
+		}
+	}
+	return depth;
+}
+
+/*
+ * offset is the line number of the first line under node, and
+ * base is the depth at its start. Whole subtrees that never drop
+ * below target are skipped, which keeps the search logarithmic.
+ */
+size_t BracketIndex::findForward(uint32_t node, size_t offset, long base, size_t line, long target) {
+	if (node == NIL || offset + size(node) <= line) {
+		return NOT_FOUND;
+	}
+	if (offset >= line && base + sumMin(node) >= target) {
+		return NOT_FOUND;
+	}
+	const Node &n = nodes[node];
+	size_t result = findForward(n.left, offset, base, line, target);
+	if (result != NOT_FOUND) {
+		return result;
+	}
+	size_t index = offset + size(n.left);
+	long depth = base + sumDelta(n.left);
+	if (index >= line && depth + n.min < target) {
+		return index;
+	}
+	return findForward(n.right, index + 1, depth + n.delta, line, target);
+}
+
+size_t BracketIndex::findBackward(uint32_t node, size_t offset, long base, size_t line, long target) {
+	if (node == NIL || offset > line) {
+		return NOT_FOUND;
+	}
+	if (offset + size(node) <= line + 1 && base + sumMin(node) >= target) {
+		return NOT_FOUND;
+	}
+	const Node &n = nodes[node];
+	size_t index = offset + size(n.left);
+	long depth = base + sumDelta(n.left);
+	size_t result = findBackward(n.right, index + 1, depth + n.delta, line, target);
+	if (result != NOT_FOUND) {
+		return result;
+	}
+	if (index <= line && depth + n.min < target) {
+		return index;
+	}
+	return findBackward(n.left, offset, base, line, target);
+}
+
+size_t BracketIndex::findForward(size_t line, long target) {
+	return findForward(root, 0, 0, line, target);
+}
+
+size_t BracketIndex::findBackward(size_t line, long target) {
+	return findBackward(root, 0, 0, line, target);
+}
\ No newline at end of file
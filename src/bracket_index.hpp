@@ -0,0 +1,70 @@
+#pragma once
+
+#include "defines.hpp"
+#include "gap_buffer.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* BracketIndex
+ * Keeps a bracket summary for every line in an implicit treap
+ * (ordered by line number), so nesting queries don't have to scan
+ * the file. Brackets inside strings and comments are counted too.
+ * build: summarizes every line of the buffer.
+ * edit: resummarizes line, and the line_delta lines that were added
+ *   after it (or drops the ones that were removed).
+ * depthAt: nesting depth at the start of line. O(log n).
+ * findForward: the first line at or after line where the depth
+ *   drops below target. O(log n).
+ * findBackward: the last line at or before line where the depth
+ *   drops below target. O(log n).
+ * memoryUsage: the bytes the index holds on to.
+ * summarize: counts the brackets of a single line. delta is the
+ *   depth change across the line, min is the lowest depth reached
+ *   relative to the start of the line (never above 0).
+ */
+class BracketIndex {
+public:
+	static constexpr size_t NOT_FOUND = SIZE_MAX;
+
+	void build(GapBuffer &gap_buffer);
+	void edit(GapBuffer &gap_buffer, size_t line, long line_delta);
+	long depthAt(size_t line);
+	size_t findForward(size_t line, long target);
+	size_t findBackward(size_t line, long target);
+	size_t memoryUsage() const { return nodes.capacity() * sizeof(Node) + free_nodes.capacity() * sizeof(uint32_t); }
+
+	static void summarize(const char *data, size_t length, int &delta, int &min);
+
+private:
+	static constexpr uint32_t NIL = UINT32_MAX;
+
+	struct Node {
+		uint32_t left = NIL;
+		uint32_t right = NIL;
+		uint32_t priority = 0;
+		uint32_t size = 1;
+		int delta = 0;
+		int min = 0;
+		long sum_delta = 0;
+		long sum_min = 0;
+	};
+
+	uint32_t newNode(GapBuffer &gap_buffer, size_t line);
+	void release(uint32_t node);
+	void pull(uint32_t node);
+	void pullAll(uint32_t node);
+	void split(uint32_t node, size_t count, uint32_t &left, uint32_t &right);
+	uint32_t merge(uint32_t left, uint32_t right);
+	size_t findForward(uint32_t node, size_t offset, long base, size_t line, long target);
+	size_t findBackward(uint32_t node, size_t offset, long base, size_t line, long target);
+	size_t size(uint32_t node) { return node == NIL ? 0 : nodes[node].size; }
+	long sumDelta(uint32_t node) { return node == NIL ? 0 : nodes[node].sum_delta; }
+	long sumMin(uint32_t node) { return node == NIL ? 0 : nodes[node].sum_min; }
+
+	std::vector<Node> nodes;
+	std::vector<uint32_t> free_nodes;
+	uint32_t root = NIL;
+	uint32_t seed = 0x9E3779B9;
+};
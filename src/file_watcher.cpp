@@ -0,0 +1,139 @@
+#include "file_watcher.hpp"
+
+#include "logger.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Result FileWatcher::watch(const std::string &filename, size_t offset) {
+	stop();
+	file_fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (file_fd < 0) {
+		Logger::error("failed to open the file to watch!");
+		return IO_ERROR;
+	}
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0 || inotify_add_watch(inotify_fd, filename.c_str(),
+		IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+		Logger::error("failed to watch the file!");
+		stop();
+		return IO_ERROR;
+	}
+	struct stat info;
+	if (fstat(file_fd, &info) == 0) {
+		device = info.st_dev;
+		inode = info.st_ino;
+		size = info.st_size;
+		mtime = info.st_mtim;
+	}
+	this->filename = filename;
+	this->offset = offset == SIZE_MAX ? size : offset;
+	last_check = Logger::now();
+	return SUCCESS;
+}
+
+Result FileWatcher::watch(const std::string &filename) {
+	return watch(filename, SIZE_MAX);
+}
+
+void FileWatcher::stop() {
+	if (inotify_fd >= 0) {
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+	if (file_fd >= 0) {
+		close(file_fd);
+		file_fd = -1;
+	}
+}
+
+int FileWatcher::poll() {
+	if (inotify_fd < 0) {
+		return WATCH_NONE;
+	}
+	alignas(inotify_event) char events[4096];
+	int result = WATCH_NONE;
+	bool modified = false;
+	long length;
+	while ((length = read(inotify_fd, events, sizeof(events))) > 0) {
+		for (long i = 0; i < length;) {
+			const inotify_event *event = (const inotify_event *)&events[i];
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				result |= WATCH_REPLACED;
+			} else {
+				modified = true;
+			}
+			i += sizeof(inotify_event) + event->len;
+		}
+	}
+	uint64_t time = Logger::now();
+	if (!modified && time - last_check < CHECK_INTERVAL) {
+		return result;
+	}
+	last_check = time;
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0) {
+		return result;
+	}
+	return result | compare(info);
+}
+
+int FileWatcher::resume() {
+	if (filename.empty()) {
+		return WATCH_NONE;
+	}
+	dev_t last_device = device;
+	ino_t last_inode = inode;
+	size_t last_size = size;
+	timespec last_mtime = mtime;
+	if (watch(filename, offset) != SUCCESS) {
+		return WATCH_REPLACED;
+	}
+	struct stat info;
+	if (fstat(file_fd, &info) != 0) {
+		return WATCH_NONE;
+	}
+	device = last_device;
+	inode = last_inode;
+	size = last_size;
+	mtime = last_mtime;
+	return compare(info);
+}
+
+// what changed between the last stat and info, which becomes the last stat
+int FileWatcher::compare(const struct stat &info) {
+	int result = WATCH_NONE;
+	if (info.st_dev != device || info.st_ino != inode) {
+		result = WATCH_REPLACED;
+	} else if ((size_t)info.st_size > offset) {
+		result = WATCH_GREW;
+	} else if ((size_t)info.st_size < offset) {
+		result = WATCH_CHANGED;
+	} else if ((size_t)info.st_size != size || info.st_mtim.tv_sec != mtime.tv_sec || info.st_mtim.tv_nsec != mtime.tv_nsec) {
+		result = WATCH_TOUCHED;
+	}
+	device = info.st_dev;
+	inode = info.st_ino;
+	size = info.st_size;
+	mtime = info.st_mtim;
+	return result;
+}
+
+size_t FileWatcher::readAppended(char *buffer, size_t length) {
+	if (file_fd < 0) {
+		return 0;
+	}
+	long result = pread(file_fd, buffer, length, offset);
+	while (result < 0 && errno == EINTR) {
+		result = pread(file_fd, buffer, length, offset);
+	}
+	if (result <= 0) {
+		return 0;
+	}
+	offset += result;
+	return result;
+}
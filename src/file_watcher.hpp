@@ -0,0 +1,65 @@
+#pragma once
+
+#include "defines.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+enum WatchEvent {
+	WATCH_NONE = 0,
+	// bytes were added at the end
+	WATCH_GREW = 1,
+	// truncated, or rewritten in place
+	WATCH_CHANGED = 2,
+	// renamed or deleted, there may be a new file at the path
+	WATCH_REPLACED = 4,
+	// the same size, but written to since the last poll
+	WATCH_TOUCHED = 8,
+};
+
+/* FileWatcher
+ * Watches a file through inotify, so following it or noticing that
+ * something else changed it never has to poll the whole file.
+ * watch: starts watching filename, with the first offset bytes
+ *   already read, or all of them.
+ * poll: checks for changes without blocking, and returns a mask of
+ *   WatchEvents. Besides asking inotify, it compares the size and
+ *   mtime of the path every CHECK_INTERVAL, for filesystems that
+ *   inotify can't see changes on.
+ * resume: watches the file again after a stop, and returns what
+ *   changed while nothing was watching it.
+ * readAppended: reads up to length of the bytes past offset, and
+ *   moves offset along. Returns 0 once it has caught up.
+ */
+class FileWatcher {
+public:
+	~FileWatcher() { stop(); }
+
+	static constexpr uint64_t CHECK_INTERVAL = 1000000000;
+
+	Result watch(const std::string &filename, size_t offset);
+	Result watch(const std::string &filename);
+	void stop();
+	int poll();
+	int resume();
+	size_t readAppended(char *buffer, size_t length);
+	bool watching() const { return inotify_fd >= 0; }
+
+private:
+	int compare(const struct stat &info);
+
+	std::string filename;
+	int inotify_fd = -1;
+	int file_fd = -1;
+	size_t offset = 0;
+	// what the last stat saw
+	dev_t device = 0;
+	ino_t inode = 0;
+	size_t size = 0;
+	timespec mtime = {};
+	uint64_t last_check = 0;
+};
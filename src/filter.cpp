@@ -0,0 +1,193 @@
+#include "filter.hpp"
+
+#include "logger.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+FilterEngine::~FilterEngine() {
+	cancel();
+}
+
+Result FilterEngine::start(const std::string &command, std::vector<iovec> segments, std::shared_ptr<const void> keep_alive) {
+	cancel();
+	int input[2], output[2];
+	if (pipe2(input, O_CLOEXEC) != 0) {
+		Logger::error("failed to make a pipe for the filter!");
+		return IO_ERROR;
+	}
+	if (pipe2(output, O_CLOEXEC) != 0) {
+		Logger::error("failed to make a pipe for the filter!");
+		close(input[0]);
+		close(input[1]);
+		return IO_ERROR;
+	}
+	// fewer, bigger splices, if the system lets a pipe be that big
+	fcntl(input[1], F_SETPIPE_SZ, PIPE_SIZE);
+	fcntl(output[0], F_SETPIPE_SZ, PIPE_SIZE);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, input[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+	// anything it says would land on top of the screen
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	// its own process group, so cancelling stops a whole pipeline
+	posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attributes, 0);
+	const char *argv[] = {"/bin/sh", "-c", command.c_str(), nullptr};
+	int error = posix_spawn(&pid, "/bin/sh", &actions, &attributes, (char *const *)argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+	close(input[0]);
+	close(output[1]);
+	if (error != 0) {
+		Logger::error("failed to run the filter!");
+		pid = -1;
+		close(input[1]);
+		close(output[0]);
+		return IO_ERROR;
+	}
+
+	this->segments = std::move(segments);
+	this->keep_alive = std::move(keep_alive);
+	pending.clear();
+	done = false;
+	cancelled = false;
+	exit_status = -1;
+	running = true;
+	writer = std::thread([this, fd = input[1]]() { writeInput(fd); });
+	reader = std::thread([this, fd = output[0]]() { readOutput(fd); });
+	return SUCCESS;
+}
+
+/*
+ * Hands the input to the command, then closes its stdin. A command
+ * that stops reading early just ends the input there.
+ */
+void FilterEngine::writeInput(int fd) {
+	// a command that exits without reading shouldn't take the editor with it
+	sigset_t pipe_signal;
+	sigemptyset(&pipe_signal);
+	sigaddset(&pipe_signal, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+	bool splice = true;
+	for (iovec segment : segments) {
+		while (segment.iov_len > 0 && !cancelled) {
+			ssize_t written = splice ? vmsplice(fd, &segment, 1, 0) : write(fd, segment.iov_base, segment.iov_len);
+			if (written < 0 && errno == EINTR) {
+				continue;
+			}
+			if (written < 0 && splice && (errno == EINVAL || errno == ENOSYS)) {
+				splice = false;
+				continue;
+			}
+			if (written <= 0) {
+				close(fd);
+				return;
+			}
+			segment.iov_base = (char *)segment.iov_base + written;
+			segment.iov_len -= written;
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Reads what the command writes until it closes its stdout, then reaps
+ * it. Stops reading while there's more than OUTPUT_LIMIT waiting to be
+ * taken, which in turn stops the command once the pipe fills up.
+ */
+void FilterEngine::readOutput(int fd) {
+	std::unique_ptr<char[]> buffer = std::make_unique<char[]>(READ_SIZE);
+	while (true) {
+		ssize_t length = read(fd, buffer.get(), READ_SIZE);
+		if (length < 0 && errno == EINTR) {
+			continue;
+		}
+		if (length <= 0) {
+			break;
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return pending.size() < OUTPUT_LIMIT || cancelled; });
+		if (cancelled) {
+			break;
+		}
+		pending.insert(pending.end(), buffer.get(), buffer.get() + length);
+		changed.notify_all();
+	}
+	close(fd);
+	int wait_status = 0;
+	while (waitpid(pid, &wait_status, 0) < 0 && errno == EINTR) {
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	exit_status = WIFEXITED(wait_status) && !cancelled ? WEXITSTATUS(wait_status) : -1;
+	done = true;
+	changed.notify_all();
+}
+
+bool FilterEngine::take(std::vector<char> &output, bool wait) {
+	if (!running) {
+		return true;
+	}
+	std::unique_lock<std::mutex> lock(mutex);
+	if (wait) {
+		changed.wait(lock, [this]() { return !pending.empty() || done; });
+	}
+	output.insert(output.end(), pending.begin(), pending.end());
+	pending.clear();
+	changed.notify_all();
+	bool finished = done;
+	lock.unlock();
+	if (finished) {
+		finish();
+	}
+	return finished;
+}
+
+void FilterEngine::cancel() {
+	if (!running) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		cancelled = true;
+		changed.notify_all();
+	}
+	kill(-pid, SIGTERM);
+	for (int i = 0; i < 100; i++) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (done) {
+				break;
+			}
+		}
+		usleep(10000);
+	}
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!done) {
+		kill(-pid, SIGKILL);
+	}
+	lock.unlock();
+	finish();
+	exit_status = -1;
+}
+
+void FilterEngine::finish() {
+	writer.join();
+	reader.join();
+	running = false;
+	pid = -1;
+	segments.clear();
+	keep_alive.reset();
+	pending.clear();
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "defines.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* FilterEngine
+ * Runs a shell command over some text without blocking the editor, for
+ * :{range}!cmd. The text goes to the command's stdin through a pipe
+ * with vmsplice, which hands the pipe the pages of the buffer's storage
+ * instead of copying them, falling back to write where it can't. What
+ * the command writes to stdout is read as it comes, on another thread,
+ * for the editor to take in batches. Nothing goes through a temporary
+ * file.
+ * start: runs command with the bytes of segments as its input, with
+ *   keep_alive owning whatever they point at until it's done.
+ * take: moves whatever the command has written since the last take to
+ *   the end of output. Returns true once the command has exited and
+ *   there's nothing left to take. With wait, blocks until there's
+ *   something to take or the command is done.
+ * cancel: stops the command, with SIGTERM and, if it doesn't go within
+ *   a second, SIGKILL, and waits for it.
+ * status: the command's exit status, once take has returned true. -1
+ *   if it was cancelled, or didn't exit on its own.
+ * OUTPUT_LIMIT: how much output can wait to be taken before reading
+ *   stops, so a command can't outrun the editor by more than that.
+ */
+class FilterEngine {
+public:
+	~FilterEngine();
+
+	static constexpr size_t READ_SIZE = 1 << 20;
+	static constexpr size_t OUTPUT_LIMIT = 64 << 20;
+	static constexpr int PIPE_SIZE = 1 << 20;
+
+	Result start(const std::string &command, std::vector<iovec> segments, std::shared_ptr<const void> keep_alive);
+	bool take(std::vector<char> &output, bool wait = false);
+	void cancel();
+	bool busy() { return running; }
+	int status() { return exit_status; }
+
+private:
+	void writeInput(int fd);
+	void readOutput(int fd);
+	void finish();
+
+	std::thread writer;
+	std::thread reader;
+	pid_t pid = -1;
+	bool running = false;
+	std::atomic<bool> cancelled = false;
+	int exit_status = -1;
+	std::vector<iovec> segments;
+	std::shared_ptr<const void> keep_alive;
+
+	// shared with the reader thread
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::vector<char> pending;
+	bool done = false;
+};
@@ -1,20 +1,18 @@
 #include "gap_buffer.hpp"
 
+#include "line_cache.hpp"
 #include "logger.hpp"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <sys/stat.h>
 
 constexpr unsigned BLOCK_SIZE = 4096;
-
-GapBuffer::~GapBuffer() {
-	if (buffer) {
-		delete[] buffer;
-	}
-}
+// room to type into after loading a file, before the buffer has to grow
+constexpr size_t INITIAL_GAP = 16 * BLOCK_SIZE;
 
 Result GapBuffer::loadFile(const std::string &filename) {
-	assert(!buffer, NULL_ERROR, "buffer must be null!");
 	assert(filename != "", IO_ERROR, "filename must not be empty!");
 	
 	FILE *file = fopen(filename.c_str(), "r");
@@ -22,41 +20,80 @@ Result GapBuffer::loadFile(const std::string &filename) {
 		Logger::error("failed to open file!");
 		return IO_ERROR;
 	}
+	struct stat info;
+	fstat(fileno(file), &info);
 	fseek(file, 0, SEEK_END);
 	size_t len = (size_t)ftell(file);
 	fseek(file, 0, SEEK_SET);
 	
-	if (buffer) {
-		if (capacity < (len / BLOCK_SIZE + 1) * BLOCK_SIZE) {
-			delete[] buffer;
-			capacity = (len / BLOCK_SIZE + 1) * BLOCK_SIZE;
-			buffer = new char[capacity];
-		}
-		pre_cursor_lines.clear();
-		post_cursor_lines.clear();
+	char *data = beginLoad(len);
+	size_t read_length = fread(data, 1, len, file);
+	fclose(file);
+	LineCache cache;
+	if (read_length != len) {
+		Logger::error("failed to read file!");
+		memmove(&buffer[capacity - read_length], data, read_length);
 	} else {
-		capacity = (len / BLOCK_SIZE + 1) * BLOCK_SIZE;
-		buffer = new char[capacity];
+		cache.open(filename, info, data, len);
 	}
-	pre_cursor_index = fread(buffer, 1, len, file);
-	fclose(file);
+	endLoad(read_length, &cache);
+	cache.store(post_cursor_lines, read_length);
 	
-	post_cursor_index = capacity;
-	bool line_start = false;
+	return SUCCESS;
+}
+
+/*
+ * Makes room for length bytes of text and returns where to put them,
+ * at the very end of the buffer, after the gap.
+ */
+char *GapBuffer::beginLoad(size_t length) {
+	size_t new_capacity = (length + INITIAL_GAP + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	// the old storage can only be reused if no snapshot still sees it
+	if (!buffer || storage.use_count() > 1 || capacity < new_capacity) {
+		capacity = new_capacity;
+		storage.reset(new char[capacity]);
+		buffer = storage.get();
+	}
+	pre_cursor_lines.clear();
+	post_cursor_lines.clear();
+	return &buffer[capacity - length];
+}
+
+/*
+ * Indexes the lines of the text put in place after beginLoad, with
+ * the cursor at the start. A trailing newline doesn't start a line.
+ * Only the text past what the cache covers is scanned, the cached
+ * line starts go after the lines found there, nearest last.
+ */
+void GapBuffer::endLoad(size_t length, const LineCache *cache) {
+	pre_cursor_index = 0;
+	post_cursor_index = capacity - length;
 	pre_cursor_lines.push_back(0);
-	for (size_t i = 0; i < pre_cursor_index; i++) {
-		if (line_start) {
-			pre_cursor_lines.push_back(i);
-			line_start = false;
-		}
-		if (buffer[i] == '\n') {
-			line_start = true;
+	size_t cached_count = cache != nullptr ? cache->starts().size() : 0;
+	// the last byte the cache covers was never a line start, it may be now
+	size_t indexed = cache != nullptr && cache->indexed() > 0 ? cache->indexed() - 1 : 0;
+	post_cursor_lines.reserve(cached_count, cached_count);
+	for (size_t i = capacity - 1; i > post_cursor_index + indexed; i--) {
+		if (buffer[i - 1] == '\n') {
+			post_cursor_lines.push_back(capacity - i);
 		}
 	}
-	retreat(pre_cursor_index);
+	for (size_t i = cached_count; i-- > 0;) {
+		post_cursor_lines.push_back(length - cache->starts()[i]);
+	}
+	// lines move between the two sides as the cursor does, so both need room for all of them
+	pre_cursor_lines.reserve(post_cursor_lines.size() + 1, post_cursor_lines.byteCount());
 	line_index = 0;
-	
-	return SUCCESS;
+}
+
+// makes the gap bigger than length, so that many bytes go in without resizing
+void GapBuffer::reserve_gap(size_t length) {
+	if (length + pre_cursor_index >= post_cursor_index) {
+		// grow by at least an eighth, so typing into a big file doesn't copy it every few keys
+		size_t needed = length + pre_cursor_index + 1 - post_cursor_index;
+		size_t growth = std::max<size_t>({needed, capacity / 8, BLOCK_SIZE});
+		resize(capacity + (growth + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE);
+	}
 }
 
 /*
@@ -69,9 +106,8 @@ size_t GapBuffer::insert(const char *data, size_t length) {
 	assert(data, 0, "data must be non-null!");
 	assert(pre_cursor_index < post_cursor_index, 0, "pre_cursor_index must be less than post_cursor_index!");
 	
-	if (length + pre_cursor_index >= post_cursor_index) {
-		resize(capacity + BLOCK_SIZE);
-	}
+	reserve_gap(length);
+	prepare_write(pre_cursor_index, pre_cursor_index + length);
 	
 	size_t i = 0;
 	bool line_start = false;
@@ -100,31 +136,67 @@ size_t GapBuffer::insert(const char *data, size_t length) {
 	return i;
 }
 
+/*
+ * Adds text at the end of the buffer, wherever the cursor is. With
+ * the cursor at the end it's an insert that leaves the cursor after
+ * the new text. Otherwise the text after the cursor moves down into
+ * the gap, and every line start after the cursor moves with it.
+ */
+size_t GapBuffer::append(const char *data, size_t length) {
+	assert(buffer, 0, "buffer must be allocated!");
+	// a loaded file's trailing newline doesn't start a line until something follows it
+	if (post_cursor_index == capacity) {
+		if (pre_cursor_index > 0 && buffer[pre_cursor_index - 1] == '\n' && pre_cursor_lines.back() != pre_cursor_index) {
+			pre_cursor_lines.push_back(pre_cursor_index);
+			line_index = 0;
+		}
+		return insert(data, length);
+	}
+	reserve_gap(length);
+	prepare_write(post_cursor_index - length, capacity);
+	bool ends_line = buffer[capacity - 1] == '\n' && (post_cursor_lines.empty() || post_cursor_lines.front() != 0);
+	memmove(&buffer[post_cursor_index - length], &buffer[post_cursor_index], capacity - post_cursor_index);
+	memcpy(&buffer[capacity - length], data, length);
+	post_cursor_index -= length;
+
+	post_cursor_lines.shift(length);
+	// the new line starts are all further on than the old ones, so they go in front
+	std::vector<size_t> lines;
+	for (size_t i = 0; i + 1 < length; i++) {
+		if (data[i] == '\n') {
+			lines.push_back(length - i - 1);
+		}
+	}
+	std::reverse(lines.begin(), lines.end());
+	if (ends_line) {
+		lines.push_back(length);
+	}
+	post_cursor_lines.prepend(lines);
+	return length;
+}
+
 size_t GapBuffer::removeFront(size_t length) {
 	assert(buffer, 0, "buffer must be allocated!");
 	assert(post_cursor_index <= capacity, 0, "post_cursor_index must be less than or equal to capacity");
-	if (post_cursor_index + length >= capacity) {
+	if (post_cursor_index + length > capacity) {
 		Logger::error("attempting to remove at the end of buffer!");
 		length = capacity - post_cursor_index;
 	}
 	
-	size_t i = 0;
-	for (; i < length; i++) {
-		if (!post_cursor_lines.empty()) {
-			if (capacity - post_cursor_index == post_cursor_lines.back()) {
-				post_cursor_lines.pop_back();
-			}
-		}
-		post_cursor_index++;
-	}
+	// removing a newline removes the line start right after it, so the
+	// lines starting in the removed text all go in one cut
+	size_t remaining = capacity - post_cursor_index - length;
+	post_cursor_lines.truncate(remaining > 0 ? post_cursor_lines.upper_bound(remaining - 1) : 0);
+	post_cursor_index += length;
 	
-	return i;
+	return length;
 }
 
 /*
  * Removes characters behind the current cursor position and
  * decrements the cursor. Automatically handles removing line-
- * starts and calculates line_index.
+ * starts and calculates line_index. The line starts go in one cut
+ * however many there are.
  */
 size_t GapBuffer::removeBack(size_t length) {
 	assert(buffer, 0, "buffer must be allocated!");
@@ -134,25 +206,24 @@ size_t GapBuffer::removeBack(size_t length) {
 		length = pre_cursor_index;
 	}
 	
-	size_t i = 0;
-	bool recalc_line_index = false;
-	for (; i < length; i++) {
-		if (buffer[pre_cursor_index - 1] == '\t') {
-			recalc_line_index = true;
-		} else if ((buffer[pre_cursor_index - 1] & 0xC0) != 0x80) {
-			line_index--;
-		}
-		if (pre_cursor_index == pre_cursor_lines.back()) {
-			pre_cursor_lines.pop_back();
-			recalc_line_index = true;
+	size_t start = pre_cursor_index - length;
+	size_t kept = pre_cursor_lines.upper_bound(start);
+	// the column only has to be worked out again if the cursor changed lines, or went back over a tab
+	bool recalc_line_index = kept < pre_cursor_lines.size() || memchr(&buffer[start], '\t', length) != nullptr;
+	if (!recalc_line_index) {
+		for (size_t i = start; i < pre_cursor_index; i++) {
+			if ((buffer[i] & 0xC0) != 0x80) {
+				line_index--;
+			}
 		}
-		pre_cursor_index--;
 	}
+	pre_cursor_lines.truncate(kept);
+	pre_cursor_index = start;
 	if (recalc_line_index) {
 		line_index = get_line_index();
 	}
 	
-	return i;
+	return length;
 }
 
 size_t GapBuffer::resize(size_t new_capacity) {
@@ -161,16 +232,88 @@ size_t GapBuffer::resize(size_t new_capacity) {
 	
 	size_t new_pci = new_capacity - (capacity - post_cursor_index);
 	char *new_buffer = new char[new_capacity];
-	memcpy(new_buffer, buffer, capacity);
-	memmove(&new_buffer[new_pci], &new_buffer[post_cursor_index], new_capacity - new_pci);
+	memcpy(new_buffer, buffer, pre_cursor_index);
+	memcpy(&new_buffer[new_pci], &buffer[post_cursor_index], new_capacity - new_pci);
 	post_cursor_index = new_pci;
 	capacity = new_capacity;
-	delete[] buffer;
+	// any snapshots keep the old storage alive on their own
+	storage.reset(new_buffer);
 	buffer = new_buffer;
 	
 	return new_capacity;
 }
 
+/*
+ * Snapshots share storage with the buffer, and only ever see the
+ * bytes outside of the gap at the time they were taken. Writes
+ * inside the part of the gap that every live snapshot agrees on
+ * are safe, anything else has to move to fresh storage first.
+ */
+void GapBuffer::prepare_write(size_t start, size_t end) {
+	if (storage.use_count() > 1 && (start < writable_start || end > writable_end)) {
+		detach();
+	}
+}
+
+void GapBuffer::detach() {
+	char *new_buffer = new char[capacity];
+	memcpy(new_buffer, buffer, pre_cursor_index);
+	memcpy(&new_buffer[post_cursor_index], &buffer[post_cursor_index], capacity - post_cursor_index);
+	storage.reset(new_buffer);
+	buffer = new_buffer;
+}
+
+Snapshot GapBuffer::snapshot() {
+	Snapshot result;
+	if (!buffer) {
+		return result;
+	}
+	if (storage.use_count() == 1) {
+		writable_start = pre_cursor_index;
+		writable_end = post_cursor_index;
+	} else {
+		writable_start = std::max(writable_start, pre_cursor_index);
+		writable_end = std::min(writable_end, post_cursor_index);
+	}
+	result.storage = storage;
+	result.data[0] = buffer;
+	result.length[0] = pre_cursor_index;
+	result.data[1] = &buffer[post_cursor_index];
+	result.length[1] = capacity - post_cursor_index;
+	return result;
+}
+
+/*
+ * A slice only sees its own bytes, so writes only have to keep off
+ * those. The writable part grows to reach from the gap out to the
+ * slice, so moving the gap away from it doesn't detach either. Only a
+ * slice that spans the gap pins it like a snapshot does.
+ */
+Snapshot GapBuffer::extract(size_t offset, size_t length) {
+	if (!buffer) {
+		return Snapshot();
+	}
+	if (storage.use_count() == 1) {
+		writable_start = 0;
+		writable_end = capacity;
+	}
+	if (offset + length <= pre_cursor_index) {
+		writable_start = std::max(writable_start, offset + length);
+	} else if (offset >= pre_cursor_index) {
+		writable_end = std::min(writable_end, post_cursor_index + offset - pre_cursor_index);
+	} else {
+		writable_start = std::max(writable_start, pre_cursor_index);
+		writable_end = std::min(writable_end, post_cursor_index);
+	}
+	Snapshot result;
+	result.storage = storage;
+	result.data[0] = buffer;
+	result.length[0] = pre_cursor_index;
+	result.data[1] = &buffer[post_cursor_index];
+	result.length[1] = capacity - post_cursor_index;
+	return result.slice(offset, length);
+}
+
 size_t GapBuffer::advance(size_t distance) {
 	assert(buffer, 0, "buffer must be allocated!");
 	assert(pre_cursor_index < post_cursor_index, 0, "pre_cursor_index must be less than post_cursor_index!");
@@ -179,6 +322,7 @@ size_t GapBuffer::advance(size_t distance) {
 		Logger::error("attempting to advance past buffer!");
 		distance = capacity - post_cursor_index;
 	}
+	prepare_write(pre_cursor_index, pre_cursor_index + distance);
 	size_t i = 0;
 	for (; i < distance; i++) {
 		buffer[pre_cursor_index] = buffer[post_cursor_index];
@@ -204,6 +348,7 @@ size_t GapBuffer::retreat(size_t distance) {
 		Logger::error("attempting to retreat past buffer!");
 		distance = pre_cursor_index;
 	}
+	prepare_write(post_cursor_index - distance, post_cursor_index);
 	size_t i = 0;
 	for (; i < distance; i++) {
 		if (pre_cursor_lines.size() > 1) {
@@ -220,6 +365,44 @@ size_t GapBuffer::retreat(size_t distance) {
 	return i;
 }
 
+/*
+ * Moves the cursor to a logical offset with one memmove, and moves
+ * the line starts it passes over to the other side in bulk, instead
+ * of going a byte at a time like advance and retreat.
+ */
+size_t GapBuffer::move_gap(size_t offset) {
+	assert(buffer, 0, "buffer must be allocated!");
+	offset = std::min(offset, length());
+	if (offset < pre_cursor_index) {
+		size_t distance = pre_cursor_index - offset;
+		prepare_write(post_cursor_index - distance, post_cursor_index);
+		memmove(&buffer[post_cursor_index - distance], &buffer[offset], distance);
+		pre_cursor_index -= distance;
+		post_cursor_index -= distance;
+		// a line starting right at the cursor is the cursor's line, so it stays
+		size_t kept = std::max<size_t>(pre_cursor_lines.upper_bound(offset), 1);
+		while (pre_cursor_lines.size() > kept) {
+			post_cursor_lines.push_back(capacity - (pre_cursor_lines.back() + post_cursor_index - pre_cursor_index));
+			pre_cursor_lines.pop_back();
+		}
+	} else if (offset > pre_cursor_index) {
+		size_t distance = offset - pre_cursor_index;
+		prepare_write(pre_cursor_index, offset);
+		size_t gap = post_cursor_index - pre_cursor_index;
+		memmove(&buffer[pre_cursor_index], &buffer[post_cursor_index], distance);
+		pre_cursor_index += distance;
+		post_cursor_index += distance;
+		// the lines starting up to offset, counted from the top of post_cursor_lines
+		size_t kept = offset < capacity - gap ? post_cursor_lines.upper_bound(capacity - gap - offset - 1) : 0;
+		while (post_cursor_lines.size() > kept) {
+			pre_cursor_lines.push_back(capacity - post_cursor_lines.back() - gap);
+			post_cursor_lines.pop_back();
+		}
+	}
+	line_index = get_line_index();
+	return offset;
+}
+
 size_t GapBuffer::end() {
 	assert(buffer, 0, "buffer must be allocated!");
 	assert(pre_cursor_index < post_cursor_index, 0, "pre_cursor_index must be less than post_cursor_index!");
@@ -251,9 +434,9 @@ size_t GapBuffer::up(size_t distance) {
 		Logger::error("attempting to move out of bounds!");
 		distance = pre_cursor_lines.size() - 1;
 	}
-	size_t line_length = *(pre_cursor_lines.end() - distance) - *(pre_cursor_lines.end() - distance - 1) - 1;
+	size_t line_length = pre_cursor_lines[pre_cursor_lines.size() - distance] - pre_cursor_lines[pre_cursor_lines.size() - distance - 1] - 1;
 	size_t cursor_pos_x = 0;
-	for (size_t i = *(pre_cursor_lines.end() - distance - 1); i < *(pre_cursor_lines.end() - distance); i++) {
+	for (size_t i = pre_cursor_lines[pre_cursor_lines.size() - distance - 1]; i < pre_cursor_lines[pre_cursor_lines.size() - distance]; i++) {
 		if (buffer[i] == '\t') {
 			cursor_pos_x = (cursor_pos_x / 4 + 1) * 4;
 		} else if (buffer[i] == '\n') {
@@ -262,11 +445,11 @@ size_t GapBuffer::up(size_t distance) {
 			cursor_pos_x++;
 		}
 		if (temp_line_index <= cursor_pos_x) {
-			line_length = i - *(pre_cursor_lines.end() - distance - 1) + (1 && temp_line_index);
+			line_length = i - pre_cursor_lines[pre_cursor_lines.size() - distance - 1] + (1 && temp_line_index);
 			break;
 		}
 	}
-	size_t dist = pre_cursor_index - *(pre_cursor_lines.end() - distance - 1) - line_length;
+	size_t dist = pre_cursor_index - pre_cursor_lines[pre_cursor_lines.size() - distance - 1] - line_length;
 	retreat(dist);
 	line_index = temp_line_index;
 	return distance;
@@ -287,12 +470,12 @@ size_t GapBuffer::down(size_t distance) {
 	}
 	size_t line_length = 0;
 	if (post_cursor_lines.size() == distance) {
-		line_length = *(post_cursor_lines.end() - distance);
+		line_length = post_cursor_lines[post_cursor_lines.size() - distance];
 	} else {
-		line_length = *(post_cursor_lines.end() - distance) - *(post_cursor_lines.end() - distance - 1) - 1;
+		line_length = post_cursor_lines[post_cursor_lines.size() - distance] - post_cursor_lines[post_cursor_lines.size() - distance - 1] - 1;
 	}
 	size_t cursor_pos_x = 0;
-	for (size_t i = capacity - *(post_cursor_lines.end() - distance); i < capacity; i++) {
+	for (size_t i = capacity - post_cursor_lines[post_cursor_lines.size() - distance]; i < capacity; i++) {
 		if (buffer[i] == '\t') {
 			cursor_pos_x = (cursor_pos_x / 4 + 1) * 4;
 		} else if (buffer[i] == '\n') {
@@ -301,14 +484,12 @@ size_t GapBuffer::down(size_t distance) {
 			cursor_pos_x++;
 		}
 		if (temp_line_index <= cursor_pos_x) {
-			line_length = i - (capacity - *(post_cursor_lines.end() - distance)) + (1 && temp_line_index);
+			line_length = i - (capacity - post_cursor_lines[post_cursor_lines.size() - distance]) + (1 && temp_line_index);
 			break;
 		}
 	}
-	char buf[256] = {0};
-	sprintf(buf, "line_length: %lu", line_length);
-	Logger::info(buf);
-	size_t dist = capacity - post_cursor_index - *(post_cursor_lines.end() - distance) + line_length;
+	Logger::log<LogLevel::DEBUG>("line_length: %lu", line_length);
+	size_t dist = capacity - post_cursor_index - post_cursor_lines[post_cursor_lines.size() - distance] + line_length;
 	advance(dist);
 	line_index = temp_line_index;
 	return distance;
@@ -332,6 +513,53 @@ size_t GapBuffer::get_line_index() {
 	return index;
 }
 
+size_t GapBuffer::line_count() {
+	return pre_cursor_lines.size() + post_cursor_lines.size();
+}
+
+size_t GapBuffer::line_start(size_t line) {
+	if (line < pre_cursor_lines.size()) {
+		return pre_cursor_lines[line];
+	}
+	if (line >= line_count()) {
+		return length();
+	}
+	size_t start = capacity - post_cursor_lines[line_count() - line - 1];
+	return start - (post_cursor_index - pre_cursor_index);
+}
+
+/*
+ * Returns the number of spans filled. Lines before the cursor
+ * line live in the pre-cursor data, lines after it in the post-
+ * cursor data, and the cursor line is split across the gap.
+ */
+int GapBuffer::get_line(size_t line, const char *data[2], size_t length[2]) {
+	assert(buffer, 0, "buffer must be allocated!");
+	if (line >= line_count()) {
+		return 0;
+	}
+	if (line + 1 < pre_cursor_lines.size()) {
+		data[0] = &buffer[pre_cursor_lines[line]];
+		length[0] = pre_cursor_lines[line + 1] - pre_cursor_lines[line] - 1;
+		return 1;
+	}
+	size_t post_end = capacity;
+	if (line + 1 < line_count()) {
+		post_end = capacity - post_cursor_lines[line_count() - line - 2] - 1;
+	}
+	if (line + 1 > pre_cursor_lines.size()) {
+		size_t start = capacity - post_cursor_lines[line_count() - line - 1];
+		data[0] = &buffer[start];
+		length[0] = post_end - start;
+		return 1;
+	}
+	data[0] = &buffer[pre_cursor_lines.back()];
+	length[0] = pre_cursor_index - pre_cursor_lines.back();
+	data[1] = &buffer[post_cursor_index];
+	length[1] = post_end - post_cursor_index;
+	return 2;
+}
+
 Result GapBuffer::print(FILE *file) {
 	assert(file, IO_ERROR, "file must be valid open file or stdout!");
 	assert(buffer, NULL_ERROR, "buffer must be allocated!");
@@ -1,29 +1,57 @@
 #pragma once
 
 #include "defines.hpp"
+#include "line_index.hpp"
+#include "snapshot.hpp"
 
 #include <cstdio>
+#include <memory>
 #include <vector>
 #include <string>
 
+class LineCache;
+
 /* GapBuffer
  * loadFile: takes a filename and loads the contents of the
- *   file into the buffer.
+ *   file into the buffer, replacing whatever it held. The line index
+ *   of a big file comes from its LineCache, when it has one.
+ * beginLoad, endLoad: load length bytes from anywhere else. beginLoad
+ *   returns where the bytes go, endLoad indexes them, skipping the
+ *   ones a cache already has the lines of.
  * insert: inserts the supplied text, up to length bytes, and
  *   advances the cursor.
+ * append: adds text at the end of the buffer, without moving the
+ *   cursor unless it's at the end.
+ * reserve_gap: grows the gap to fit length more bytes, so a batch
+ *   of inserts resizes at most once.
  * removeFront: removes data from the front of the cursor. (delete)
  * removeBack: removes data from the back of the cursor. (backspace)
+ * extract: length bytes from a logical offset, as a snapshot that
+ *   shares the buffer's storage instead of copying them.
  * advance: moves the cursor forward in the buffer.
  * retreat: moves the cursor backward in the buffer.
+ * move_gap: moves the cursor straight to a logical offset.
  * end: moves to the end of the current line.
  * home: moves to the beginning of the current line.
  * up: moves up to distance lines up.
  * down: moves up to distance lines down.
  * get_line_index: calculates the current line index.
+ * line_count: the number of lines in the buffer.
+ * line_start: the logical offset (ignoring the gap) of a line.
+ * get_line: fills up to two spans with the bytes of a line, without
+ *   its newline. The line holding the cursor is split by the gap.
  * print: sends the contents of the buffer to a file, or the
  *   terminal.
+ * snapshot: returns an immutable view of the current text in O(1).
  * resize: increases the size of the buffer and copies the data over.
+ * prepare_write: called before writing into the gap, moves to fresh
+ *   storage if a live snapshot could see the bytes being written.
+ * detach: copies the text into storage no snapshot shares.
  * buffer: stores all of the text data for the buffer.
+ * storage: owns buffer, shared with any live snapshots.
+ * writable_start, writable_end: the part of the storage around the
+ *   gap that no live snapshot can see, so it's safe to write to
+ *   without detaching.
  * capacity: unsigned int that does what it says on the tin.
  *   Includes the space between the two sides of the gap.
  * pre_cursor_index: stores the top of the pre-cursor data, and 
@@ -34,35 +62,50 @@
  *   the cursor. Will always have 0 as its first element.
  * post_cursor_lines: stores all of the line start indices after
  *   the cursor. Can be empty, if the cursor is on the last newline.
+ *   Both are LineIndexes, which keep them compressed.
  * line_index: preserves the position of the cursor along the line.
  *   Respects tabwidth, and unicode.
  */
 
 struct GapBuffer {
-	~GapBuffer();
-	
 	Result loadFile(const std::string &filename);
+	char *beginLoad(size_t length);
+	void endLoad(size_t length, const LineCache *cache = nullptr);
 	size_t insert(const char *data, size_t length);
+	size_t append(const char *data, size_t length);
+	void reserve_gap(size_t length);
 	size_t removeFront(size_t length);
 	size_t removeBack(size_t length);
 	size_t advance(size_t distance);
 	size_t retreat(size_t distance);
+	size_t move_gap(size_t offset);
 	size_t end();
 	size_t home();
 	size_t up(size_t distance);
 	size_t down(size_t distance);
 	size_t length();
 	size_t get_line_index();
+	size_t line_count();
+	size_t line_start(size_t line);
+	int get_line(size_t line, const char *data[2], size_t length[2]);
 	Result print(FILE *file = stdout);
+	Snapshot snapshot();
+	Snapshot extract(size_t offset, size_t length);
 
 	char *buffer = nullptr;
 	size_t capacity = 0;
 	size_t pre_cursor_index = 0;
 	size_t post_cursor_index = 0;
-	std::vector<size_t> pre_cursor_lines;
-	std::vector<size_t> post_cursor_lines;
+	LineIndex pre_cursor_lines;
+	LineIndex post_cursor_lines;
 	size_t line_index;
 
 private:
 	size_t resize(size_t new_capacity);
+	void prepare_write(size_t start, size_t end);
+	void detach();
+
+	std::shared_ptr<char[]> storage;
+	size_t writable_start = 0;
+	size_t writable_end = 0;
 };
@@ -0,0 +1,400 @@
+#include "highlight.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iterator>
+
+using byte = unsigned char;
+
+const CharColor TOKEN_COLORS[] = {
+	CharColor::GREEN,
+	CharColor::LIGHT_YELLOW,
+	CharColor::YELLOW,
+	CharColor::LIGHT_GREEN,
+	CharColor::LIGHT_RED,
+	CharColor::LIGHT_BLACK,
+	CharColor::MAGENTA,
+};
+
+// keyword and type tables must stay sorted, they are binary searched
+const char *const CPP_KEYWORDS[] = {
+	"alignas", "alignof", "and", "asm", "break", "case", "catch", "class",
+	"co_await", "co_return", "co_yield", "concept", "const", "const_cast",
+	"consteval", "constexpr", "constinit", "continue", "decltype",
+	"default", "delete", "do", "dynamic_cast", "else", "enum", "explicit",
+	"export", "extern", "false", "for", "friend", "goto", "if", "inline",
+	"mutable", "namespace", "new", "noexcept", "not", "nullptr",
+	"operator", "or", "private", "protected", "public", "register",
+	"reinterpret_cast", "requires", "return", "sizeof", "static",
+	"static_assert", "static_cast", "struct", "switch", "template",
+	"this", "thread_local", "throw", "true", "try", "typedef", "typeid",
+	"typename", "union", "using", "virtual", "volatile", "while"
+};
+
+const char *const CPP_TYPES[] = {
+	"auto", "bool", "char", "char16_t", "char32_t", "char8_t", "double",
+	"float", "int", "int16_t", "int32_t", "int64_t", "int8_t", "long",
+	"ptrdiff_t", "short", "signed", "size_t", "ssize_t", "uint16_t",
+	"uint32_t", "uint64_t", "uint8_t", "unsigned", "void", "wchar_t"
+};
+
+const char *const PYTHON_KEYWORDS[] = {
+	"False", "None", "True", "and", "as", "assert", "async", "await",
+	"break", "class", "continue", "def", "del", "elif", "else", "except",
+	"finally", "for", "from", "global", "if", "import", "in", "is",
+	"lambda", "nonlocal", "not", "or", "pass", "raise", "return", "try",
+	"while", "with", "yield"
+};
+
+const char *const PYTHON_TYPES[] = {
+	"bool", "bytes", "dict", "float", "int", "list", "object", "set",
+	"str", "tuple"
+};
+
+const char *const RUST_KEYWORDS[] = {
+	"as", "async", "await", "break", "const", "continue", "crate", "dyn",
+	"else", "enum", "extern", "false", "fn", "for", "if", "impl", "in",
+	"let", "loop", "match", "mod", "move", "mut", "pub", "ref", "return",
+	"self", "static", "struct", "super", "trait", "true", "type",
+	"unsafe", "use", "where", "while"
+};
+
+const char *const RUST_TYPES[] = {
+	"Self", "String", "Vec", "bool", "char", "f32", "f64", "i128", "i16",
+	"i32", "i64", "i8", "isize", "str", "u128", "u16", "u32", "u64", "u8",
+	"usize"
+};
+
+const char *const SHELL_KEYWORDS[] = {
+	"case", "do", "done", "elif", "else", "esac", "export", "fi", "for",
+	"function", "if", "in", "local", "return", "then", "until", "while"
+};
+
+const char *const CPP_EXTENSIONS[] = {"c", "cc", "cpp", "cxx", "h", "hh", "hpp", "hxx"};
+const char *const PYTHON_EXTENSIONS[] = {"py"};
+const char *const RUST_EXTENSIONS[] = {"rs"};
+const char *const SHELL_EXTENSIONS[] = {"bash", "sh", "zsh"};
+
+const Language LANGUAGES[] = {
+	{
+		"c++",
+		CPP_EXTENSIONS, std::size(CPP_EXTENSIONS),
+		CPP_KEYWORDS, std::size(CPP_KEYWORDS),
+		CPP_TYPES, std::size(CPP_TYPES),
+		"//", "/*", "*/", "\"'", false, '#',
+	},
+	{
+		"python",
+		PYTHON_EXTENSIONS, std::size(PYTHON_EXTENSIONS),
+		PYTHON_KEYWORDS, std::size(PYTHON_KEYWORDS),
+		PYTHON_TYPES, std::size(PYTHON_TYPES),
+		"#", nullptr, nullptr, "\"'", true, '\0',
+	},
+	{
+		"rust",
+		RUST_EXTENSIONS, std::size(RUST_EXTENSIONS),
+		RUST_KEYWORDS, std::size(RUST_KEYWORDS),
+		RUST_TYPES, std::size(RUST_TYPES),
+		"//", "/*", "*/", "\"", false, '\0',
+	},
+	{
+		"shell",
+		SHELL_EXTENSIONS, std::size(SHELL_EXTENSIONS),
+		SHELL_KEYWORDS, std::size(SHELL_KEYWORDS),
+		nullptr, 0,
+		"#", nullptr, nullptr, "\"'", false, '\0',
+	},
+};
+
+const Language *findLanguage(const std::string &filename) {
+	size_t dot = filename.rfind('.');
+	if (dot == std::string::npos || filename.find('/', dot) != std::string::npos) {
+		return nullptr;
+	}
+	const char *extension = filename.c_str() + dot + 1;
+	for (const Language &language : LANGUAGES) {
+		for (size_t i = 0; i < language.extension_count; i++) {
+			if (strcmp(language.extensions[i], extension) == 0) {
+				return &language;
+			}
+		}
+	}
+	return nullptr;
+}
+
+static bool isWordChar(char c) {
+	return isalnum((byte)c) || c == '_';
+}
+
+static bool matches(const char *line, size_t i, size_t length, const char *delimiter) {
+	if (delimiter == nullptr) {
+		return false;
+	}
+	size_t delimiter_length = strlen(delimiter);
+	return i + delimiter_length <= length && memcmp(&line[i], delimiter, delimiter_length) == 0;
+}
+
+static bool inTable(const char *const *table, size_t count, const char *word, size_t length) {
+	size_t low = 0, high = count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		int compare = strncmp(table[mid], word, length);
+		if (compare == 0 && table[mid][length] != '\0') {
+			compare = 1;
+		}
+		if (compare == 0) {
+			return true;
+		} else if (compare < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return false;
+}
+
+static void mark(Token *tokens, size_t from, size_t to, Token token) {
+	if (tokens) {
+		memset(&tokens[from], (int)token, to - from);
+	}
+}
+
+/*
+ * Lexes a single line, writing a token per byte into tokens (if
+ * it isn't null), and returns the state at the end of the line.
+ */
+unsigned char lexLine(const Language &language, unsigned char state, const char *line, size_t length, Token *tokens) {
+	if (state == LEX_PREPROCESSOR) {
+		mark(tokens, 0, length, Token::PREPROCESSOR);
+		return (length > 0 && line[length - 1] == '\\') ? LEX_PREPROCESSOR : LEX_NORMAL;
+	}
+	size_t i = 0;
+	bool line_start = true;
+	while (i < length) {
+		size_t start = i;
+		if (state == LEX_BLOCK_COMMENT) {
+			for (; i < length; i++) {
+				if (matches(line, i, length, language.block_comment_end)) {
+					i += strlen(language.block_comment_end);
+					state = LEX_NORMAL;
+					break;
+				}
+			}
+			mark(tokens, start, i, Token::COMMENT);
+			continue;
+		}
+		if (state == LEX_LONG_STRING_DOUBLE || state == LEX_LONG_STRING_SINGLE) {
+			const char *end = state == LEX_LONG_STRING_DOUBLE ? "\"\"\"" : "'''";
+			for (; i < length; i++) {
+				if (line[i] == '\\') {
+					i++;
+				} else if (matches(line, i, length, end)) {
+					i += 3;
+					state = LEX_NORMAL;
+					break;
+				}
+			}
+			i = std::min(i, length);
+			mark(tokens, start, i, Token::STRING);
+			continue;
+		}
+
+		char c = line[i];
+		if (matches(line, i, length, language.line_comment) &&
+			(language.line_comment[1] != '\0' || i == 0 || isspace((byte)line[i - 1]))) {
+			mark(tokens, i, length, Token::COMMENT);
+			return LEX_NORMAL;
+		} else if (matches(line, i, length, language.block_comment_start)) {
+			i += strlen(language.block_comment_start);
+			state = LEX_BLOCK_COMMENT;
+			mark(tokens, start, i, Token::COMMENT);
+		} else if (line_start && language.preprocessor && c == language.preprocessor) {
+			mark(tokens, i, length, Token::PREPROCESSOR);
+			return line[length - 1] == '\\' ? LEX_PREPROCESSOR : LEX_NORMAL;
+		} else if (language.long_strings && matches(line, i, length, "\"\"\"")) {
+			i += 3;
+			state = LEX_LONG_STRING_DOUBLE;
+			mark(tokens, start, i, Token::STRING);
+		} else if (language.long_strings && matches(line, i, length, "'''")) {
+			i += 3;
+			state = LEX_LONG_STRING_SINGLE;
+			mark(tokens, start, i, Token::STRING);
+		} else if (language.quotes && strchr(language.quotes, c)) {
+			for (i++; i < length && line[i] != c; i++) {
+				if (line[i] == '\\') i++;
+			}
+			i = std::min(i + 1, length);
+			mark(tokens, start, i, Token::STRING);
+		} else if (isdigit((byte)c)) {
+			for (; i < length && (isWordChar(line[i]) || line[i] == '.' || line[i] == '\''); i++);
+			mark(tokens, start, i, Token::NUMBER);
+		} else if (isWordChar(c)) {
+			for (; i < length && isWordChar(line[i]); i++);
+			Token token = Token::TEXT;
+			if (inTable(language.keywords, language.keyword_count, &line[start], i - start)) {
+				token = Token::KEYWORD;
+			} else if (inTable(language.types, language.type_count, &line[start], i - start)) {
+				token = Token::TYPE;
+			}
+			mark(tokens, start, i, token);
+		} else {
+			i++;
+			mark(tokens, start, i, Token::TEXT);
+		}
+		if (!isspace((byte)c)) {
+			line_start = false;
+		}
+	}
+	return state;
+}
+
+void Highlighter::setLanguage(const std::string &filename) {
+	language = findLanguage(filename);
+	if (language) {
+		debug("highlighting as ", language->name);
+	}
+}
+
+void Highlighter::reset(size_t line_count) {
+	// leave room for new lines, so editing doesn't have to allocate
+	states.reserve(line_count + line_count / 8 + 1024);
+	states.assign(line_count, LEX_NORMAL);
+	line_buffer.reserve(4096);
+	tokens.reserve(4096);
+	valid_lines = line_count > 0 ? 1 : 0;
+	dirty = false;
+}
+
+void Highlighter::edit(size_t line, long line_delta) {
+	if (language == nullptr || line >= states.size()) {
+		return;
+	}
+	// shifting the states after the line along would cost O(lines) a key, so
+	// they're dropped instead, to be relexed as far down as anything is drawn
+	if (line_delta != 0) {
+		size_t count = line_delta > 0 ? states.size() + line_delta : states.size() - std::min((size_t)-line_delta, states.size() - line - 1);
+		states.resize(count, LEX_NORMAL);
+		valid_lines = std::min(valid_lines, line + 1);
+	}
+
+	size_t edit_end = line + (line_delta > 0 ? line_delta : 0);
+	if (!dirty) {
+		dirty = true;
+		dirty_start = line;
+		dirty_end = edit_end;
+		return;
+	}
+	if (dirty_end > line) {
+		dirty_end = std::max((long)line, (long)dirty_end + line_delta);
+	}
+	dirty_start = std::min(dirty_start, line);
+	dirty_end = std::max(dirty_end, edit_end);
+}
+
+unsigned char Highlighter::lex(GapBuffer &gap_buffer, size_t line, Token *tokens) {
+	const char *data[2];
+	size_t length[2];
+	if (gap_buffer.get_line(line, data, length) == 1) {
+		return lexLine(*language, states[line], data[0], length[0], tokens);
+	}
+	line_buffer.assign(data[0], length[0]);
+	line_buffer.append(data[1], length[1]);
+	return lexLine(*language, states[line], line_buffer.data(), line_buffer.length(), tokens);
+}
+
+/*
+ * Brings the cached states up to date for every line up to
+ * last_line. Dirty lines are relexed until the end state of a
+ * line past the edit matches the state cached for the next one,
+ * so an edit usually costs a single line.
+ */
+void Highlighter::update(GapBuffer &gap_buffer, size_t last_line) {
+	if (dirty) {
+		dirty = false;
+		if (dirty_start < valid_lines) {
+			for (size_t line = dirty_start; line + 1 < states.size(); line++) {
+				unsigned char end = lex(gap_buffer, line, nullptr);
+				bool converged = line >= dirty_end && line + 1 < valid_lines && states[line + 1] == end;
+				states[line + 1] = end;
+				if (converged) {
+					break;
+				} else if (line >= last_line) {
+					valid_lines = line + 2;
+					break;
+				} else if (line + 2 >= states.size()) {
+					valid_lines = states.size();
+				}
+			}
+		}
+	}
+	while (valid_lines < states.size() && valid_lines <= last_line) {
+		states[valid_lines] = lex(gap_buffer, valid_lines - 1, nullptr);
+		valid_lines++;
+	}
+}
+
+void Highlighter::render(GapBuffer &gap_buffer, size_t first_line, Frame &frame) {
+	if (language == nullptr) {
+		return;
+	}
+	size_t line_count = gap_buffer.line_count();
+	if (states.size() != line_count) {
+		Logger::warn("highlighter lost track of the line count, relexing");
+		reset(line_count);
+	}
+	if (first_line >= line_count) {
+		return;
+	}
+	size_t last_line = std::min<size_t>(first_line + frame.height, line_count) - 1;
+	update(gap_buffer, last_line);
+
+	for (size_t line = first_line; line <= last_line; line++) {
+		const char *data[2];
+		size_t length[2];
+		const char *text = nullptr;
+		size_t text_length = 0;
+		if (gap_buffer.get_line(line, data, length) == 1) {
+			text = data[0];
+			text_length = length[0];
+		} else {
+			line_buffer.assign(data[0], length[0]);
+			line_buffer.append(data[1], length[1]);
+			text = line_buffer.data();
+			text_length = line_buffer.length();
+		}
+		if (tokens.size() < text_length) {
+			tokens.resize(text_length);
+		}
+		lexLine(*language, states[line], text, text_length, tokens.data());
+
+		// walks the line the same way Frame::loadString lays it out
+		Character *row = &frame.contents[frame.width * (line - first_line)];
+		unsigned int x = 0;
+		for (size_t i = 0; i < text_length && x < frame.width;) {
+			byte c = text[i];
+			unsigned int cells = 1;
+			size_t bytes = 1;
+			if (c == '\t') {
+				cells = 4 - x % 4;
+			} else if (c >= 0x80 && c < 0xE0) {
+				bytes = 2;
+			} else if (c >= 0xE0 && c < 0xF0) {
+				bytes = 3;
+			} else if (c >= 0xF0 && c < 0xF8) {
+				bytes = 4;
+			} else if (c >= 0xF8 && c < 0xFC) {
+				bytes = 5;
+			}
+			if (tokens[i] != Token::TEXT) {
+				for (unsigned int j = x; j < x + cells && j < frame.width; j++) {
+					row[j].fg = TOKEN_COLORS[static_cast<int>(tokens[i])];
+				}
+			}
+			x += cells;
+			i += bytes;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "defines.hpp"
+#include "screen.hpp"
+#include "gap_buffer.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+enum class Token : unsigned char {
+	TEXT = 0,
+	KEYWORD,
+	TYPE,
+	STRING,
+	NUMBER,
+	COMMENT,
+	PREPROCESSOR,
+};
+
+/* LexState
+ * The state the lexer is in at the start of a line. Anything
+ * that can span a newline needs its own state.
+ */
+enum LexState : unsigned char {
+	LEX_NORMAL = 0,
+	LEX_BLOCK_COMMENT,
+	LEX_PREPROCESSOR,
+	LEX_LONG_STRING_DOUBLE,
+	LEX_LONG_STRING_SINGLE,
+};
+
+/* Language
+ * Describes a language to the table-driven lexer. Keyword and
+ * type tables must be sorted, since they are binary searched.
+ * Any of the delimiters can be nullptr if the language doesn't
+ * have them.
+ */
+struct Language {
+	const char *name;
+	const char *const *extensions;
+	size_t extension_count;
+	const char *const *keywords;
+	size_t keyword_count;
+	const char *const *types;
+	size_t type_count;
+	const char *line_comment;
+	const char *block_comment_start;
+	const char *block_comment_end;
+	const char *quotes;
+	bool long_strings;
+	char preprocessor;
+};
+
+const Language *findLanguage(const std::string &filename);
+unsigned char lexLine(const Language &language, unsigned char state, const char *line, size_t length, Token *tokens);
+
+/* Highlighter
+ * setLanguage: picks the lexer tables from the file extension.
+ * reset: forgets every cached state, for when a file is loaded.
+ * edit: tells the highlighter that line was changed, and that
+ *   line_delta lines were added (or removed) after it. Adding or
+ *   removing lines drops the states after the edit rather than
+ *   moving them, so it doesn't cost more the longer the file is.
+ * render: recolors the visible rows of frame, starting at
+ *   first_line. Only relexes dirty lines, and stops as soon as
+ *   the state at the end of a line matches the cached one.
+ * memoryUsage: the bytes the caches hold on to.
+ * states: the lexer state at the start of every line.
+ * valid_lines: states before this line can be trusted.
+ * dirty_start, dirty_end: the range of lines touched by edits
+ *   since the last render.
+ */
+class Highlighter {
+public:
+	void setLanguage(const std::string &filename);
+	void reset(size_t line_count);
+	void edit(size_t line, long line_delta);
+	void render(GapBuffer &gap_buffer, size_t first_line, Frame &frame);
+	size_t memoryUsage() const { return states.capacity() + tokens.capacity() * sizeof(Token) + line_buffer.capacity(); }
+
+private:
+	void update(GapBuffer &gap_buffer, size_t last_line);
+	unsigned char lex(GapBuffer &gap_buffer, size_t line, Token *tokens);
+
+	const Language *language = nullptr;
+	std::vector<unsigned char> states;
+	size_t valid_lines = 0;
+	size_t dirty_start = 0;
+	size_t dirty_end = 0;
+	bool dirty = false;
+
+	std::string line_buffer;
+	std::vector<Token> tokens;
+};
@@ -0,0 +1,289 @@
+#include "huge_file.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+HugeFile::~HugeFile() {
+	if (map != nullptr) {
+		munmap(map, map_length);
+	}
+}
+
+size_t HugeFile::threshold() {
+	const char *size = getenv("YADDA_HUGE_FILE_SIZE");
+	if (size != nullptr) {
+		return strtoull(size, nullptr, 10);
+	}
+	size_t ram = (size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE);
+	return std::min<size_t>(ram / 4, (size_t)1 << 30);
+}
+
+Result HugeFile::open(const std::string &filename) {
+	int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		Logger::error("failed to open file!");
+		return IO_ERROR;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return IO_ERROR;
+	}
+	// the map keeps the file alive on its own, even once it's replaced by a save
+	void *result = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (result == MAP_FAILED) {
+		Logger::error("failed to map file!");
+		return MEMORY_ERROR;
+	}
+	map = (char *)result;
+	map_length = info.st_size;
+	madvise(map, map_length, MADV_RANDOM);
+
+	total = map_length;
+	pieces.assign(1, Piece{map, map_length});
+	checkpoints.assign(1, Checkpoint{0, 0});
+	scanned = 0;
+	scanned_lines = 0;
+	Logger::info("opened a %lu byte file as a huge file", (unsigned long)total);
+	return SUCCESS;
+}
+
+/*
+ * Calls f with every span of text between offset and offset + length,
+ * in order, until it returns false.
+ */
+template <typename F>
+void HugeFile::forEachSpan(size_t offset, size_t length, F f) const {
+	size_t position = 0;
+	for (const Piece &piece : pieces) {
+		if (length == 0) {
+			return;
+		}
+		if (position + piece.length <= offset) {
+			position += piece.length;
+			continue;
+		}
+		size_t skip = offset > position ? offset - position : 0;
+		size_t span = std::min(piece.length - skip, length);
+		if (!f(piece.data + skip, span)) {
+			return;
+		}
+		length -= span;
+		position += piece.length;
+	}
+}
+
+// mapped pages are cheap to fault back in, so nothing keeps them resident
+void HugeFile::dropPages(const char *data, size_t length) const {
+	if (data < map || data >= map + map_length) {
+		return;
+	}
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = (data - map) / page * page;
+	size_t end = std::min(map_length, (size_t)(data - map) + length);
+	madvise(map + start, end - start, MADV_DONTNEED);
+}
+
+size_t HugeFile::read(size_t offset, size_t length, char *out) const {
+	size_t copied = 0;
+	forEachSpan(offset, length, [&](const char *data, size_t span) {
+		if (data >= map && data < map + map_length) {
+			size_t page = sysconf(_SC_PAGESIZE);
+			size_t start = (data - map) / page * page;
+			madvise(map + start, (data - map) + span - start, MADV_WILLNEED);
+		}
+		memcpy(out + copied, data, span);
+		dropPages(data, span);
+		copied += span;
+		return true;
+	});
+	return copied;
+}
+
+size_t HugeFile::countLines(size_t offset, size_t length) const {
+	size_t lines = 0;
+	forEachSpan(offset, length, [&](const char *data, size_t span) {
+		const char *end = data + span;
+		while ((data = (const char *)memchr(data, '\n', end - data)) != nullptr) {
+			lines++;
+			data++;
+		}
+		return true;
+	});
+	return lines;
+}
+
+/*
+ * Adds checkpoints until they reach offset, and cover line, or the end
+ * of the text.
+ */
+void HugeFile::scan(size_t offset, size_t line) {
+	while (scanned < total && (scanned < offset || scanned_lines < line)) {
+		size_t length = std::min(CHECKPOINT_INTERVAL, total - scanned);
+		size_t lines = countLines(scanned, length);
+		forEachSpan(scanned, length, [&](const char *data, size_t span) {
+			dropPages(data, span);
+			return true;
+		});
+		scanned += length;
+		scanned_lines += lines;
+		checkpoints.push_back(Checkpoint{scanned, scanned_lines});
+	}
+}
+
+size_t HugeFile::lineAt(size_t offset) {
+	offset = std::min(offset, total);
+	scan(offset, 0);
+	auto checkpoint = std::upper_bound(checkpoints.begin(), checkpoints.end(), offset,
+		[](size_t offset, const Checkpoint &checkpoint) { return offset < checkpoint.offset; }) - 1;
+	return checkpoint->line + countLines(checkpoint->offset, offset - checkpoint->offset);
+}
+
+size_t HugeFile::lineStart(size_t line) {
+	if (line == 0) {
+		return 0;
+	}
+	scan(0, line);
+	auto checkpoint = std::lower_bound(checkpoints.begin(), checkpoints.end(), line,
+		[](const Checkpoint &checkpoint, size_t line) { return checkpoint.line < line; }) - 1;
+	size_t remaining = line - checkpoint->line;
+	size_t position = checkpoint->offset;
+	size_t start = position;
+	forEachSpan(position, total - position, [&](const char *data, size_t span) {
+		const char *found = data;
+		const char *end = data + span;
+		while ((found = (const char *)memchr(found, '\n', end - found)) != nullptr) {
+			found++;
+			start = position + (found - data);
+			if (--remaining == 0) {
+				return false;
+			}
+		}
+		position += span;
+		return true;
+	});
+	// a trailing newline doesn't start another line
+	if (start >= total && total > 0) {
+		return lineStartBefore(total - 1);
+	}
+	return start;
+}
+
+size_t HugeFile::lineStartBefore(size_t offset) const {
+	size_t search_start = offset > LINE_SEARCH ? offset - LINE_SEARCH : 0;
+	size_t position = search_start;
+	size_t start = search_start == 0 ? 0 : offset;
+	forEachSpan(search_start, offset - search_start, [&](const char *data, size_t span) {
+		const char *found = (const char *)memrchr(data, '\n', span);
+		if (found != nullptr) {
+			start = position + (found - data) + 1;
+		}
+		position += span;
+		return true;
+	});
+	return start;
+}
+
+size_t HugeFile::lineStartAfter(size_t offset) const {
+	size_t search_end = std::min(total, offset + LINE_SEARCH);
+	size_t position = offset;
+	size_t start = search_end == total ? total : offset;
+	forEachSpan(offset, search_end - offset, [&](const char *data, size_t span) {
+		const char *found = (const char *)memchr(data, '\n', span);
+		if (found != nullptr) {
+			start = position + (found - data) + 1;
+			return false;
+		}
+		position += span;
+		return true;
+	});
+	return start;
+}
+
+/*
+ * Splits the pieces around the replaced range and puts a piece for
+ * the new text between them. Checkpoints after the range shift along
+ * with it, ones inside it are dropped.
+ */
+Result HugeFile::replace(size_t offset, size_t old_length, const Snapshot &text) {
+	if (offset + old_length > total) {
+		return OUT_OF_BOUNDS;
+	}
+	size_t length = text.size();
+	Piece inserted = {nullptr, length};
+	if (length > 0) {
+		added.emplace_back(new char[length]);
+		text.copy(0, length, added.back().get());
+		inserted.data = added.back().get();
+	}
+	size_t end = offset + old_length;
+	long line_delta = 0;
+	if (scanned >= end) {
+		line_delta = -(long)countLines(offset, old_length);
+		const char *data = inserted.data;
+		for (const char *found = data; length > 0 &&
+			(found = (const char *)memchr(found, '\n', data + length - found)) != nullptr; found++) {
+			line_delta++;
+		}
+	}
+
+	std::vector<Piece> result;
+	result.reserve(pieces.size() + 2);
+	size_t position = 0;
+	bool placed = false;
+	for (const Piece &piece : pieces) {
+		if (position < offset) {
+			result.push_back(Piece{piece.data, std::min(piece.length, offset - position)});
+		}
+		if (!placed && position + piece.length >= offset) {
+			if (length > 0) {
+				result.push_back(inserted);
+			}
+			placed = true;
+		}
+		if (position + piece.length > end) {
+			size_t skip = end > position ? end - position : 0;
+			result.push_back(Piece{piece.data + skip, piece.length - skip});
+		}
+		position += piece.length;
+	}
+	if (!placed && length > 0) {
+		result.push_back(inserted);
+	}
+	pieces.swap(result);
+
+	if (scanned < end) {
+		while (checkpoints.size() > 1 && checkpoints.back().offset > offset) {
+			checkpoints.pop_back();
+		}
+	} else {
+		size_t kept = 0;
+		for (const Checkpoint &checkpoint : checkpoints) {
+			if (checkpoint.offset <= offset) {
+				checkpoints[kept++] = checkpoint;
+			} else if (checkpoint.offset >= end) {
+				checkpoints[kept++] = Checkpoint{checkpoint.offset - old_length + length, checkpoint.line + line_delta};
+			}
+		}
+		checkpoints.resize(kept);
+	}
+	scanned = checkpoints.back().offset;
+	scanned_lines = checkpoints.back().line;
+	total = total - old_length + length;
+	return SUCCESS;
+}
+
+void HugeFile::segments(std::vector<iovec> &out) const {
+	out.clear();
+	for (const Piece &piece : pieces) {
+		out.push_back(iovec{(void *)piece.data, piece.length});
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "defines.hpp"
+#include "snapshot.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+
+/* HugeFile
+ * A file too big to load, mapped read-only and edited through a piece
+ * table: the text is a list of pieces, each pointing into the map or
+ * into a block of added text, so an edit only ever adds a block and
+ * splits the pieces around it. Lines are found through sparse
+ * checkpoints, taken every CHECKPOINT_INTERVAL bytes as far as
+ * anything has needed to look, so opening the file never scans it.
+ * Mapped pages are dropped again as soon as they have been copied or
+ * scanned, and only the parts that are read get paged in.
+ * threshold: files at least this big are opened as huge files. A
+ *   quarter of RAM up to 1GB, or YADDA_HUGE_FILE_SIZE bytes.
+ * read: copies length bytes of the text, starting at offset.
+ * replace: replaces old_length bytes at offset with text.
+ * lineAt: the line, from 0, that offset is on.
+ * lineStart: the offset that line starts at, or the start of the last
+ *   line if there aren't that many.
+ * lineStartBefore: the start of the line that offset is on, or offset
+ *   itself if it's more than LINE_SEARCH bytes away.
+ * lineStartAfter: the start of the line after the one offset is on,
+ *   or offset itself if that's more than LINE_SEARCH bytes away.
+ * segments: the text as a list of spans, for writev. They stay valid
+ *   for as long as the HugeFile does.
+ * checkpoints: the offset and line of every checkpoint, in order.
+ *   scanned and scanned_lines are where the last one ends.
+ */
+class HugeFile {
+public:
+	~HugeFile();
+
+	static constexpr size_t CHECKPOINT_INTERVAL = 1 << 20;
+	static constexpr size_t LINE_SEARCH = 1 << 20;
+
+	static size_t threshold();
+
+	Result open(const std::string &filename);
+	size_t size() const { return total; }
+	size_t read(size_t offset, size_t length, char *out) const;
+	Result replace(size_t offset, size_t old_length, const Snapshot &text);
+	size_t lineAt(size_t offset);
+	size_t lineStart(size_t line);
+	size_t lineStartBefore(size_t offset) const;
+	size_t lineStartAfter(size_t offset) const;
+	void segments(std::vector<iovec> &out) const;
+
+private:
+	struct Piece {
+		const char *data;
+		size_t length;
+	};
+
+	struct Checkpoint {
+		size_t offset;
+		size_t line;
+	};
+
+	template <typename F>
+	void forEachSpan(size_t offset, size_t length, F f) const;
+	size_t countLines(size_t offset, size_t length) const;
+	void scan(size_t offset, size_t line);
+	void dropPages(const char *data, size_t length) const;
+
+	char *map = nullptr;
+	size_t map_length = 0;
+	size_t total = 0;
+	std::vector<Piece> pieces;
+	std::vector<std::unique_ptr<char[]>> added;
+	std::vector<Checkpoint> checkpoints;
+	size_t scanned = 0;
+	size_t scanned_lines = 0;
+};
@@ -0,0 +1,224 @@
+#include "keymap.hpp"
+
+#include "logger.hpp"
+
+#include <cstring>
+#include <strings.h>
+
+const char *ACTION_NAMES[static_cast<int>(Action::COUNT)] = {
+	"nop",
+	"count",
+	"down",
+	"up",
+	"left",
+	"right",
+	"home",
+	"end",
+	"goto-line",
+	"match-bracket",
+	"yank",
+	"delete",
+	"paste",
+	"insert",
+	"append",
+	"replace",
+	"command",
+	"escape",
+	"delete-forward",
+	"backspace",
+	"newline",
+	"confirm-selection",
+	"delete-selection",
+	"run-command",
+	"command-backspace",
+	"paste-response",
+	"next-view",
+	"undo",
+	"redo",
+	"register",
+	"cursor-matches",
+	"cursor-below",
+	"record-macro",
+	"stop-recording",
+	"run-macro",
+	"interrupt",
+};
+
+Action internAction(const char *name, size_t length) {
+	for (int i = 0; i < static_cast<int>(Action::COUNT); i++) {
+		if (strlen(ACTION_NAMES[i]) == length && memcmp(ACTION_NAMES[i], name, length) == 0) {
+			return static_cast<Action>(i);
+		}
+	}
+	return Action::COUNT;
+}
+
+KeyResult Keymap::feed(uint8_t byte, Action &action) {
+	if (ended) {
+		length = 0;
+		ended = false;
+	}
+	uint8_t next = in_nodes ? nodes[node].next[byte] : 0;
+	uint8_t user_next = in_user_nodes ? user_nodes[user_node].next[byte] : 0;
+	if (next == 0 && user_next == 0) {
+		// the longest bound sequence wins, the byte starts the next one
+		if (length > 0 && resolve(action)) {
+			reset();
+			return KeyResult::MATCHED_BEFORE;
+		}
+		if (length < MAX_SEQUENCE) {
+			sequence[length++] = byte;
+		}
+		restart();
+		ended = true;
+		return KeyResult::UNBOUND;
+	}
+	node = next;
+	user_node = user_next;
+	in_nodes = next != 0;
+	in_user_nodes = user_next != 0;
+	if (length < MAX_SEQUENCE) {
+		sequence[length++] = byte;
+	}
+	last = byte;
+	bool children = (in_nodes && nodes[node].children > 0) ||
+		(in_user_nodes && user_nodes[user_node].children > 0);
+	if (children) {
+		return KeyResult::PENDING;
+	}
+	bool bound = resolve(action);
+	restart();
+	if (bound) {
+		length = 0;
+		return KeyResult::MATCHED;
+	}
+	ended = true;
+	return KeyResult::UNBOUND;
+}
+
+bool Keymap::flush(Action &action) {
+	if (!pending()) {
+		return false;
+	}
+	bool bound = resolve(action);
+	restart();
+	if (bound) {
+		length = 0;
+	} else {
+		ended = true;
+	}
+	return bound;
+}
+
+void Keymap::reset() {
+	length = 0;
+	ended = false;
+	restart();
+}
+
+// back to the root, leaving the sequence for the caller
+void Keymap::restart() {
+	node = 0;
+	user_node = 0;
+	in_nodes = true;
+	in_user_nodes = !user_nodes.empty();
+}
+
+bool Keymap::resolve(Action &action) const {
+	if (in_user_nodes && user_nodes[user_node].bound) {
+		action = user_nodes[user_node].action;
+		return true;
+	}
+	if (in_nodes && nodes[node].bound) {
+		action = nodes[node].action;
+		return true;
+	}
+	return false;
+}
+
+bool Keymap::startsSequence(uint8_t byte) const {
+	return nodes[0].next[byte] != 0 || (!user_nodes.empty() && user_nodes[0].next[byte] != 0);
+}
+
+/*
+ * Binds keys to an action on top of the compiled bindings, adding
+ * nodes to the runtime trie as needed. Binding to Action::NONE
+ * turns a key off.
+ */
+Result Keymap::map(const char *keys, size_t key_length, Action action) {
+	if (key_length == 0 || key_length >= MAX_SEQUENCE) {
+		return INVALID_INPUT;
+	}
+	if (user_nodes.empty()) {
+		user_nodes.emplace_back();
+	}
+	size_t current = 0;
+	for (size_t i = 0; i < key_length; i++) {
+		uint8_t byte = keys[i];
+		if (user_nodes[current].next[byte] == 0) {
+			if (user_nodes.size() >= 256) {
+				Logger::error("too many key mappings!");
+				return OUT_OF_BOUNDS;
+			}
+			user_nodes[current].next[byte] = user_nodes.size();
+			user_nodes[current].children++;
+			user_nodes.emplace_back();
+		}
+		current = user_nodes[current].next[byte];
+	}
+	user_nodes[current].action = action;
+	user_nodes[current].bound = true;
+	reset();
+	return SUCCESS;
+}
+
+struct KeyName {
+	const char *name;
+	char key;
+};
+
+const KeyName KEY_NAMES[] = {
+	{"esc", '\033'},
+	{"cr", '\r'},
+	{"bs", '\x7f'},
+	{"tab", '\t'},
+	{"space", ' '},
+	{"lt", '<'},
+};
+
+/*
+ * Turns the keys of a mapping into bytes, up to the first end, which
+ * is a space unless a whole line of keys is being read.
+ * Special keys are written as <esc>, <cr>, <bs>, <tab>, <space> and
+ * <lt>. Returns the number of bytes, or 0 if the keys don't parse.
+ */
+size_t Keymap::parseKeys(const char *text, char *keys, size_t capacity, char end) {
+	size_t length = 0;
+	for (size_t i = 0; text[i] != '\0' && text[i] != end; i++) {
+		if (length >= capacity) {
+			return 0;
+		}
+		if (text[i] != '<') {
+			keys[length++] = text[i];
+			continue;
+		}
+		const char *close = strchr(&text[i], '>');
+		if (close == nullptr) {
+			return 0;
+		}
+		size_t name_length = close - &text[i + 1];
+		bool found = false;
+		for (const KeyName &name : KEY_NAMES) {
+			if (strlen(name.name) == name_length && strncasecmp(name.name, &text[i + 1], name_length) == 0) {
+				keys[length++] = name.key;
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			return 0;
+		}
+		i += name_length + 1;
+	}
+	return length;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "defines.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// what a key sequence does, run by Application::execute
+enum class Action : uint8_t {
+	NONE,
+	COUNT_DIGIT,
+	DOWN,
+	UP,
+	LEFT,
+	RIGHT,
+	HOME,
+	END,
+	GOTO_LINE,
+	MATCH_BRACKET,
+	YANK,
+	DELETE,
+	PASTE,
+	INSERT,
+	APPEND,
+	REPLACE,
+	COMMAND,
+	ESCAPE,
+	DELETE_FORWARD,
+	BACKSPACE,
+	NEWLINE,
+	CONFIRM_SELECTION,
+	DELETE_SELECTION,
+	RUN_COMMAND,
+	COMMAND_BACKSPACE,
+	PASTE_RESPONSE,
+	NEXT_VIEW,
+	UNDO,
+	REDO,
+	REGISTER,
+	CURSOR_MATCHES,
+	CURSOR_BELOW,
+	RECORD_MACRO,
+	STOP_RECORDING,
+	RUN_MACRO,
+	INTERRUPT,
+	COUNT,
+};
+
+extern const char *ACTION_NAMES[static_cast<int>(Action::COUNT)];
+
+Action internAction(const char *name, size_t length);
+
+struct Binding {
+	const char *keys;
+	Action action;
+};
+
+/* KeyNode
+ * One node of a keymap trie, the root is node 0.
+ * next: the child for each byte, 0 if there is none, since the root is
+ *   never anyone's child.
+ * children: how many of next are set.
+ * bound: whether the sequence ending here does anything. A node can be
+ *   bound and still have children, as "\033" is for "\033[A".
+ */
+struct KeyNode {
+	uint8_t next[256] = {0};
+	uint16_t children = 0;
+	Action action = Action::NONE;
+	bool bound = false;
+};
+
+constexpr size_t keyLength(const char *keys) {
+	size_t length = 0;
+	while (keys[length] != '\0') {
+		length++;
+	}
+	return length;
+}
+
+// an upper bound on the nodes needed, one per byte plus the root
+template <size_t M, size_t G>
+constexpr size_t trieSize(const Binding (&mode)[M], const Binding (&global)[G]) {
+	size_t size = 1;
+	for (const Binding &binding : mode) {
+		size += keyLength(binding.keys);
+	}
+	for (const Binding &binding : global) {
+		size += keyLength(binding.keys);
+	}
+	return size;
+}
+
+constexpr void trieInsert(KeyNode *nodes, size_t &size, const Binding &binding) {
+	size_t node = 0;
+	for (size_t i = 0; binding.keys[i] != '\0'; i++) {
+		uint8_t byte = binding.keys[i];
+		if (nodes[node].next[byte] == 0) {
+			nodes[node].next[byte] = size++;
+			nodes[node].children++;
+		}
+		node = nodes[node].next[byte];
+	}
+	// the first binding for a sequence wins, so modes can shadow globals
+	if (!nodes[node].bound) {
+		nodes[node].action = binding.action;
+		nodes[node].bound = true;
+	}
+}
+
+/*
+ * Builds the trie for a mode at compile time, from the mode's own
+ * bindings followed by the ones every mode shares.
+ */
+template <size_t N, size_t M, size_t G>
+constexpr std::array<KeyNode, N> buildTrie(const Binding (&mode)[M], const Binding (&global)[G]) {
+	static_assert(N <= 256, "keymap tries index their nodes with a byte");
+	std::array<KeyNode, N> nodes{};
+	size_t size = 1;
+	for (const Binding &binding : mode) {
+		trieInsert(nodes.data(), size, binding);
+	}
+	for (const Binding &binding : global) {
+		trieInsert(nodes.data(), size, binding);
+	}
+	return nodes;
+}
+
+enum class KeyResult {
+	PENDING,
+	MATCHED,
+	// matched the sequence before this byte, feed the byte again
+	MATCHED_BEFORE,
+	UNBOUND,
+};
+
+/* Keymap
+ * Turns the bytes read in a mode into actions, one byte at a time, by
+ * walking the mode's compile time trie and the runtime trie of user
+ * overrides side by side. Overrides win wherever both are bound.
+ * feed: steps along the sequence. A sequence that is bound and can't
+ *   go any further matches straight away, one that could still grow
+ *   stays pending until a byte that doesn't fit, or a flush. UNBOUND
+ *   leaves the bytes that went nowhere in sequence.
+ * flush: ends a pending sequence when no more input is coming, returns
+ *   true if it was bound. Otherwise sequence holds whatever was
+ *   pending, which is unbound.
+ * startsSequence: whether the byte does anything at the root, callers
+ *   that insert unbound bytes use it to find how many they can take.
+ * map: binds keys to an action for this mode at runtime.
+ * sequence, length: the bytes of the sequence so far.
+ * last: the last byte that went into a sequence, so actions like
+ *   count digits can tell which key ran them.
+ */
+class Keymap {
+public:
+	Keymap(const KeyNode *nodes = nullptr) : nodes(nodes) {}
+
+	KeyResult feed(uint8_t byte, Action &action);
+	bool flush(Action &action);
+	void reset();
+	bool pending() const { return length > 0 && !ended; }
+	bool startsSequence(uint8_t byte) const;
+	Result map(const char *keys, size_t key_length, Action action);
+
+	static size_t parseKeys(const char *text, char *keys, size_t capacity, char end = ' ');
+
+	static constexpr size_t MAX_SEQUENCE = 16;
+	char sequence[MAX_SEQUENCE] = {0};
+	size_t length = 0;
+	uint8_t last = 0;
+
+private:
+	bool resolve(Action &action) const;
+	void restart();
+
+	const KeyNode *nodes;
+	std::vector<KeyNode> user_nodes;
+	uint8_t node = 0;
+	uint8_t user_node = 0;
+	bool in_nodes = true;
+	bool in_user_nodes = false;
+	bool ended = false;
+};
@@ -0,0 +1,187 @@
+#include "line_cache.hpp"
+
+#include "logger.hpp"
+#include "terminal.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <unistd.h>
+#include <vector>
+
+static uint64_t hashBytes(uint64_t hash, const char *data, size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/*
+ * Hashes SAMPLE_COUNT spans spread evenly over the text, and its last
+ * bytes. Where they go only depends on length, so the text a file had
+ * before it grew hashes the same as long as it hasn't changed.
+ */
+uint64_t LineCache::sampleHash(const char *text, size_t length) {
+	uint64_t hash = hashBytes(0xcbf29ce484222325ull, (const char *)&length, sizeof(length));
+	for (size_t i = 0; i < SAMPLE_COUNT; i++) {
+		size_t offset = length / SAMPLE_COUNT * i;
+		hash = hashBytes(hash, &text[offset], std::min(SAMPLE_SIZE, length - offset));
+	}
+	size_t tail = std::min(SAMPLE_SIZE, length);
+	return hashBytes(hash, &text[length - tail], tail);
+}
+
+void LineCache::open(const std::string &filename, const struct stat &info, const char *text, size_t length) {
+	if (length < MIN_SIZE) {
+		return;
+	}
+	char *resolved = realpath(filename.c_str(), nullptr);
+	if (resolved == nullptr) {
+		return;
+	}
+	std::string full_path = resolved;
+	free(resolved);
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (cache_home != nullptr && cache_home[0] != '\0') {
+		path = std::string(cache_home) + "/yadda/";
+	} else if (home != nullptr) {
+		path = std::string(home) + "/.cache/yadda/";
+	} else {
+		return;
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.lines",
+		(unsigned long long)hashBytes(0xcbf29ce484222325ull, full_path.data(), full_path.length()));
+	path += name;
+
+	header.device = info.st_dev;
+	header.inode = info.st_ino;
+	header.size = length;
+	header.mtime = (uint64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+	header.sample = sampleHash(text, length);
+
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	struct stat cache_info;
+	Header found;
+	bool usable = fstat(fd, &cache_info) == 0 && pread(fd, &found, sizeof(found), 0) == sizeof(found) &&
+		memcmp(found.magic, header.magic, sizeof(found.magic)) == 0 && found.version == header.version &&
+		(uint64_t)cache_info.st_size >= sizeof(found) && found.count <= (uint64_t)cache_info.st_size &&
+		found.device == header.device && found.inode == header.inode;
+	if (usable) {
+		bool hit = found.size == header.size && found.mtime == header.mtime && found.sample == header.sample;
+		// only appended to, what was there before is still where it was
+		bool grew = found.size < header.size && found.size > 0 && found.sample == sampleHash(text, found.size);
+		usable = hit || grew;
+	}
+	if (!usable) {
+		close(fd);
+		return;
+	}
+	size_t length_read = cache_info.st_size - sizeof(found);
+	std::unique_ptr<uint8_t[]> encoded(new uint8_t[length_read]);
+	bool read = pread(fd, encoded.get(), length_read, sizeof(found)) == (ssize_t)length_read;
+	// used, so it's the last to be pruned
+	if (read) {
+		futimens(fd, nullptr);
+	}
+	close(fd);
+	// a cache from some other version, or a torn or damaged one, can't be trusted
+	if (!read || !cached_starts.deserialize(encoded.get(), length_read, found.count) ||
+		(!cached_starts.empty() && cached_starts.back() >= found.size)) {
+		Logger::warn("ignoring a line cache that doesn't hold together");
+		cached_starts.clear();
+		return;
+	}
+	cached_length = found.size;
+	debug("line cache covers ", cached_length);
+}
+
+/*
+ * Brings the cache up to date with the text that was opened, given the
+ * gap buffer's post_cursor_lines right after loading it. The cache is
+ * written to a temporary file and renamed into place, so a torn write
+ * can only leave the old one.
+ */
+void LineCache::store(const LineIndex &lines, size_t length) {
+	if (path.empty() || cached_length == length || Terminal::headless()) {
+		return;
+	}
+	// lines is in the gap buffer's order, the line nearest the end first
+	LineIndex starts;
+	starts.reserve(lines.size(), lines.byteCount());
+	for (size_t i = lines.size(); i-- > 0;) {
+		starts.push_back(length - lines[i]);
+	}
+	header.count = starts.size();
+	std::vector<uint8_t> encoded(starts.serializedSize());
+	starts.serialize(encoded.data());
+
+	size_t slash = path.rfind('/');
+	std::string directory = path.substr(0, slash);
+	// the cache directory, and the one it's in if that's ~/.cache
+	mkdir(directory.substr(0, directory.rfind('/')).c_str(), 0700);
+	mkdir(directory.c_str(), 0700);
+	std::string temp_path = path + ".XXXXXX";
+	int fd = mkstemp(temp_path.data());
+	if (fd < 0) {
+		return;
+	}
+	bool result = pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+		pwrite(fd, encoded.data(), encoded.size(), sizeof(header)) == (ssize_t)encoded.size();
+	if (close(fd) != 0 || !result || rename(temp_path.c_str(), path.c_str()) != 0) {
+		Logger::warn("failed to write the line cache");
+		unlink(temp_path.c_str());
+		return;
+	}
+	prune(directory);
+}
+
+// removes the caches used longest ago until the rest fit in MAX_TOTAL_SIZE
+void LineCache::prune(const std::string &directory) {
+	DIR *dir = opendir(directory.c_str());
+	if (dir == nullptr) {
+		return;
+	}
+	struct Entry {
+		std::string path;
+		uint64_t mtime;
+		size_t size;
+	};
+	std::vector<Entry> entries;
+	size_t total = 0;
+	dirent *entry;
+	while ((entry = readdir(dir)) != nullptr) {
+		size_t name_length = strlen(entry->d_name);
+		if (name_length < 6 || strcmp(&entry->d_name[name_length - 6], ".lines") != 0) {
+			continue;
+		}
+		std::string entry_path = directory + "/" + entry->d_name;
+		struct stat info;
+		if (stat(entry_path.c_str(), &info) != 0) {
+			continue;
+		}
+		entries.push_back(Entry{entry_path, (uint64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec, (size_t)info.st_size});
+		total += info.st_size;
+	}
+	closedir(dir);
+	if (total <= MAX_TOTAL_SIZE) {
+		return;
+	}
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.mtime < b.mtime; });
+	for (const Entry &old : entries) {
+		if (total <= MAX_TOTAL_SIZE || old.path == path) {
+			break;
+		}
+		if (unlink(old.path.c_str()) == 0) {
+			total -= old.size;
+		}
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "defines.hpp"
+#include "line_index.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+
+/* LineCache
+ * The line index of a file, kept on disk so opening the file again
+ * doesn't have to look for its newlines. A cache file is a header
+ * followed by the offset of every line start but the first, encoded
+ * as a LineIndex, so it takes about a byte a line. It lives in
+ * $XDG_CACHE_HOME/yadda (or ~/.cache/yadda), named after a hash of the
+ * file's full path, and is only kept for files of at least MIN_SIZE.
+ * Writing one prunes the least recently used caches until they all
+ * fit in MAX_TOTAL_SIZE.
+ * open: finds the cache for a file that's been read into text. It's a
+ *   hit if the device, inode, size, mtime and a hash of SAMPLE_COUNT
+ *   spans of the text all match, and a partial hit if the file only
+ *   grew and the text it had still hashes the same, as a log's does.
+ *   Starts that don't go up, or run past the text, are ignored.
+ * starts: the line starts that were cached.
+ * indexed: how many bytes of the text the cached starts cover, the
+ *   rest still needs indexing. 0 if there was nothing usable.
+ * store: writes the index of the whole text, from the gap buffer's
+ *   post_cursor_lines once it's loaded. A batch run only reads caches.
+ */
+class LineCache {
+public:
+	static constexpr size_t MIN_SIZE = 1 << 20;
+	static constexpr size_t SAMPLE_COUNT = 64;
+	static constexpr size_t SAMPLE_SIZE = 256;
+	static constexpr size_t MAX_TOTAL_SIZE = 64 << 20;
+
+	void open(const std::string &filename, const struct stat &info, const char *text, size_t length);
+	const LineIndex &starts() const { return cached_starts; }
+	size_t indexed() const { return cached_length; }
+	void store(const LineIndex &lines, size_t length);
+
+private:
+	struct Header {
+		char magic[8] = {'Y', 'A', 'D', 'D', 'A', 'L', 'I', 'X'};
+		uint32_t version = 2;
+		uint32_t padding = 0;
+		uint64_t device = 0;
+		uint64_t inode = 0;
+		uint64_t size = 0;
+		uint64_t mtime = 0;
+		uint64_t sample = 0;
+		uint64_t count = 0;
+	};
+
+	static uint64_t sampleHash(const char *text, size_t length);
+	void prune(const std::string &directory);
+
+	std::string path;
+	Header header;
+	LineIndex cached_starts;
+	size_t cached_length = 0;
+};
@@ -0,0 +1,225 @@
+#include "line_index.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+static size_t decode(const uint8_t *bytes, size_t &position) {
+	size_t value = 0;
+	int shift = 0;
+	while (bytes[position] & 0x80) {
+		value |= (size_t)(bytes[position++] & 0x7F) << shift;
+		shift += 7;
+	}
+	value |= (size_t)bytes[position++] << shift;
+	return value;
+}
+
+// the value at index in block, decoded from its base, and where its delta ends
+size_t LineIndex::blockValue(size_t block, size_t index, size_t &position) const {
+	size_t value = blocks[block].base;
+	position = blocks[block].offset;
+	for (size_t i = 0; i < index; i++) {
+		value += decode(deltas.data(), position);
+	}
+	return value;
+}
+
+size_t LineIndex::at(size_t index) const {
+	if (index == cached_index) {
+		return cached_value;
+	}
+	size_t in_block = index % BLOCK_LINES;
+	if (cached_index != SIZE_MAX && index == cached_index + 1 && in_block != 0) {
+		cached_value += decode(deltas.data(), cached_end);
+	} else if (cached_index != SIZE_MAX && index + 1 == cached_index && cached_index % BLOCK_LINES != 0) {
+		// back over the delta of the cached line, to the end of the one before it
+		size_t start = cached_end - 1;
+		while (start > blocks[index / BLOCK_LINES].offset && (deltas[start - 1] & 0x80)) {
+			start--;
+		}
+		size_t position = start;
+		cached_value -= decode(deltas.data(), position);
+		cached_end = start;
+	} else {
+		cached_value = blockValue(index / BLOCK_LINES, in_block, cached_end);
+	}
+	cached_index = index;
+	return cached_value;
+}
+
+size_t LineIndex::upper_bound(size_t value) const {
+	auto block = std::upper_bound(blocks.begin(), blocks.end(), value,
+		[](size_t value, const Block &block) { return value < block.base; });
+	if (block == blocks.begin()) {
+		return 0;
+	}
+	size_t block_index = block - blocks.begin() - 1;
+	size_t index = block_index * BLOCK_LINES;
+	size_t end = std::min(count, index + BLOCK_LINES);
+	size_t current = blocks[block_index].base;
+	size_t position = blocks[block_index].offset;
+	for (index++; index < end; index++) {
+		current += decode(deltas.data(), position);
+		if (current > value) {
+			break;
+		}
+	}
+	return index;
+}
+
+void LineIndex::push_back(size_t value) {
+	if (count % BLOCK_LINES == 0) {
+		blocks.push_back(Block{value, deltas.size()});
+	} else {
+		// a value out of order wraps around, and still decodes to itself
+		size_t delta = value - last;
+		while (delta >= 0x80) {
+			deltas.push_back((delta & 0x7F) | 0x80);
+			delta >>= 7;
+		}
+		deltas.push_back(delta);
+	}
+	count++;
+	last = value;
+}
+
+void LineIndex::pop_back() {
+	count--;
+	if (cached_index >= count) {
+		cached_index = SIZE_MAX;
+	}
+	if (count % BLOCK_LINES == 0) {
+		blocks.pop_back();
+		if (count > 0) {
+			size_t position;
+			last = blockValue(blocks.size() - 1, BLOCK_LINES - 1, position);
+		}
+		return;
+	}
+	size_t start = deltas.size() - 1;
+	while (start > blocks.back().offset && (deltas[start - 1] & 0x80)) {
+		start--;
+	}
+	size_t position = start;
+	last -= decode(deltas.data(), position);
+	deltas.resize(start);
+}
+
+void LineIndex::truncate(size_t size) {
+	if (size >= count) {
+		return;
+	}
+	if (size == 0) {
+		clear();
+		return;
+	}
+	if (cached_index >= size) {
+		cached_index = SIZE_MAX;
+	}
+	size_t block = (size - 1) / BLOCK_LINES;
+	size_t end;
+	last = blockValue(block, (size - 1) % BLOCK_LINES, end);
+	blocks.resize(block + 1);
+	deltas.resize(end);
+	count = size;
+}
+
+void LineIndex::clear() {
+	blocks.clear();
+	deltas.clear();
+	count = 0;
+	last = 0;
+	cached_index = SIZE_MAX;
+}
+
+// with a block of slack, so lines added by editing fit too
+void LineIndex::reserve(size_t lines, size_t bytes) {
+	blocks.reserve(lines / BLOCK_LINES + 2);
+	deltas.reserve(bytes + BLOCK_LINES * 2);
+}
+
+void LineIndex::shift(size_t delta) {
+	for (Block &block : blocks) {
+		block.base += delta;
+	}
+	last += delta;
+	cached_value += delta;
+}
+
+void LineIndex::prepend(const std::vector<size_t> &values) {
+	if (values.empty()) {
+		return;
+	}
+	LineIndex index;
+	index.reserve(values.size() + count, deltas.size() + values.size());
+	for (size_t value : values) {
+		index.push_back(value);
+	}
+	for (size_t i = 0; i < count; i++) {
+		index.push_back(at(i));
+	}
+	*this = std::move(index);
+}
+
+void LineIndex::serialize(uint8_t *data) const {
+	for (const Block &block : blocks) {
+		uint64_t pair[2] = {block.base, block.offset};
+		memcpy(data, pair, sizeof(pair));
+		data += sizeof(pair);
+	}
+	memcpy(data, deltas.data(), deltas.size());
+}
+
+/*
+ * Nothing in data is trusted, so every delta is decoded with its
+ * bounds checked before the blocks and deltas are taken as they are.
+ */
+bool LineIndex::deserialize(const uint8_t *data, size_t length, size_t size) {
+	clear();
+	size_t block_count = (size + BLOCK_LINES - 1) / BLOCK_LINES;
+	if (block_count > length / (2 * sizeof(uint64_t))) {
+		return false;
+	}
+	const uint8_t *bytes = data + block_count * 2 * sizeof(uint64_t);
+	size_t byte_count = length - block_count * 2 * sizeof(uint64_t);
+	blocks.resize(block_count);
+	size_t position = 0;
+	size_t value = 0;
+	for (size_t i = 0; i < size; i++) {
+		if (i % BLOCK_LINES == 0) {
+			uint64_t pair[2];
+			memcpy(pair, &data[i / BLOCK_LINES * sizeof(pair)], sizeof(pair));
+			if ((i > 0 && pair[0] <= value) || pair[1] != position) {
+				clear();
+				return false;
+			}
+			blocks[i / BLOCK_LINES] = Block{pair[0], pair[1]};
+			value = pair[0];
+			continue;
+		}
+		size_t delta = 0;
+		int shift = 0;
+		while (position < byte_count && (bytes[position] & 0x80) && shift < 63) {
+			delta |= (size_t)(bytes[position++] & 0x7F) << shift;
+			shift += 7;
+		}
+		if (position == byte_count || (bytes[position] & 0x80)) {
+			clear();
+			return false;
+		}
+		delta |= (size_t)bytes[position++] << shift;
+		if (delta == 0 || value + delta < value) {
+			clear();
+			return false;
+		}
+		value += delta;
+	}
+	if (position != byte_count) {
+		clear();
+		return false;
+	}
+	deltas.assign(bytes, bytes + byte_count);
+	count = size;
+	last = value;
+	return true;
+}
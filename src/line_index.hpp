@@ -0,0 +1,76 @@
+#pragma once
+
+#include "defines.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* LineIndex
+ * A sorted list of line starts, as the two sides of a gap buffer keep
+ * them, in a fraction of the memory of a size_t per line. The lines are
+ * split into blocks of BLOCK_LINES, each holding the absolute value of
+ * its first line, and the rest as varint differences from the line
+ * before, which are line lengths and mostly fit in a byte. Only the end
+ * changes, like a stack, apart from shift and prepend.
+ * at, operator[]: the value at index, decoding at most one block.
+ *   Walking the lines in either direction decodes each only once.
+ * upper_bound: how many values are no more than value, by a binary
+ *   search over the block bases and then one block.
+ * reserve: makes room for lines lines taking up bytes of deltas, so
+ *   pushing that many doesn't allocate.
+ * truncate: drops every value from index size on, in one cut.
+ * shift: adds delta to every value, only touching the block bases.
+ * prepend: puts values, which are all smaller, in front of the rest.
+ * serializedSize, serialize: the blocks as 64 bit pairs of base and
+ *   offset, then the deltas as they are, for writing to disk.
+ * deserialize: reads size values back from what serialize wrote,
+ *   checking that it holds together and that every value is bigger
+ *   than the last. False, leaving the index empty, if it doesn't.
+ */
+class LineIndex {
+public:
+	static constexpr size_t BLOCK_LINES = 64;
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	size_t back() const { return last; }
+	size_t front() const { return blocks.front().base; }
+	size_t at(size_t index) const;
+	size_t operator[](size_t index) const { return at(index); }
+	size_t upper_bound(size_t value) const;
+	void push_back(size_t value);
+	void pop_back();
+	void truncate(size_t size);
+	void clear();
+	void reserve(size_t lines, size_t bytes);
+	void shift(size_t delta);
+	void prepend(const std::vector<size_t> &values);
+	size_t byteCount() const { return deltas.size(); }
+	size_t memoryUsage() const { return blocks.capacity() * sizeof(Block) + deltas.capacity(); }
+	size_t serializedSize() const { return blocks.size() * 2 * sizeof(uint64_t) + deltas.size(); }
+	void serialize(uint8_t *data) const;
+	bool deserialize(const uint8_t *data, size_t length, size_t size);
+
+private:
+	/* Block
+	 * base: the first value in the block.
+	 * offset: where the deltas of the rest start.
+	 */
+	struct Block {
+		size_t base;
+		size_t offset;
+	};
+
+	size_t blockValue(size_t block, size_t index, size_t &position) const;
+
+	std::vector<Block> blocks;
+	std::vector<uint8_t> deltas;
+	size_t count = 0;
+	size_t last = 0;
+
+	// the last value looked up, and where its delta ends
+	mutable size_t cached_index = SIZE_MAX;
+	mutable size_t cached_value = 0;
+	mutable size_t cached_end = 0;
+};
@@ -1,6 +1,24 @@
 #include "logger.hpp"
 
+#include <chrono>
+#include <string>
+#include <unordered_set>
+
+// rotate the log instead of letting it grow forever
+constexpr size_t MAX_LOG_FILE_SIZE = 16 * 1024 * 1024;
+
+Logger::Slot Logger::slots[Logger::CAPACITY];
+std::atomic<uint64_t> Logger::enqueue_position = 0;
+uint64_t Logger::dequeue_position = 0;
+std::atomic<uint64_t> Logger::dropped = 0;
+std::atomic<bool> Logger::stopping = false;
+std::thread Logger::drain_thread;
 FILE *Logger::log_file = nullptr;
+const char *Logger::log_file_name = nullptr;
+size_t Logger::log_file_size = 0;
+
+// the drain thread writes each format string once per file
+static std::unordered_set<const char *> written_strings;
 
 Result Logger::init(const char *log_file_name) {
 #ifndef NDEBUG
@@ -10,10 +28,17 @@ Result Logger::init(const char *log_file_name) {
 		return IO_ERROR;
 	}
 #endif
-	log_file = fopen(log_file_name, "w+");
-	if (log_file == nullptr) {
+	for (size_t i = 0; i < CAPACITY; i++) {
+		slots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	enqueue_position = 0;
+	dequeue_position = 0;
+	Logger::log_file_name = log_file_name;
+	if (openFile() != SUCCESS) {
 		return IO_ERROR;
 	}
+	stopping = false;
+	drain_thread = std::thread(drain);
 	info("logger initialized.");
 	return SUCCESS;
 }
@@ -25,55 +50,117 @@ void Logger::deinit() {
 	}
 #endif
 	info("logger shutdown");
-	fflush(log_file);
+	stopping = true;
+	if (drain_thread.joinable()) {
+		drain_thread.join();
+	}
 	fclose(log_file);
 	log_file = nullptr;
 }
 
-void Logger::fatal(const char *message) {
-#ifndef NDEBUG
+Result Logger::openFile() {
+	log_file = fopen(log_file_name, "wb");
 	if (log_file == nullptr) {
-		return; // TODO: report error
-	} else if (message == nullptr) {
-		error("invalid logging message");
-		return;
+		return IO_ERROR;
 	}
-#endif
-	fprintf(log_file, "[FATAL]:%s\n", message);
+	LogFileHeader header;
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	header.monotonic_base = (uint64_t)time.tv_sec * 1000000000ull + time.tv_nsec;
+	clock_gettime(CLOCK_REALTIME, &time);
+	header.realtime_base = (uint64_t)time.tv_sec * 1000000000ull + time.tv_nsec;
+	fwrite(&header, sizeof(header), 1, log_file);
+	log_file_size = sizeof(header);
+	written_strings.clear();
+	return SUCCESS;
 }
 
-void Logger::error(const char *message) {
-#ifndef NDEBUG
-	if (log_file == nullptr) {
-		return; // TODO: report error
-	} else if (message == nullptr) {
-		error("invalid logging message");
-		return;
+/*
+ * Claims a slot by bumping enqueue_position, copies the record in,
+ * and publishes it through the slot's sequence number. Never blocks.
+ */
+void Logger::push(const LogRecord &record) {
+	uint64_t position = enqueue_position.load(std::memory_order_relaxed);
+	Slot *slot;
+	for (;;) {
+		slot = &slots[position % CAPACITY];
+		uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+		int64_t difference = (int64_t)sequence - (int64_t)position;
+		if (difference == 0) {
+			if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				break;
+			}
+		} else if (difference < 0) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		} else {
+			position = enqueue_position.load(std::memory_order_relaxed);
+		}
 	}
-#endif
-	fprintf(log_file, "[ERROR]:%s\n", message);
+	slot->record = record;
+	slot->sequence.store(position + 1, std::memory_order_release);
 }
 
-void Logger::warn(const char *message) {
-#ifndef NDEBUG
-	if (log_file == nullptr) {
-		return; // report error
-	} else if (message == nullptr) {
-		error("invalid logging message");
+static void writeString(FILE *file, const char *string, size_t &file_size) {
+	if (string == nullptr || written_strings.count(string)) {
 		return;
 	}
-#endif
-	fprintf(log_file, "[WARN]:%s\n", message);
+	written_strings.insert(string);
+	uint64_t address = (uintptr_t)string;
+	uint32_t length = strlen(string);
+	fputc('S', file);
+	fwrite(&address, sizeof(address), 1, file);
+	fwrite(&length, sizeof(length), 1, file);
+	fwrite(string, 1, length, file);
+	file_size += 1 + sizeof(address) + sizeof(length) + length;
 }
 
-void Logger::info(const char *message) {
-#ifndef NDEBUG
-	if (log_file == nullptr) {
-		return; // TODO: report error
-	} else if (message == nullptr) {
-		error("invalid logging message");
-		return;
+/*
+ * Moves everything in the ring into the file, returns the number of
+ * records written. Only ever called from the drain thread.
+ */
+size_t Logger::flush() {
+	size_t count = 0;
+	for (;;) {
+		Slot &slot = slots[dequeue_position % CAPACITY];
+		if (slot.sequence.load(std::memory_order_acquire) != dequeue_position + 1) {
+			break;
+		}
+		LogRecord record = slot.record;
+		slot.sequence.store(dequeue_position + CAPACITY, std::memory_order_release);
+		dequeue_position++;
+		count++;
+
+		if (log_file_size > MAX_LOG_FILE_SIZE) {
+			fclose(log_file);
+			std::string old_name = std::string(log_file_name) + ".1";
+			rename(log_file_name, old_name.c_str());
+			if (openFile() != SUCCESS) {
+				return count;
+			}
+		}
+		writeString(log_file, record.format, log_file_size);
+		fputc('R', log_file);
+		fwrite(&record, sizeof(record), 1, log_file);
+		log_file_size += 1 + sizeof(record);
 	}
-#endif
-	fprintf(log_file, "[INFO]:%s\n", message);
+	uint64_t dropped_count = dropped.exchange(0, std::memory_order_relaxed);
+	if (dropped_count > 0) {
+		fputc('D', log_file);
+		fwrite(&dropped_count, sizeof(dropped_count), 1, log_file);
+		log_file_size += 1 + sizeof(dropped_count);
+	}
+	if (count > 0 || dropped_count > 0) {
+		fflush(log_file);
+	}
+	return count;
+}
+
+void Logger::drain() {
+	while (!stopping.load(std::memory_order_acquire)) {
+		if (flush() == 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+	flush();
 }
\ No newline at end of file
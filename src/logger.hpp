@@ -2,34 +2,194 @@
 
 #include "defines.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <source_location>
-#include <utility>
-#include <typeinfo>
+#include <thread>
+#include <type_traits>
 
+enum class LogLevel : uint8_t {
+	DEBUG = 0,
+	INFO,
+	WARN,
+	ERROR,
+	FATAL,
+};
+
+// anything below this level is compiled out
+#ifndef YADDA_LOG_LEVEL
+#ifdef NDEBUG
+#define YADDA_LOG_LEVEL 1
+#else
+#define YADDA_LOG_LEVEL 0
+#endif
+#endif
+
+enum LogArg : uint8_t {
+	LOG_INT = 0,
+	LOG_UINT,
+	LOG_DOUBLE,
+	LOG_POINTER,
+};
+
+/* LogRecord
+ * A single fixed-size log entry, copied into the ring buffer by the
+ * thread that logs it. format must be a string literal: only its
+ * address is stored, the drain thread writes each format string to
+ * the file once, and the decoder matches records up by address.
+ * arg_types: a LogArg for each of the arg_count args.
+ * text: holds a copied string instead of args when arg_count is
+ *   LOG_TEXT, for messages that aren't known at compile time.
+ */
+struct LogRecord {
+	static constexpr uint8_t LOG_TEXT = 0xFF;
+	static constexpr size_t MAX_ARGS = 5;
+
+	uint64_t timestamp;
+	const char *format;
+	LogLevel level;
+	uint8_t arg_count;
+	uint8_t arg_types[6];
+	union {
+		uint64_t args[MAX_ARGS];
+		char text[MAX_ARGS * sizeof(uint64_t)];
+	};
+};
+static_assert(sizeof(LogRecord) == 64, "log records are written to disk as is");
+
+/* Log file layout
+ * LogFileHeader, then a stream of tagged entries: 'S' is followed by
+ * a u64 address, a u32 length and the string itself, 'R' by a raw
+ * LogRecord, and 'D' by a u64 count of records dropped because the
+ * ring buffer was full.
+ */
+struct LogFileHeader {
+	char magic[4] = {'Y', 'L', 'O', 'G'};
+	uint32_t version = 1;
+	uint64_t monotonic_base = 0;
+	uint64_t realtime_base = 0;
+};
+
+/* Logger
+ * Logging only copies a LogRecord into a lock-free ring buffer
+ * (a bounded multi-producer queue), which a background thread drains
+ * into the binary log file. Records are dropped, and counted, rather
+ * than blocking when the ring is full. Levels below YADDA_LOG_LEVEL
+ * compile to nothing. bin/yadda-logdump renders the file as text.
+ */
 class Logger {
 public:
-	static Result init(const char *log_file_name = "/home/andrew/Code/Yadda/v3/yadda.log");
+	static Result init(const char *log_file_name = "yadda.ylog");
 	static void deinit();
 
-	static void fatal(const char *message = "");
-	static void error(const char *message = "");
-	static void warn(const char *message = "");
-	static void info(const char *message = "");
-	template <typename T> static void logParam(T t) {
-		fprintf(log_file, "unknown param of type: %s, located at: %p", typeid(T).name(), (void *)t);
+	template <LogLevel level, typename... Args> static void log(const char *format, Args... args) {
+		if constexpr (static_cast<int>(level) >= YADDA_LOG_LEVEL) {
+			static_assert(sizeof...(Args) <= LogRecord::MAX_ARGS, "too many log arguments");
+			LogRecord record;
+			record.timestamp = now();
+			record.format = format;
+			record.level = level;
+			record.arg_count = sizeof...(Args);
+			size_t i = 0;
+			((record.arg_types[i] = argType<Args>(), record.args[i] = argBits(args), i++), ...);
+			(void)i;
+			push(record);
+		}
 	}
-	template <typename... Args> static void _debug(const std::source_location location, Args... args) {
-		// doesn't need #ifndef preamble since this function doesn't get called outside of debug mode
-		if (log_file == nullptr) {
-			printf("can I see the error!\n");
-			return; // TODO: handle this error!
+	template <LogLevel level> static void text(const char *format, const char *text) {
+		if constexpr (static_cast<int>(level) >= YADDA_LOG_LEVEL) {
+			LogRecord record;
+			record.timestamp = now();
+			record.format = format;
+			record.level = level;
+			record.arg_count = LogRecord::LOG_TEXT;
+			strncpy(record.text, text ? text : "", sizeof(record.text) - 1);
+			record.text[sizeof(record.text) - 1] = '\0';
+			push(record);
 		}
-		fprintf(log_file, "[DEBUG]:[%s]:[%s]:[%i,%i]:", location.file_name(), location.function_name(), location.line(), location.column());
+	}
+
+	template <typename... Args> static void fatal(const char *format, Args... args) { log<LogLevel::FATAL>(format, args...); }
+	template <typename... Args> static void error(const char *format, Args... args) { log<LogLevel::ERROR>(format, args...); }
+	template <typename... Args> static void warn(const char *format, Args... args) { log<LogLevel::WARN>(format, args...); }
+	template <typename... Args> static void info(const char *format, Args... args) { log<LogLevel::INFO>(format, args...); }
+
+	template <typename... Args> static void _debug(const std::source_location location, Args... args) {
+		char message[sizeof(LogRecord::text)] = {0};
+		size_t length = 0;
+		(appendParam(message, length, args), ...);
+		text<LogLevel::DEBUG>(location.function_name(), message);
+	}
+
+	static uint64_t now() {
+		timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return (uint64_t)time.tv_sec * 1000000000ull + time.tv_nsec;
 	}
 
 private:
+	static constexpr size_t CAPACITY = 4096;
+
+	struct alignas(64) Slot {
+		std::atomic<uint64_t> sequence;
+		LogRecord record;
+	};
+
+	template <typename T> static constexpr uint8_t argType() {
+		static_assert(!std::is_same_v<std::decay_t<T>, const char *> && !std::is_same_v<std::decay_t<T>, char *>,
+			"strings have to be copied with Logger::text");
+		if constexpr (std::is_floating_point_v<T>) return LOG_DOUBLE;
+		else if constexpr (std::is_pointer_v<T>) return LOG_POINTER;
+		else if constexpr (std::is_enum_v<T> || std::is_signed_v<T>) return LOG_INT;
+		else return LOG_UINT;
+	}
+	template <typename T> static uint64_t argBits(T value) {
+		uint64_t bits = 0;
+		if constexpr (std::is_floating_point_v<T>) {
+			double d = value;
+			memcpy(&bits, &d, sizeof(d));
+		} else if constexpr (std::is_pointer_v<T>) {
+			bits = (uintptr_t)value;
+		} else {
+			bits = (uint64_t)(int64_t)value;
+		}
+		return bits;
+	}
+	template <typename T> static void appendParam(char *message, size_t &length, T param) {
+		size_t space = sizeof(LogRecord::text) - length;
+		int written = 0;
+		if constexpr (std::is_convertible_v<T, const char *>) {
+			written = snprintf(&message[length], space, "%s", (const char *)param);
+		} else if constexpr (std::is_floating_point_v<T>) {
+			written = snprintf(&message[length], space, "%g", (double)param);
+		} else if constexpr (std::is_pointer_v<T>) {
+			written = snprintf(&message[length], space, "%p", (const void *)param);
+		} else {
+			written = snprintf(&message[length], space, "%lld", (long long)param);
+		}
+		if (written > 0) {
+			length = std::min(length + written, sizeof(LogRecord::text) - 1);
+		}
+	}
+
+	static void push(const LogRecord &record);
+	static void drain();
+	static size_t flush();
+	static Result openFile();
+
+	static Slot slots[CAPACITY];
+	static std::atomic<uint64_t> enqueue_position;
+	static uint64_t dequeue_position;
+	static std::atomic<uint64_t> dropped;
+	static std::atomic<bool> stopping;
+	static std::thread drain_thread;
 	static FILE *log_file;
+	static const char *log_file_name;
+	static size_t log_file_size;
 };
 
 #ifndef NDEBUG
@@ -1,10 +1,16 @@
 #include "app.hpp"
+#include "alloc_stats.hpp"
 #include "logger.hpp"
+#include "terminal.hpp"
+#include "trace.hpp"
 
 #include "gap_buffer.hpp"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <string>
+#include <vector>
 
 int testGapBufferTiny() {
 	GapBuffer gap_buffer;
@@ -113,11 +119,97 @@ int testGapBufferInsertTiny() {
 	return 0;
 }
 
+/*
+ * Prints what a replay cost, as JSON.
+ */
+void printReplayReport(Application &app, uint64_t time, uint64_t allocations, uint64_t allocated_bytes) {
+	const Histogram &keys = Trace::histogram(TRACE_KEY);
+	size_t key_count = std::max<size_t>(keys.count, 1);
+	printf("{\"keys\": %llu, \"input_bytes\": %zu, \"recorded_seconds\": %.3f, \"seconds\": %.3f, \"keys_per_s\": %.1f, "
+		"\"output_bytes\": %zu, \"output_bytes_per_key\": %.1f, \"allocations\": %llu, \"allocations_per_key\": %.2f, "
+		"\"allocated_bytes\": %llu, \"allocating_keys\": {\"normal\": %zu, \"insert\": %zu, \"select\": %zu}, "
+		"\"key_p50_ns\": %llu, \"key_p99_ns\": %llu, \"key_max_ns\": %llu}\n",
+		(unsigned long long)keys.count, Terminal::bytes_read, Terminal::recorded_time / 1e9, time / 1e9,
+		keys.count / (time / 1e9), Terminal::bytes_written, (double)Terminal::bytes_written / key_count,
+		(unsigned long long)allocations, (double)allocations / key_count, (unsigned long long)allocated_bytes,
+		app.allocatingKeys(Mode::NORMAL), app.allocatingKeys(Mode::INSERT), app.allocatingKeys(Mode::SELECT),
+		(unsigned long long)keys.percentile(50), (unsigned long long)keys.percentile(99), (unsigned long long)keys.max);
+}
+
+// adds the lines of a script file to script
+Result readScript(const char *path, std::string &script) {
+	FILE *file = fopen(path, "r");
+	if (file == nullptr) {
+		return IO_ERROR;
+	}
+	char buffer[4096];
+	size_t length;
+	while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		script.append(buffer, length);
+	}
+	fclose(file);
+	if (!script.empty() && script.back() != '\n') {
+		script += '\n';
+	}
+	return SUCCESS;
+}
+
 int main(int argc, char **argv) {
-	Result result = Logger::init("yadda.log");
+	const char *filename = nullptr;
+	const char *record_file = nullptr;
+	const char *replay_file = nullptr;
+	bool assert_zero_alloc = false;
+	bool follow = false;
+	// -e and -c make a batch run, of the script against the files
+	std::string script;
+	bool batch = false;
+	std::vector<const char *> files;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record_file = argv[++i];
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replay_file = argv[++i];
+		} else if (strcmp(argv[i], "--assert-zero-alloc") == 0) {
+			assert_zero_alloc = true;
+		} else if (strcmp(argv[i], "--follow") == 0 || strcmp(argv[i], "-f") == 0) {
+			follow = true;
+		} else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+			if (readScript(argv[++i], script) != SUCCESS) {
+				fprintf(stderr, "failed to read the script %s\n", argv[i]);
+				return IO_ERROR;
+			}
+			batch = true;
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			script += argv[++i];
+			script += '\n';
+			batch = true;
+		} else {
+			filename = argv[i];
+			files.push_back(argv[i]);
+		}
+	}
+
+	if (assert_zero_alloc && !AllocStats::enabled) {
+		fprintf(stderr, "--assert-zero-alloc needs a build that counts allocations, make bin/yadda-replay\n");
+		return INVALID_INPUT;
+	}
+	// before the logger's thread starts
+	SaveEngine::readUmask();
+	Result result = Logger::init("yadda.ylog");
 	if (result != SUCCESS) {
 		return 1;
 	}
+	result = Terminal::init(replay_file, batch && replay_file == nullptr);
+	if (result != SUCCESS) {
+		fprintf(stderr, "failed to open %s as a key trace\n", replay_file);
+		Logger::deinit();
+		return result;
+	}
+	if (record_file != nullptr && Terminal::record(record_file) != SUCCESS) {
+		Terminal::deinit();
+		Logger::deinit();
+		return IO_ERROR;
+	}
 	
 	//if (testGapBufferTiny()) return 1;
 	//if (testGapBufferHomeTiny()) return 1;
@@ -125,15 +217,36 @@ int main(int argc, char **argv) {
 	// if (testGapBufferInsertTiny()) return 1;
 	
 	Application app;
-	if (argc < 2) {
+	if (batch && replay_file == nullptr) {
 		result = app.init(nullptr);
-	} else {
-		result = app.init(argv[1]);
+		if (result == SUCCESS) {
+			result = app.runBatch(script, files);
+		}
+		return result == SUCCESS ? 0 : 1;
 	}
+	result = app.init(filename);
 	if (result != SUCCESS) {
 		return result;
 	}
+	if (follow && app.follow() != SUCCESS) {
+		return IO_ERROR;
+	}
+	uint64_t start = Logger::now();
+	uint64_t allocations = AllocStats::count;
+	uint64_t allocated_bytes = AllocStats::bytes;
 	app.run();
+	if (Terminal::replaying()) {
+		printReplayReport(app, Logger::now() - start, AllocStats::count - allocations, AllocStats::bytes - allocated_bytes);
+		// past the first key, editing shouldn't touch the heap
+		if (assert_zero_alloc) {
+			for (Mode mode : {Mode::NORMAL, Mode::INSERT, Mode::SELECT}) {
+				if (app.allocatingKeys(mode) > 0) {
+					fprintf(stderr, "%zu keys allocated in %s mode\n", app.allocatingKeys(mode), MODE_STRINGS[static_cast<int>(mode)]);
+					return 1;
+				}
+			}
+		}
+	}
 	
 	return 0;
 }
@@ -0,0 +1,173 @@
+#include "save.hpp"
+
+#include "logger.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+mode_t SaveEngine::process_umask = 022;
+
+void SaveEngine::readUmask() {
+	FILE *status = fopen("/proc/self/status", "r");
+	if (status != nullptr) {
+		char line[256];
+		unsigned int bits;
+		while (fgets(line, sizeof(line), status) != nullptr) {
+			if (sscanf(line, "Umask: %o", &bits) == 1) {
+				process_umask = bits;
+				fclose(status);
+				return;
+			}
+		}
+		fclose(status);
+	}
+	// only safe before any other thread is running
+	process_umask = umask(0);
+	umask(process_umask);
+}
+
+SaveEngine::~SaveEngine() {
+	wait();
+}
+
+Result SaveEngine::start(const std::string &filename, const Snapshot &snapshot, size_t edit_count, bool sync) {
+	std::vector<iovec> segments = {
+		{(void *)snapshot.data[0], snapshot.length[0]},
+		{(void *)snapshot.data[1], snapshot.length[1]},
+	};
+	return start(filename, std::move(segments), snapshot.storage, edit_count, sync);
+}
+
+Result SaveEngine::start(const std::string &filename, std::vector<iovec> segments, std::shared_ptr<const void> keep_alive,
+	size_t edit_count, bool sync) {
+	if (filename.empty()) {
+		Logger::error("no file name to save to!");
+		return IO_ERROR;
+	}
+	wait();
+
+	this->filename = filename;
+	this->segments = std::move(segments);
+	this->keep_alive = std::move(keep_alive);
+	this->edit_count = edit_count;
+	this->sync = sync;
+	done = false;
+	running = true;
+	thread = std::thread([this]() {
+		result = writeAtomic(this->filename, this->segments, this->sync, process_umask);
+		done.store(true, std::memory_order_release);
+	});
+	return SUCCESS;
+}
+
+bool SaveEngine::poll(Result &result) {
+	if (!running || !done.load(std::memory_order_acquire)) {
+		return false;
+	}
+	finish();
+	result = this->result;
+	return true;
+}
+
+Result SaveEngine::wait() {
+	if (!running) {
+		return SUCCESS;
+	}
+	finish();
+	return result;
+}
+
+void SaveEngine::finish() {
+	thread.join();
+	running = false;
+	segments.clear();
+	keep_alive.reset();
+}
+
+static Result writeAll(int fd, std::vector<iovec> &segments) {
+	size_t index = 0;
+	while (index < segments.size()) {
+		if (segments[index].iov_len == 0) {
+			index++;
+			continue;
+		}
+		int count = (int)std::min<size_t>(segments.size() - index, IOV_MAX);
+		ssize_t written = writev(fd, &segments[index], count);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return IO_ERROR;
+		}
+		while (written > 0) {
+			if ((size_t)written >= segments[index].iov_len) {
+				written -= segments[index].iov_len;
+				segments[index].iov_len = 0;
+				index++;
+			} else {
+				segments[index].iov_base = (char *)segments[index].iov_base + written;
+				segments[index].iov_len -= written;
+				written = 0;
+			}
+		}
+	}
+	return SUCCESS;
+}
+
+Result SaveEngine::writeAtomic(const std::string &filename, std::vector<iovec> segments, bool sync, mode_t umask_bits) {
+	// write through symlinks instead of replacing them
+	std::string target = filename;
+	char *resolved = realpath(filename.c_str(), nullptr);
+	if (resolved) {
+		target = resolved;
+		free(resolved);
+	}
+	size_t slash = target.rfind('/');
+	std::string directory = slash == std::string::npos ? "." : target.substr(0, slash == 0 ? 1 : slash);
+	std::string temp_name = directory + "/." + target.substr(slash == std::string::npos ? 0 : slash + 1) + ".yadda-XXXXXX";
+
+	int fd = mkstemp(temp_name.data());
+	if (fd < 0) {
+		Logger::error("failed to create a temporary file to save to!");
+		return IO_ERROR;
+	}
+	struct stat info;
+	if (stat(target.c_str(), &info) == 0) {
+		fchmod(fd, info.st_mode & 07777);
+		if (fchown(fd, info.st_uid, info.st_gid) != 0) {
+			Logger::warn("couldn't keep the owner of the file being saved");
+		}
+	} else {
+		fchmod(fd, 0666 & ~umask_bits);
+	}
+
+	Result result = writeAll(fd, segments);
+	if (result == SUCCESS && sync && fsync(fd) != 0) {
+		result = IO_ERROR;
+	}
+	if (close(fd) != 0) {
+		result = IO_ERROR;
+	}
+	if (result != SUCCESS) {
+		Logger::error("failed to write the temporary file, the original is untouched!");
+		unlink(temp_name.c_str());
+		return result;
+	}
+	if (rename(temp_name.c_str(), target.c_str()) != 0) {
+		Logger::error("failed to rename the temporary file over the original!");
+		unlink(temp_name.c_str());
+		return IO_ERROR;
+	}
+	if (sync) {
+		int directory_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+		if (directory_fd >= 0) {
+			fsync(directory_fd);
+			close(directory_fd);
+		}
+	}
+	return SUCCESS;
+}
\ No newline at end of file
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "defines.hpp"
+#include "snapshot.hpp"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* SaveEngine
+ * Saves a buffer without blocking the editor. The text is written
+ * with writev to a temporary file next to the target, optionally
+ * fsynced, and renamed over the target, so a crash mid-save leaves
+ * the old file intact.
+ * start: starts writing a snapshot of the buffer on a background
+ *   thread. Waits for any save still running. Any other text can be
+ *   saved as segments, with keep_alive owning whatever they point at
+ *   until the save is done.
+ * poll: returns true once the running save has finished, and
+ *   stores its result.
+ * wait: blocks until the running save has finished.
+ * writeAtomic: does the actual writing, on whatever thread calls it.
+ * readUmask: reads the process's umask into process_umask, for new
+ *   files to be created with. Called once at startup, since reading it
+ *   without /proc means setting it, which would race with any other
+ *   thread creating a file.
+ * edit_count: the buffer's edit count when the save was started,
+ *   so the caller can tell whether it was modified since.
+ */
+class SaveEngine {
+public:
+	~SaveEngine();
+
+	Result start(const std::string &filename, const Snapshot &snapshot, size_t edit_count, bool sync);
+	Result start(const std::string &filename, std::vector<iovec> segments, std::shared_ptr<const void> keep_alive,
+		size_t edit_count, bool sync);
+	bool poll(Result &result);
+	Result wait();
+	bool busy() { return running; }
+
+	static Result writeAtomic(const std::string &filename, std::vector<iovec> segments, bool sync, mode_t umask_bits);
+	static void readUmask();
+	static mode_t process_umask;
+
+	std::string filename;
+	size_t edit_count = 0;
+
+private:
+	void finish();
+
+	std::thread thread;
+	std::atomic<bool> done = false;
+	bool running = false;
+	bool sync = true;
+	Result result = SUCCESS;
+	std::vector<iovec> segments;
+	std::shared_ptr<const void> keep_alive;
+};
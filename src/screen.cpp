@@ -1,12 +1,15 @@
 #include "screen.hpp"
 
 #include "logger.hpp"
+#include "terminal.hpp"
+#include "trace.hpp"
 
 #include <cstring>
-#include <sstream>
 
 using byte = unsigned char;
 
+bool Frame::held = false;
+
 Result Frame::init() {
 	if (contents != nullptr) delete[] contents;
 	contents = new (std::nothrow) Character[width * height];
@@ -82,46 +85,73 @@ void Frame::loadString(const char *string, size_t length, unsigned short &x, uns
 	x = temp_x;
 }
 
+static void appendNumber(std::string &out, unsigned int number) {
+	char digits[10];
+	int count = 0;
+	do {
+		digits[count++] = '0' + number % 10;
+		number /= 10;
+	} while (number > 0);
+	while (count > 0) {
+		out += digits[--count];
+	}
+}
+
+/*
+ * Composes into output, which keeps its capacity between draws, so
+ * redrawing a frame doesn't allocate once it has been drawn before.
+ */
 void Frame::draw() {
+	if (held) {
+		return;
+	}
+	Trace::Scope scope(TRACE_COMPOSE);
 	CharColor current_fg = contents[0].fg;
 	CharColor current_bg = contents[0].bg;
 
-	std::stringstream print_string;
-	print_string << "\033[" << parseFgColor(current_fg) << ';' << parseBgColor(current_bg) << 'm';
+	output.clear();
+	output += "\033[";
+	output += parseFgColor(current_fg);
+	output += ';';
+	output += parseBgColor(current_bg);
+	output += 'm';
 	for (unsigned int i = 0; i < width * height; i++) {
 		if (i % width == 0) {
-			print_string << "\033[" << y + i / width + 1 << ';' << x + 1 << 'H';
+			output += "\033[";
+			appendNumber(output, y + i / width + 1);
+			output += ';';
+			appendNumber(output, x + 1);
+			output += 'H';
 		}
-		print_string << parse(contents[i], current_fg, current_bg);
-		print_string << contents[i].character;
+		parse(contents[i], current_fg, current_bg, output);
+		output += contents[i].character;
 	}
-	printf("%s", print_string.str().c_str());
-	fflush(stdout);
+	Trace::Scope write_scope(TRACE_WRITE);
+	Terminal::write(output.data(), output.size());
+	Terminal::flush();
 }
 
-std::string parse(Character &c, CharColor &current_fg, CharColor &current_bg) {
-	std::string print_string = "";
+void parse(const Character &c, CharColor &current_fg, CharColor &current_bg, std::string &output) {
 	if (current_fg != c.fg ||
 		current_bg != c.bg) {
 		bool sequence_separator = false;
-		print_string += "\033[";
+		output += "\033[";
 		if (current_fg != c.fg) {
-			print_string += parseFgColor(c.fg);
+			output += parseFgColor(c.fg);
 			current_fg = c.fg;
 			sequence_separator = true;
 		}
 		if (current_bg != c.bg) {
-			if (sequence_separator) print_string += ';';
-			print_string += parseBgColor(c.bg);
+			if (sequence_separator) output += ';';
+			output += parseBgColor(c.bg);
 			current_bg = c.bg;
 			sequence_separator = true;
 		}
-		print_string += 'm';
+		output += 'm';
 	}
-	return print_string;
 }
 
-std::string parseFgColor(CharColor fg) {
+const char *parseFgColor(CharColor fg) {
 	switch (fg) {
 		case CharColor::BLACK: return "38;2;16;12;8";
 		case CharColor::RED: return "31";
@@ -143,7 +173,7 @@ std::string parseFgColor(CharColor fg) {
 	}
 }
 
-std::string parseBgColor(CharColor bg) {
+const char *parseBgColor(CharColor bg) {
 	switch (bg) {
 		case CharColor::BLACK: return "48;2;16;12;8";
 		case CharColor::RED: return "41";
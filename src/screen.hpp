@@ -35,11 +35,15 @@ struct Frame {
 	void loadString(const char *string, size_t length, unsigned short &x, unsigned short &y, CharColor fg, CharColor bg);
 	void draw();
 
+	// while set, draw does nothing, so a macro can be drawn once at the end
+	static bool held;
+
 	Character *contents = nullptr;
+	std::string output;
 	unsigned int x = 0, y = 0;
 	unsigned int width = 1, height = 1;
 };
 
-std::string parse(Character &c, CharColor &fg, CharColor &bg);
-std::string parseFgColor(CharColor fg);
-std::string parseBgColor(CharColor bg);
\ No newline at end of file
+void parse(const Character &c, CharColor &fg, CharColor &bg, std::string &output);
+const char *parseFgColor(CharColor fg);
+const char *parseBgColor(CharColor bg);
\ No newline at end of file
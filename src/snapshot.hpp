@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+
+/* Snapshot
+ * An immutable view of a buffer's text at one point in time. It
+ * shares the buffer's storage instead of copying it, so taking one
+ * is O(1), and later edits never change what it sees: the buffer
+ * moves to fresh storage the first time an edit would write over
+ * bytes that a live snapshot can still see. Snapshots are cheap to
+ * copy, and the storage is freed when the last one goes away.
+ * data, length: the text before and after the gap, in order.
+ * slice: a snapshot of part of this one, sharing the same storage.
+ * copy: copies count bytes starting at offset into out.
+ * copyOf: a snapshot with storage of its own, holding a copy of
+ *   length bytes of data, for text that isn't in any buffer, or of
+ *   another snapshot, so it stops sharing that one's storage.
+ */
+struct Snapshot {
+	size_t size() const { return length[0] + length[1]; }
+	bool empty() const { return size() == 0; }
+
+	Snapshot slice(size_t offset, size_t count) const {
+		Snapshot result;
+		result.storage = storage;
+		int span = 0;
+		for (int i = 0; i < 2 && count > 0; i++) {
+			if (offset >= length[i]) {
+				offset -= length[i];
+				continue;
+			}
+			size_t span_length = std::min(count, length[i] - offset);
+			result.data[span] = data[i] + offset;
+			result.length[span] = span_length;
+			span++;
+			count -= span_length;
+			offset = 0;
+		}
+		return result;
+	}
+
+	size_t copy(size_t offset, size_t count, char *out) const {
+		size_t copied = 0;
+		for (int i = 0; i < 2 && count > 0; i++) {
+			if (offset >= length[i]) {
+				offset -= length[i];
+				continue;
+			}
+			size_t span_length = std::min(count, length[i] - offset);
+			memcpy(out + copied, data[i] + offset, span_length);
+			copied += span_length;
+			count -= span_length;
+			offset = 0;
+		}
+		return copied;
+	}
+
+	static Snapshot copyOf(const char *data, size_t length) {
+		Snapshot result;
+		if (length == 0) {
+			return result;
+		}
+		std::shared_ptr<char[]> bytes(new char[length]);
+		memcpy(bytes.get(), data, length);
+		result.storage = bytes;
+		result.data[0] = bytes.get();
+		result.length[0] = length;
+		return result;
+	}
+
+	static Snapshot copyOf(const Snapshot &text) {
+		Snapshot result;
+		if (text.empty()) {
+			return result;
+		}
+		std::shared_ptr<char[]> bytes(new char[text.size()]);
+		text.copy(0, text.size(), bytes.get());
+		result.storage = bytes;
+		result.data[0] = bytes.get();
+		result.length[0] = text.size();
+		return result;
+	}
+
+	std::shared_ptr<const char[]> storage;
+	const char *data[2] = {nullptr, nullptr};
+	size_t length[2] = {0, 0};
+};
@@ -0,0 +1,415 @@
+#include "swap.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+SwapJournal::~SwapJournal() {
+	if (map != nullptr) {
+		munmap(map, map_length);
+	}
+	// the editor is closing the buffer on purpose, only a crash leaves the journal behind
+	if (fd >= 0) {
+		close();
+		unlink(path.c_str());
+	}
+}
+
+static bool writeAt(int fd, const void *data, size_t length, uint64_t offset) {
+	const char *bytes = (const char *)data;
+	while (length > 0) {
+		ssize_t written = pwrite(fd, bytes, length, offset);
+		if (written <= 0) {
+			return false;
+		}
+		bytes += written;
+		length -= written;
+		offset += written;
+	}
+	return true;
+}
+
+// a word at a time, a torn write only has to be noticed, not guarded against
+static uint64_t checksum(uint64_t hash, const char *data, size_t length) {
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, &data[i], 8);
+		hash = (hash ^ word) * 0x100000001b3ull;
+		hash ^= hash >> 29;
+	}
+	for (; i < length; i++) {
+		hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+void SwapJournal::attach(const std::string &filename) {
+	// the text the journal was for has been replaced
+	discard();
+	failed = false;
+	this->filename = filename;
+	size_t slash = filename.rfind('/');
+	size_t name = slash == std::string::npos ? 0 : slash + 1;
+	path = filename.substr(0, name) + "." + filename.substr(name) + ".yswp";
+	identify();
+	if (!batch) {
+		batch = std::make_unique<char[]>(BATCH_SIZE);
+	}
+}
+
+// what the file is like now, which new edits apply to
+void SwapJournal::identify() {
+	header = Header();
+	header.pid = getpid();
+	struct stat info;
+	if (stat(filename.c_str(), &info) == 0) {
+		header.device = info.st_dev;
+		header.inode = info.st_ino;
+		header.size = info.st_size;
+		header.mtime = (uint64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+	}
+}
+
+bool SwapJournal::create() {
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		Logger::warn("couldn't create the swap file, edits won't survive a crash");
+		failed = true;
+		return false;
+	}
+	if (!writeAt(fd, &header, sizeof(header), 0)) {
+		fail();
+		return false;
+	}
+	end = sizeof(header);
+	return true;
+}
+
+void SwapJournal::fail() {
+	Logger::error("failed to write the swap file, edits won't survive a crash!");
+	failed = true;
+	batch_length = 0;
+	last_record = SIZE_MAX;
+}
+
+void SwapJournal::close() {
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+}
+
+void SwapJournal::record(size_t offset, size_t removed_length, const char *data, size_t length, size_t text_length) {
+	if (path.empty() || failed || map != nullptr || (removed_length == 0 && length == 0)) {
+		return;
+	}
+	if (fd < 0 && !create()) {
+		return;
+	}
+	if (last_record != SIZE_MAX) {
+		Record last;
+		memcpy(&last, &batch[last_record], sizeof(last));
+		size_t last_end = last.offset + last.length;
+		bool merged = true;
+		if (removed_length == 0 && offset == last_end && batch_length + length <= BATCH_SIZE) {
+			memcpy(&batch[batch_length], data, length);
+			batch_length += length;
+			last.length += length;
+		} else if (length == 0 && removed_length <= last.length && offset + removed_length == last_end) {
+			// its bytes are the last in the batch
+			batch_length -= removed_length;
+			last.length -= removed_length;
+		} else if (length == 0 && last.length == 0 && offset == last.offset) {
+			last.removed_length += removed_length;
+		} else {
+			merged = false;
+		}
+		if (merged) {
+			if (last.length == 0 && last.removed_length == 0) {
+				batch_length -= sizeof(last);
+				last_record = SIZE_MAX;
+			} else {
+				memcpy(&batch[last_record], &last, sizeof(last));
+			}
+			batch_text_length = text_length;
+			return;
+		}
+	}
+	Record next{offset, removed_length, length};
+	if (batch_length + sizeof(next) + length > BATCH_SIZE && !flush()) {
+		return;
+	}
+	// too big for a batch, it gets a frame of its own
+	if (sizeof(next) + length > BATCH_SIZE) {
+		if (!writeFrame((const char *)&next, sizeof(next), data, length, text_length)) {
+			fail();
+		}
+		return;
+	}
+	if (batch_length == 0) {
+		batch_time = Logger::now();
+	}
+	last_record = batch_length;
+	memcpy(&batch[batch_length], &next, sizeof(next));
+	if (length > 0) {
+		memcpy(&batch[batch_length + sizeof(next)], data, length);
+	}
+	batch_length += sizeof(next) + length;
+	batch_text_length = text_length;
+}
+
+void SwapJournal::tick(uint64_t now) {
+	if (batch_length > 0 && now - batch_time >= FLUSH_INTERVAL) {
+		flush();
+	}
+	// the checkpoint, everything written so far survives the machine going down too
+	if (unsynced && now - last_sync >= CHECKPOINT_INTERVAL) {
+		if (fdatasync(fd) != 0) {
+			Logger::warn("failed to sync the swap file");
+		}
+		unsynced = false;
+		last_sync = now;
+	}
+}
+
+bool SwapJournal::flush() {
+	if (batch_length == 0) {
+		return true;
+	}
+	bool result = writeFrame(batch.get(), batch_length, nullptr, 0, batch_text_length);
+	batch_length = 0;
+	last_record = SIZE_MAX;
+	if (!result) {
+		fail();
+	}
+	return result;
+}
+
+bool SwapJournal::writeFrame(const char *payload, size_t length, const char *extra, size_t extra_length, size_t text_length) {
+	Frame frame;
+	frame.length = length + extra_length;
+	frame.text_length = text_length;
+	frame.checksum = checksum(checksum(0xcbf29ce484222325ull, payload, length), extra, extra_length);
+	if (!writeAt(fd, &frame, sizeof(frame), end) || !writeAt(fd, payload, length, end + sizeof(frame)) ||
+		!writeAt(fd, extra, extra_length, end + sizeof(frame) + length)) {
+		return false;
+	}
+	end += sizeof(frame) + frame.length;
+	unsynced = true;
+	return true;
+}
+
+void SwapJournal::mark() {
+	flush();
+	save_mark = fd >= 0 ? end : sizeof(Header);
+}
+
+/*
+ * Starts the journal over against the file that was just saved. Edits
+ * made while the save was running are after the mark, and are copied
+ * into a new journal that's renamed over the old one. Those are all
+ * that gets copied, never the text.
+ */
+void SwapJournal::saved() {
+	identify();
+	if (fd < 0 || failed || !flush()) {
+		return;
+	}
+	if (save_mark < sizeof(Header)) {
+		save_mark = sizeof(Header);
+	}
+	if (end <= save_mark) {
+		close();
+		unlink(path.c_str());
+		end = 0;
+		unsynced = false;
+		return;
+	}
+	std::string temp_path = path + ".new";
+	int new_fd = open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	bool result = new_fd >= 0 && writeAt(new_fd, &header, sizeof(header), 0);
+	uint64_t new_end = sizeof(header);
+	// the batch was just written out, so it's free to copy through
+	for (uint64_t offset = save_mark; result && offset < end;) {
+		ssize_t count = pread(fd, batch.get(), std::min<uint64_t>(BATCH_SIZE, end - offset), offset);
+		result = count > 0 && writeAt(new_fd, batch.get(), count, new_end);
+		offset += count;
+		new_end += count;
+	}
+	if (!result || rename(temp_path.c_str(), path.c_str()) != 0) {
+		if (new_fd >= 0) {
+			::close(new_fd);
+			unlink(temp_path.c_str());
+		}
+		fail();
+		return;
+	}
+	close();
+	fd = new_fd;
+	end = new_end;
+	save_mark = sizeof(header);
+	unsynced = true;
+}
+
+void SwapJournal::discard() {
+	batch_length = 0;
+	last_record = SIZE_MAX;
+	if (fd >= 0) {
+		close();
+		unlink(path.c_str());
+	}
+	end = 0;
+	save_mark = 0;
+	unsynced = false;
+	if (!filename.empty()) {
+		identify();
+	}
+}
+
+/*
+ * Maps the swap file, if there is one, and finds how much of it can be
+ * replayed: every frame up to the first one that's torn, or doesn't
+ * add up to the length it says the text had after it.
+ */
+size_t SwapJournal::beginRecovery() {
+	if (path.empty() || fd >= 0) {
+		return 0;
+	}
+	int recover_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+	if (recover_fd < 0) {
+		return 0;
+	}
+	struct stat info;
+	Header found;
+	if (fstat(recover_fd, &info) != 0 || (size_t)info.st_size < sizeof(found) ||
+		pread(recover_fd, &found, sizeof(found), 0) != sizeof(found) ||
+		memcmp(found.magic, header.magic, sizeof(found.magic)) != 0 || found.version != header.version) {
+		::close(recover_fd);
+		return 0;
+	}
+	if ((pid_t)found.pid != getpid() && kill(found.pid, 0) == 0) {
+		Logger::warn("another yadda (pid %u) has a swap file for this file, edits here won't have one", found.pid);
+		::close(recover_fd);
+		failed = true;
+		return 0;
+	}
+	if (found.device != header.device || found.inode != header.inode || found.size != header.size ||
+		found.mtime != header.mtime) {
+		std::string old_path = path + ".old";
+		Logger::text<LogLevel::WARN>("the swap file is for another version of the file, moved it to %s", old_path.c_str());
+		rename(path.c_str(), old_path.c_str());
+		::close(recover_fd);
+		return 0;
+	}
+	map_length = info.st_size;
+	void *mapped = mmap(nullptr, map_length, PROT_READ, MAP_PRIVATE, recover_fd, 0);
+	if (mapped == MAP_FAILED) {
+		::close(recover_fd);
+		return 0;
+	}
+	map = (char *)mapped;
+	size_t frames = 0;
+	size_t offset = sizeof(found);
+	uint64_t text_length = found.size;
+	while (map_length - offset >= sizeof(Frame)) {
+		Frame frame;
+		memcpy(&frame, &map[offset], sizeof(frame));
+		const char *payload = &map[offset + sizeof(frame)];
+		if (frame.length > map_length - offset - sizeof(frame) ||
+			frame.checksum != checksum(0xcbf29ce484222325ull, payload, frame.length)) {
+			break;
+		}
+		uint64_t length = text_length;
+		bool valid = true;
+		for (size_t at = 0; valid && at < frame.length;) {
+			Record record;
+			valid = frame.length - at >= sizeof(record);
+			if (valid) {
+				memcpy(&record, &payload[at], sizeof(record));
+				at += sizeof(record);
+				valid = record.length <= frame.length - at && record.offset <= length &&
+					record.removed_length <= length - record.offset;
+				length += record.length - record.removed_length;
+				at += record.length;
+			}
+		}
+		if (!valid || length != frame.text_length) {
+			break;
+		}
+		text_length = length;
+		offset += sizeof(frame) + frame.length;
+		frames++;
+	}
+	if (frames == 0) {
+		munmap(map, map_length);
+		map = nullptr;
+		::close(recover_fd);
+		return 0;
+	}
+	fd = recover_fd;
+	valid_end = offset;
+	position = frame_end = sizeof(found);
+	return frames;
+}
+
+bool SwapJournal::nextEdit(Edit &edit) {
+	if (map == nullptr || position >= valid_end) {
+		return false;
+	}
+	if (position == frame_end) {
+		Frame frame;
+		memcpy(&frame, &map[position], sizeof(frame));
+		position += sizeof(frame);
+		frame_end = position + frame.length;
+		frame_text_length = frame.text_length;
+	}
+	Record record;
+	memcpy(&record, &map[position], sizeof(record));
+	position += sizeof(record);
+	edit = Edit{record.offset, record.removed_length, &map[position], record.length, SIZE_MAX};
+	position += record.length;
+	if (position == frame_end) {
+		edit.text_length = frame_text_length;
+	}
+	return true;
+}
+
+// carries on the journal past what was replayed, anything torn after it is cut off
+void SwapJournal::endRecovery() {
+	if (map != nullptr) {
+		munmap(map, map_length);
+		map = nullptr;
+	}
+	if (fd < 0) {
+		return;
+	}
+	if (ftruncate(fd, valid_end) != 0 || !writeAt(fd, &header, sizeof(header), 0)) {
+		fail();
+	}
+	end = valid_end;
+	save_mark = 0;
+}
+
+// the swap is kept for someone to look at, and edits from here on start a new one
+void SwapJournal::abandonRecovery() {
+	if (map != nullptr) {
+		munmap(map, map_length);
+		map = nullptr;
+	}
+	if (fd < 0) {
+		return;
+	}
+	close();
+	std::string old_path = path + ".old";
+	Logger::text<LogLevel::WARN>("moved the swap file that couldn't be recovered to", old_path.c_str());
+	rename(path.c_str(), old_path.c_str());
+	end = 0;
+	save_mark = 0;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "defines.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+/* SwapJournal
+ * An append-only log of the edits made to a buffer since its file was
+ * last loaded or saved, kept next to the file as .name.yswp, so edits
+ * survive the editor dying. Only the edits go in it, never the text:
+ * each is its offset, how many bytes it removed, and the bytes it
+ * added, so its cost doesn't depend on the size of the file. Edits are
+ * gathered into a batch and written as one checksummed frame every
+ * FLUSH_INTERVAL, or when the batch fills up, and the journal is
+ * synced every CHECKPOINT_INTERVAL. Every frame ends with the length
+ * of the text after it, which recovery checks its replay against.
+ * attach: the swap for filename, and what the file was like when
+ *   loaded, which the edits apply to. Nothing is written until the
+ *   first edit.
+ * record: an edit that replaced removed_length bytes at offset with
+ *   length bytes of data, leaving text_length bytes of text. Inserts
+ *   that carry on from the last edit of the batch, and backspaces over
+ *   them, grow or shrink it. Ignored while recovering, the edits being
+ *   replayed are in the journal already.
+ * tick: writes the batch once it's old enough, and syncs once it's
+ *   time to.
+ * mark: writes the batch, saving starts from here.
+ * saved: the file was saved as of the mark, so the edits before it are
+ *   dropped, and only the ones made since are kept.
+ * discard: drops the whole journal, the buffer matches the file again.
+ * beginRecovery: looks for a swap left behind, and checks that it's
+ *   for the file as it is now and that nothing else is using it.
+ *   Returns the number of whole frames.
+ * nextEdit: the next edit to replay, false after the last one. data
+ *   stays valid until endRecovery, which carries on the journal from
+ *   the end of what was replayed. The last edit of each frame has the
+ *   length the text had after it, the rest have SIZE_MAX.
+ * abandonRecovery: gives up on a replay that doesn't add up, moving
+ *   the swap aside instead of carrying it on.
+ */
+class SwapJournal {
+public:
+	~SwapJournal();
+
+	static constexpr size_t BATCH_SIZE = 64 << 10;
+	static constexpr uint64_t FLUSH_INTERVAL = 200000000;
+	static constexpr uint64_t CHECKPOINT_INTERVAL = 2000000000;
+
+	struct Edit {
+		size_t offset;
+		size_t removed_length;
+		const char *data;
+		size_t length;
+		size_t text_length;
+	};
+
+	void attach(const std::string &filename);
+	void record(size_t offset, size_t removed_length, const char *data, size_t length, size_t text_length);
+	void tick(uint64_t now);
+	void mark();
+	void saved();
+	void discard();
+	size_t beginRecovery();
+	bool nextEdit(Edit &edit);
+	void endRecovery();
+	void abandonRecovery();
+
+private:
+	/* what the edits apply to
+	 * device, inode, size, mtime: the file when it was loaded.
+	 * pid: the editor writing the journal.
+	 */
+	struct Header {
+		char magic[8] = {'Y', 'A', 'D', 'D', 'A', 'S', 'W', 'P'};
+		uint32_t version = 1;
+		uint32_t pid = 0;
+		uint64_t device = 0;
+		uint64_t inode = 0;
+		uint64_t size = 0;
+		uint64_t mtime = 0;
+	};
+
+	struct Frame {
+		uint64_t length;
+		uint64_t text_length;
+		uint64_t checksum;
+	};
+
+	struct Record {
+		uint64_t offset;
+		uint64_t removed_length;
+		uint64_t length;
+	};
+
+	void identify();
+	bool create();
+	bool flush();
+	bool writeFrame(const char *payload, size_t length, const char *extra, size_t extra_length, size_t text_length);
+	void fail();
+	void close();
+
+	std::string path;
+	std::string filename;
+	Header header;
+	int fd = -1;
+	bool failed = false;
+	// where the journal ends, and where the running save's mark is
+	uint64_t end = 0;
+	uint64_t save_mark = 0;
+
+	// the batch, after room for its frame
+	std::unique_ptr<char[]> batch;
+	size_t batch_length = 0;
+	size_t last_record = SIZE_MAX;
+	size_t batch_text_length = 0;
+	uint64_t batch_time = 0;
+	uint64_t last_sync = 0;
+	bool unsynced = false;
+
+	// the swap being recovered, mapped
+	char *map = nullptr;
+	size_t map_length = 0;
+	size_t position = 0;
+	size_t valid_end = 0;
+	size_t frame_end = 0;
+	size_t frame_text_length = 0;
+};
@@ -0,0 +1,158 @@
+#include "terminal.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+size_t Terminal::bytes_read = 0;
+size_t Terminal::bytes_written = 0;
+uint64_t Terminal::recorded_time = 0;
+bool Terminal::raw = false;
+termios Terminal::saved_settings;
+KeyTraceHeader Terminal::header;
+FILE *Terminal::record_file = nullptr;
+FILE *Terminal::replay_file = nullptr;
+bool Terminal::replay_finished = false;
+bool Terminal::headless_mode = false;
+uint64_t Terminal::start_time = 0;
+
+Result Terminal::init(const char *replay_file, bool headless) {
+	bytes_read = 0;
+	bytes_written = 0;
+	headless_mode = headless;
+	if (headless) {
+		return SUCCESS;
+	}
+	if (replay_file != nullptr) {
+		Terminal::replay_file = fopen(replay_file, "rb");
+		if (Terminal::replay_file == nullptr) {
+			Logger::error("failed to open the key trace!");
+			return IO_ERROR;
+		}
+		KeyTraceHeader expected;
+		if (fread(&header, sizeof(header), 1, Terminal::replay_file) != 1 ||
+			memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version) {
+			Logger::error("not a key trace!");
+			fclose(Terminal::replay_file);
+			Terminal::replay_file = nullptr;
+			return INVALID_INPUT;
+		}
+		replay_finished = false;
+		return SUCCESS;
+	}
+
+	winsize w;
+	ioctl(STDIN_FILENO, TIOCGWINSZ, &w);
+	header.width = w.ws_col;
+	header.height = w.ws_row;
+
+	tcgetattr(STDIN_FILENO, &saved_settings);
+	termios new_settings = saved_settings;
+	cfmakeraw(&new_settings);
+	new_settings.c_cc[VMIN] = 0;
+	new_settings.c_cc[VTIME] = 1;
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_settings);
+	raw = true;
+
+	write("\033[?1049h", sizeof("\033[?1049h") - 1);
+	return SUCCESS;
+}
+
+Result Terminal::record(const char *trace_file) {
+	record_file = fopen(trace_file, "wb");
+	if (record_file == nullptr) {
+		Logger::error("failed to open the key trace to record to!");
+		return IO_ERROR;
+	}
+	fwrite(&header, sizeof(header), 1, record_file);
+	start_time = Logger::now();
+	return SUCCESS;
+}
+
+void Terminal::deinit() {
+	if (raw) {
+		write("\033[?1049l", sizeof("\033[?1049l") - 1);
+		flush();
+		tcsetattr(STDIN_FILENO, TCSANOW, &saved_settings);
+		raw = false;
+	}
+	if (record_file != nullptr) {
+		fclose(record_file);
+		record_file = nullptr;
+	}
+	if (replay_file != nullptr) {
+		fclose(replay_file);
+		replay_file = nullptr;
+	}
+}
+
+void Terminal::getSize(unsigned int &width, unsigned int &height) {
+	width = header.width;
+	height = header.height;
+}
+
+long Terminal::read(char *buffer, size_t length, bool keep_empty) {
+	if (replay_file != nullptr) {
+		uint64_t time;
+		uint32_t entry_length;
+		if (fread(&time, sizeof(time), 1, replay_file) != 1 ||
+			fread(&entry_length, sizeof(entry_length), 1, replay_file) != 1) {
+			replay_finished = true;
+			return 0;
+		}
+		recorded_time = time;
+		size_t count = std::min<size_t>(entry_length, length);
+		if (fread(buffer, 1, count, replay_file) != count) {
+			replay_finished = true;
+			return 0;
+		}
+		// a trace recorded with a bigger buffer, drop what doesn't fit
+		fseek(replay_file, entry_length - count, SEEK_CUR);
+		bytes_read += count;
+		return count;
+	}
+	long result = ::read(STDIN_FILENO, buffer, length);
+	if (result > 0) {
+		bytes_read += result;
+	}
+	if (record_file != nullptr && (result > 0 || (result == 0 && keep_empty))) {
+		recordRead(buffer, result);
+	}
+	return result;
+}
+
+void Terminal::recordRead(const char *buffer, long length) {
+	uint64_t time = Logger::now() - start_time;
+	uint32_t entry_length = length;
+	fwrite(&time, sizeof(time), 1, record_file);
+	fwrite(&entry_length, sizeof(entry_length), 1, record_file);
+	fwrite(buffer, 1, length, record_file);
+}
+
+void Terminal::write(const char *data, size_t length) {
+	bytes_written += length;
+	if (replay_file == nullptr && !headless_mode) {
+		fwrite(data, 1, length, stdout);
+	}
+}
+
+void Terminal::print(const char *format, ...) {
+	char buffer[256];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	if (length > 0) {
+		write(buffer, std::min<size_t>(length, sizeof(buffer) - 1));
+	}
+}
+
+void Terminal::flush() {
+	if (replay_file == nullptr && !headless_mode) {
+		fflush(stdout);
+	}
+}
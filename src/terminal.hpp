@@ -0,0 +1,70 @@
+#pragma once
+
+#include "defines.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <termios.h>
+
+/* Key trace file layout
+ * KeyTraceHeader, then one entry per read() from the terminal: a u64
+ * time in nanoseconds since recording started, a u32 length, and the
+ * bytes that were read.
+ */
+struct KeyTraceHeader {
+	char magic[4] = {'Y', 'K', 'E', 'Y'};
+	uint32_t version = 1;
+	uint16_t width = 80;
+	uint16_t height = 24;
+};
+
+/* Terminal
+ * Everything the editor reads from or writes to the terminal goes
+ * through here, so it can be recorded, or replayed without one.
+ * init: puts the terminal in raw mode and switches to the
+ *   alternate screen. With a replay file, reads come from the trace
+ *   instead, and writes only get counted. A headless terminal, for
+ *   batch runs, is left as it is, and writes only get counted too.
+ * record: logs every read to a trace file, with timing.
+ * read: reads up to length bytes, returns 0 when nothing arrived
+ *   before the timeout. keep_empty records empty reads as well, for
+ *   callers that read until nothing is left, so replay ends their
+ *   loops in the same place.
+ * write, print: queue output, flush sends it.
+ * finished: true once a replay has used up its trace.
+ * headless: true for a batch run, which has no terminal to draw on.
+ * bytes_read, bytes_written: count everything read and written
+ *   since init.
+ */
+class Terminal {
+public:
+	static Result init(const char *replay_file = nullptr, bool headless = false);
+	static Result record(const char *trace_file);
+	static void deinit();
+
+	static void getSize(unsigned int &width, unsigned int &height);
+	static long read(char *buffer, size_t length, bool keep_empty = false);
+	static void write(const char *data, size_t length);
+	static void print(const char *format, ...) __attribute__((format(printf, 1, 2)));
+	static void flush();
+	static bool replaying() { return replay_file != nullptr; }
+	static bool finished() { return replay_finished; }
+	static bool headless() { return headless_mode; }
+
+	static size_t bytes_read;
+	static size_t bytes_written;
+	static uint64_t recorded_time;
+
+private:
+	static void recordRead(const char *buffer, long length);
+
+	static bool raw;
+	static termios saved_settings;
+	static KeyTraceHeader header;
+	static FILE *record_file;
+	static FILE *replay_file;
+	static bool replay_finished;
+	static bool headless_mode;
+	static uint64_t start_time;
+};
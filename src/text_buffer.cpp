@@ -1,10 +1,19 @@
 #include "text_buffer.hpp"
 
+#include "block_diff.hpp"
 #include "logger.hpp"
+#include "terminal.hpp"
+#include "trace.hpp"
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <cstring>
 #include <cstdio>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 TextBuffer::TextBuffer(const TextBufferSettings &settings) {
 	fg = settings.fg;
@@ -14,114 +23,678 @@ TextBuffer::TextBuffer(const TextBufferSettings &settings) {
 	strcpy(tab_char, settings.tab_char);
 	strcpy(newline_char, settings.newline_char);
 
-	number_column.x = settings.x;
-	number_column.y = settings.y;
-	number_column.width = 4;
-	number_column.height = settings.height;
-
-	text_area.x = settings.x + 4;
-	text_area.y = settings.y;
-	text_area.width = settings.width - 4;
-	text_area.height = settings.height;
+	area_x = settings.x;
+	area_y = settings.y;
+	area_width = settings.width;
+	area_height = settings.height;
+	views.push_back(std::make_unique<View>());
+	view = views[0].get();
+	place(*view, area_x, area_y, area_width, area_height);
 }
 
 Result TextBuffer::loadBuffer(const std::string &filename) {
-	if (gap_buffer.loadFile(filename)) return MEMORY_ERROR;
+	huge_file.reset();
+	undo_journal.clear();
+	// a batch run has no session to lose, and no one to recover it
+	if (!Terminal::headless()) {
+		swap_journal.attach(filename);
+	}
+	window_start = window_line = 0;
+	window_length = window_prefix = window_suffix = 0;
+	struct stat info;
+	if (stat(filename.c_str(), &info) == 0 && info.st_size > 0 && (size_t)info.st_size >= HugeFile::threshold()) {
+		huge_file = std::make_shared<HugeFile>();
+		if (huge_file->open(filename) != SUCCESS) {
+			huge_file.reset();
+			return MEMORY_ERROR;
+		}
+		loadWindow(0);
+	} else {
+		if (gap_buffer.loadFile(filename)) return MEMORY_ERROR;
+		resetCaches();
+	}
+	highlighter.setLanguage(filename);
 
-	screen_start_index = 0;
-	screen_start_line = 1;
+	view->screen_start_line = 1;
+	if (view->text_area.contents == nullptr || view->number_column.contents == nullptr) return MEMORY_ERROR;
+	redraw();
 
-	if (text_area.init() != SUCCESS) return MEMORY_ERROR;
-	if (number_column.init() != SUCCESS) return MEMORY_ERROR;
-	updateFrame();
+	return SUCCESS;
+}
+
+// how many bytes match at the start of a and b
+static size_t commonPrefix(const char *a, const char *b, size_t length) {
+	size_t i = 0;
+	while (i < length) {
+		size_t chunk = std::min<size_t>(length - i, 4096);
+		if (memcmp(&a[i], &b[i], chunk) != 0) {
+			while (a[i] == b[i]) {
+				i++;
+			}
+			return i;
+		}
+		i += chunk;
+	}
+	return length;
+}
+
+// how many bytes match at the ends of a and b, which point past their last bytes
+static size_t commonSuffix(const char *a, const char *b, size_t length) {
+	size_t i = 0;
+	while (i < length) {
+		size_t chunk = std::min<size_t>(length - i, 4096);
+		if (memcmp(a - i - chunk, b - i - chunk, chunk) != 0) {
+			while (a[-(long)i - 1] == b[-(long)i - 1]) {
+				i++;
+			}
+			return i;
+		}
+		i += chunk;
+	}
+	return length;
+}
 
+/*
+ * Loads everything that can be read from fd, like a pipe, whose size
+ * isn't known until it ends. The buffer has no file, so no swap.
+ */
+Result TextBuffer::loadStream(int fd) {
+	huge_file.reset();
+	undo_journal.clear();
+	swap_journal.discard();
+	window_start = window_line = 0;
+	window_length = window_prefix = window_suffix = 0;
+	std::vector<char> text;
+	size_t length = 0;
+	while (true) {
+		if (text.size() - length < STREAM_READ_SIZE) {
+			text.resize(std::max(text.size() * 2, length + STREAM_READ_SIZE));
+		}
+		ssize_t result = read(fd, &text[length], text.size() - length);
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result < 0) {
+			Logger::error("failed to read the input!");
+			return IO_ERROR;
+		}
+		if (result == 0) {
+			break;
+		}
+		length += result;
+	}
+	memcpy(gap_buffer.beginLoad(length), text.data(), length);
+	gap_buffer.endLoad(length);
+	resetCaches();
+	view->screen_start_line = 1;
+	redraw();
 	return SUCCESS;
 }
 
-void TextBuffer::updateFrame() {
+/*
+ * Loads the file again after something else changed it, replacing
+ * only the ranges that differ, so the line index and caches are only
+ * redone around them, and the cursor and the screen stay where they
+ * were in the text around the changes. Whatever is past the common
+ * prefix and suffix is matched up in content-defined blocks. A huge
+ * file is just opened again at the same offset, it was never read.
+ */
+Result TextBuffer::reload(const std::string &filename) {
+	Trace::Scope scope(TRACE_STORAGE);
+	selection = false;
+	// the offsets in the history are into the text that's being replaced
+	undo_journal.clear();
+	swap_journal.discard();
+	size_t cursor_row = gap_buffer.pre_cursor_lines.size() - view->screen_start_line;
+	if (huge_file) {
+		size_t offset = window_start + gap_buffer.pre_cursor_index;
+		Result result = loadBuffer(filename);
+		if (result != SUCCESS) {
+			return result;
+		}
+		if (huge_file) {
+			loadWindow(std::min(offset, huge_file->size()));
+		} else {
+			gap_buffer.move_gap(offset);
+		}
+		size_t line = gap_buffer.pre_cursor_lines.size();
+		view->screen_start_line = line > cursor_row ? line - cursor_row : 1;
+		updateFrame();
+		return SUCCESS;
+	}
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0) {
+		Logger::error("failed to open file!");
+		return IO_ERROR;
+	}
+	if ((size_t)info.st_size >= HugeFile::threshold()) {
+		return loadBuffer(filename);
+	}
+
+	size_t new_length = info.st_size;
+	const char *new_data = "";
+	void *map = MAP_FAILED;
+	if (new_length > 0) {
+		int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			Logger::error("failed to open file!");
+			return IO_ERROR;
+		}
+		map = mmap(nullptr, new_length, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			Logger::error("failed to map file!");
+			return MEMORY_ERROR;
+		}
+		madvise(map, new_length, MADV_SEQUENTIAL);
+		new_data = (const char *)map;
+	}
+
+	// the text before and after the gap, and how much of it didn't change at either end
+	const char *before = gap_buffer.buffer;
+	size_t before_length = gap_buffer.pre_cursor_index;
+	const char *after = &gap_buffer.buffer[gap_buffer.post_cursor_index];
+	size_t after_length = gap_buffer.capacity - gap_buffer.post_cursor_index;
+	size_t old_length = before_length + after_length;
+	size_t prefix = commonPrefix(before, new_data, std::min(before_length, new_length));
+	if (prefix == before_length) {
+		prefix += commonPrefix(after, &new_data[before_length], std::min(after_length, new_length - before_length));
+	}
+	size_t limit = std::min(old_length, new_length) - prefix;
+	size_t suffix = commonSuffix(&after[after_length], &new_data[new_length], std::min(after_length, limit));
+	if (suffix == after_length) {
+		suffix += commonSuffix(&before[before_length], &new_data[new_length - after_length], limit - after_length);
+	}
+	if (prefix == old_length && prefix == new_length) {
+		if (map != MAP_FAILED) {
+			munmap(map, new_length);
+		}
+		return SUCCESS;
+	}
+
+	// the changed middle has to be in one piece to be diffed, which it is unless the gap is inside it
+	size_t cursor = gap_buffer.pre_cursor_index;
+	if (prefix < cursor && cursor < old_length - suffix) {
+		gap_buffer.move_gap(prefix);
+	}
+	const char *old_middle = gap_buffer.pre_cursor_index > prefix ? &gap_buffer.buffer[prefix] :
+		&gap_buffer.buffer[gap_buffer.post_cursor_index + prefix - gap_buffer.pre_cursor_index];
+	std::vector<BlockEdit> edits;
+	diffBlocks(old_middle, old_length - prefix - suffix, &new_data[prefix], new_length - prefix - suffix, edits);
+
+	// go through the edits from whichever end the gap is nearest, so it only crosses them once
+	bool forwards = gap_buffer.pre_cursor_index <= prefix;
+	long shift = 0;
+	for (size_t n = 0; n < edits.size(); n++) {
+		BlockEdit &edit = edits[forwards ? n : edits.size() - n - 1];
+		edit.old_offset += prefix;
+		edit.new_offset += prefix;
+		gap_buffer.move_gap(edit.old_offset + (forwards ? shift : 0));
+		size_t line = gap_buffer.pre_cursor_lines.size() - 1;
+		size_t line_count = gap_buffer.line_count();
+		gap_buffer.removeFront(edit.old_length);
+		gap_buffer.insert(&new_data[edit.new_offset], edit.new_length);
+		// like a loaded file, a trailing newline doesn't start a line
+		if (gap_buffer.post_cursor_index == gap_buffer.capacity && gap_buffer.pre_cursor_lines.size() > 1 &&
+			gap_buffer.pre_cursor_lines.back() == gap_buffer.pre_cursor_index) {
+			gap_buffer.pre_cursor_lines.pop_back();
+		}
+		lineEdited(line, line_count);
+		shift += (long)edit.new_length - (long)edit.old_length;
+	}
+
+	// the cursor keeps its place in the text around it
+	long cursor_shift = 0;
+	for (const BlockEdit &edit : edits) {
+		if (cursor < edit.old_offset + edit.old_length) {
+			if (cursor > edit.old_offset) {
+				cursor = edit.old_offset + std::min(cursor - edit.old_offset, edit.new_length);
+			}
+			break;
+		}
+		cursor_shift += (long)edit.new_length - (long)edit.old_length;
+	}
+	cursor += cursor_shift;
+	if (map != MAP_FAILED) {
+		munmap(map, new_length);
+	}
+	gap_buffer.move_gap(cursor);
+	size_t line = gap_buffer.pre_cursor_lines.size();
+	view->screen_start_line = line > cursor_row ? line - cursor_row : 1;
+	debug("reloaded with ", edits.size(), " edits");
+	updateFrame();
+	return SUCCESS;
+}
+
+void TextBuffer::resetCaches() {
+	highlighter.reset(gap_buffer.line_count());
+	bracket_index.build(gap_buffer);
+}
+
+/*
+ * Loads the window of the huge file around offset, starting and ending
+ * on whole lines, and puts the cursor at offset. The screen stays on
+ * the same line of the file.
+ */
+void TextBuffer::loadWindow(size_t offset) {
+	Trace::Scope scope(TRACE_STORAGE);
+	commitWindow();
+	size_t top_line = window_line + view->screen_start_line - 1;
+	size_t start = offset > WINDOW_SIZE / 2 ? huge_file->lineStartBefore(offset - WINDOW_SIZE / 2) : 0;
+	size_t end = huge_file->size();
+	if (end - start > WINDOW_SIZE) {
+		end = huge_file->lineStartAfter(start + WINDOW_SIZE);
+	}
+	char *data = gap_buffer.beginLoad(end - start);
+	huge_file->read(start, end - start, data);
+	gap_buffer.endLoad(end - start);
+	window_start = start;
+	window_length = window_prefix = window_suffix = end - start;
+	window_line = huge_file->lineAt(start);
+	gap_buffer.advance(std::min(offset, end) - start);
+	resetCaches();
+	view->screen_start_line = top_line >= window_line ? top_line - window_line + 1 : 1;
+	if (view->screen_start_line > gap_buffer.pre_cursor_lines.size()) {
+		view->screen_start_line = gap_buffer.pre_cursor_lines.size();
+	}
+	debug("loaded window at ", window_start);
+}
+
+/*
+ * Puts the edits made in the window back into the huge file. Only the
+ * bytes between the unedited prefix and suffix are replaced.
+ */
+void TextBuffer::commitWindow() {
+	if (!huge_file || (window_prefix == window_length && window_suffix == window_length)) {
+		return;
+	}
+	size_t length = gap_buffer.length();
+	size_t prefix = std::min(window_prefix, std::min(length, window_length));
+	size_t suffix = std::min(window_suffix, std::min(length, window_length) - prefix);
+	Snapshot text = gap_buffer.snapshot();
+	huge_file->replace(window_start + prefix, window_length - prefix - suffix, text.slice(prefix, length - prefix - suffix));
+	window_length = window_prefix = window_suffix = length;
+}
+
+// moves the window before the cursor gets near either end of it
+void TextBuffer::followWindow() {
+	if (!huge_file || selection) {
+		return;
+	}
+	size_t cursor = gap_buffer.pre_cursor_index;
+	size_t length = gap_buffer.length();
+	if ((cursor < WINDOW_SIZE / 4 && window_start > 0) ||
+		(length - cursor < WINDOW_SIZE / 4 && window_start + window_length < huge_file->size())) {
+		size_t offset = window_start + cursor;
+		loadWindow(offset);
+	}
+}
+
+// edits only happen at the cursor, so the unedited ends are what's either side of it
+void TextBuffer::markWindow() {
+	window_prefix = std::min(window_prefix, gap_buffer.pre_cursor_index);
+	window_suffix = std::min(window_suffix, gap_buffer.capacity - gap_buffer.post_cursor_index);
+}
+
+// fills in the line numbers of a view, the top row being line
+static void numberLines(Frame &number_column, size_t line) {
 	for (unsigned int i = 0; i < number_column.height; i++) {
 		Character ch = Character{CharColor::BLACK, CharColor::GREEN};
-		unsigned int number_line = i + screen_start_line;
+		size_t number_line = i + line;
 		for (unsigned int j = 4; j >= 1; j--) {
 			ch.character[0] = number_line % 10 + '0';
 			number_line /= 10;
 			number_column.contents[number_column.width * i + j - 1] = ch;
 		}
 	}
+}
+
+void TextBuffer::updateFrame() {
+	// held frames are drawn whole once they're let go, no need to lay them out
+	if (Frame::held) {
+		return;
+	}
+	Trace::Scope scope(TRACE_LAYOUT);
+	numberLines(view->number_column, view->screen_start_line + window_line);
 	if (gap_buffer.length() == 0) {
 		unsigned short screen_pos_x = 0, screen_pos_y = 0;
-		while (screen_pos_y < text_area.height) {
-			text_area.loadString(" ", 1, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
+		while (screen_pos_y < view->text_area.height) {
+			view->text_area.loadString(" ", 1, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
 			screen_pos_y++;
 			screen_pos_x = 0;
 		}
-		text_area.draw();
-		number_column.draw();
+		view->text_area.draw();
+		view->number_column.draw();
+		drawViews();
 		return;
 	}
 	unsigned short screen_pos_x = 0, screen_pos_y = 0;
 	size_t line_start = 0, line_length = 0;
 	if (selection) {
+		size_t selection_start_index = selectionIndex();
 		if (selection_start_index > gap_buffer.pre_cursor_index) {
-			line_start = *(gap_buffer.pre_cursor_lines.begin() + screen_start_line - 1);
+			line_start = gap_buffer.pre_cursor_lines[view->screen_start_line - 1];
 			line_length = gap_buffer.pre_cursor_index - line_start;
-			text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
+			view->text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
 			line_start = gap_buffer.post_cursor_index;
 			line_length = selection_start_index - gap_buffer.pre_cursor_index;
-			text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::WHITE);
-			if (screen_pos_y < text_area.height) {
+			view->text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::WHITE);
+			if (screen_pos_y < view->text_area.height) {
 				line_start = gap_buffer.post_cursor_index + line_length;
 				line_length = gap_buffer.capacity - line_start;
-				text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
+				view->text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
 			}
 		} else {
-			line_start = *(gap_buffer.pre_cursor_lines.begin() + screen_start_line - 1);
+			line_start = gap_buffer.pre_cursor_lines[view->screen_start_line - 1];
 			if (line_start < selection_start_index) {
 				line_length = selection_start_index - line_start;
-				text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
+				view->text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
 				line_start = selection_start_index;
 				line_length = gap_buffer.pre_cursor_index - selection_start_index;
-				text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::WHITE);
+				view->text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::WHITE);
 			} else {
 				line_length = gap_buffer.pre_cursor_index - line_start;
-				text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::WHITE);
+				view->text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::WHITE);
 			}
 			line_start = gap_buffer.post_cursor_index;
 			line_length = gap_buffer.capacity - line_start;
-			text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
+			view->text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
 		}
 	} else {
 		if (gap_buffer.pre_cursor_index > 0) {
-			line_start = *(gap_buffer.pre_cursor_lines.begin() + screen_start_line - 1);
+			line_start = gap_buffer.pre_cursor_lines[view->screen_start_line - 1];
 			line_length = gap_buffer.pre_cursor_index - line_start;
-			text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
+			view->text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
 		}
 		if (gap_buffer.post_cursor_index < gap_buffer.capacity) {
 			line_start = gap_buffer.post_cursor_index;
 			line_length = gap_buffer.capacity - line_start;
-			text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
+			view->text_area.loadString(&gap_buffer.buffer[line_start], line_length, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
 		}
 	}
-	while (screen_pos_y < text_area.height) {
-		text_area.loadString(" ", 1, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
+	while (screen_pos_y < view->text_area.height) {
+		view->text_area.loadString(" ", 1, screen_pos_x, screen_pos_y, CharColor::GREEN, CharColor::BLACK);
 		screen_pos_y++;
 		screen_pos_x = 0;
 	}
+	highlighter.render(gap_buffer, view->screen_start_line - 1, view->text_area);
 	
-	text_area.draw();
-	number_column.draw();
+	view->text_area.draw();
+	view->number_column.draw();
+	drawViews();
 	getCursorPosition();
 }
 
+// redraws every view, not just the active one
+void TextBuffer::redraw() {
+	for (std::unique_ptr<View> &other : views) {
+		other->dirty = true;
+	}
+	updateFrame();
+}
+
+/*
+ * Draws the views other than the active one that edits have touched
+ * since they were last drawn. They show whole lines from their top
+ * line on, read straight out of the gap buffer, or out of the huge
+ * file where they're outside its window.
+ */
+void TextBuffer::drawViews() {
+	for (std::unique_ptr<View> &pointer : views) {
+		View &other = *pointer;
+		if (&other == view || !other.dirty) {
+			continue;
+		}
+		other.dirty = false;
+		numberLines(other.number_column, other.screen_start_line);
+		Frame &area = other.text_area;
+		unsigned short x = 0, y = 0;
+		size_t first = other.screen_start_line - 1;
+		size_t lines = gap_buffer.line_count();
+		bool in_window = !huge_file || (first >= window_line && first + area.height <= window_line + lines);
+		if (in_window && first - window_line < lines) {
+			size_t start = gap_buffer.line_start(first - window_line);
+			size_t end = first - window_line + area.height < lines ?
+				gap_buffer.line_start(first - window_line + area.height) : gap_buffer.length();
+			// the visible lines are in at most two pieces, either side of the gap
+			size_t split = std::clamp(gap_buffer.pre_cursor_index, start, end);
+			size_t gap = gap_buffer.post_cursor_index - gap_buffer.pre_cursor_index;
+			area.loadString(&gap_buffer.buffer[start], split - start, x, y, CharColor::GREEN, CharColor::BLACK);
+			area.loadString(&gap_buffer.buffer[split + gap], end - split, x, y, CharColor::GREEN, CharColor::BLACK);
+		} else if (!in_window) {
+			commitWindow();
+			size_t start = huge_file->lineStart(first);
+			size_t end = huge_file->lineStart(first + area.height);
+			// lineStart stops at the last line when there aren't enough
+			if (end <= start || huge_file->lineAt(end) < first + area.height) {
+				end = huge_file->size();
+			}
+			end = std::min(end, start + (size_t)area.width * area.height * 4);
+			other.text.resize(end - start);
+			huge_file->read(start, end - start, other.text.data());
+			area.loadString(other.text.data(), other.text.size(), x, y, CharColor::GREEN, CharColor::BLACK);
+		}
+		while (y < area.height) {
+			area.loadString(" ", 1, x, y, CharColor::GREEN, CharColor::BLACK);
+			y++;
+			x = 0;
+		}
+		if (in_window) {
+			highlighter.render(gap_buffer, first - window_line, area);
+		}
+		area.draw();
+		other.number_column.draw();
+	}
+}
+
+void TextBuffer::place(View &target, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+	target.number_column.x = x;
+	target.number_column.y = y;
+	target.number_column.width = 4;
+	target.number_column.height = height;
+	target.text_area.x = x + 4;
+	target.text_area.y = y;
+	target.text_area.width = width - 4;
+	target.text_area.height = height;
+	target.number_column.init();
+	target.text_area.init();
+	target.dirty = true;
+}
+
+/*
+ * Makes next the active view. The active view's cursor is saved as
+ * a line and column, and the gap moves to next's, straight there
+ * rather than walking, so views far apart in a big file switch fast.
+ */
+void TextBuffer::activate(View *next) {
+	if (next == view) {
+		return;
+	}
+	// only the active view shows the selection
+	view->dirty = view->dirty || selection;
+	selection = false;
+	view->line = window_line + gap_buffer.pre_cursor_lines.size();
+	view->column = gap_buffer.pre_cursor_index - gap_buffer.pre_cursor_lines.back();
+	view->screen_start_line += window_line;
+	size_t top = next->screen_start_line;
+	view = next;
+	jumpTo(next->line, next->column);
+	size_t line = gap_buffer.pre_cursor_lines.size();
+	view->screen_start_line = std::clamp<size_t>(top > window_line ? top - window_line : 1, 1, line);
+	if (line >= view->screen_start_line + view->text_area.height) {
+		view->screen_start_line = line - view->text_area.height + 1;
+	}
+	updateFrame();
+}
+
+// puts the cursor at a line of the file, from 1, and a byte of that line
+void TextBuffer::jumpTo(size_t line, size_t column) {
+	if (huge_file && (line <= window_line || line > window_line + gap_buffer.line_count())) {
+		commitWindow();
+		loadWindow(huge_file->lineStart(line - 1));
+	}
+	size_t relative = std::min(line > window_line ? line - window_line : 1, gap_buffer.line_count()) - 1;
+	const char *data[2];
+	size_t length[2] = {0, 0};
+	gap_buffer.get_line(relative, data, length);
+	gap_buffer.move_gap(gap_buffer.line_start(relative) + std::min(column, length[0] + length[1]));
+}
+
+/*
+ * Keeps the other views on the same text after an edit at line (in
+ * the window) added or removed line_delta lines after it, and marks
+ * the ones whose lines changed for drawing.
+ */
+void TextBuffer::editViews(size_t line, long line_delta) {
+	if (views.size() == 1) {
+		return;
+	}
+	size_t edited = window_line + line + 1;
+	auto shift = [&](size_t &value) {
+		if (value <= edited) {
+			return;
+		}
+		// lines that were removed take whatever was on them to the edited line
+		if (line_delta < 0 && value <= edited - line_delta) {
+			value = edited;
+		} else {
+			value += line_delta;
+		}
+	};
+	for (std::unique_ptr<View> &other : views) {
+		if (other.get() == view) {
+			continue;
+		}
+		bool above = edited < other->screen_start_line;
+		bool visible = !above && edited < other->screen_start_line + other->text_area.height;
+		shift(other->line);
+		shift(other->screen_start_line);
+		if (visible || (above && line_delta != 0)) {
+			other->dirty = true;
+		}
+	}
+}
+
+/*
+ * Splits the active view in two, one above the other, or side by side
+ * if vertical. The new view takes the top or left half, showing the
+ * same place, and becomes active.
+ */
+Result TextBuffer::split(bool vertical) {
+	unsigned int x = view->number_column.x, y = view->number_column.y;
+	unsigned int width = view->number_column.width + view->text_area.width;
+	unsigned int height = view->text_area.height;
+	if (vertical ? width < 2 * MIN_VIEW_WIDTH : height < 2 * MIN_VIEW_HEIGHT) {
+		Logger::warn("not enough room to split the view");
+		return OUT_OF_BOUNDS;
+	}
+	auto added = std::make_unique<View>();
+	View *next = added.get();
+	if (vertical) {
+		place(*next, x, y, width / 2, height);
+		place(*view, x + width / 2, y, width - width / 2, height);
+	} else {
+		place(*next, x, y, width, height / 2);
+		place(*view, x, y + height / 2, width, height - height / 2);
+	}
+	next->line = window_line + gap_buffer.pre_cursor_lines.size();
+	next->column = gap_buffer.pre_cursor_index - gap_buffer.pre_cursor_lines.back();
+	next->screen_start_line = window_line + view->screen_start_line;
+	for (size_t i = 0; i < views.size(); i++) {
+		if (views[i].get() == view) {
+			views.insert(views.begin() + i, std::move(added));
+			break;
+		}
+	}
+	// the active view may have shrunk past its cursor
+	size_t line = gap_buffer.pre_cursor_lines.size();
+	if (line >= view->screen_start_line + view->text_area.height) {
+		view->screen_start_line = line - view->text_area.height + 1;
+	}
+	activate(next);
+	return SUCCESS;
+}
+
+// makes the next view active, in the order they were split
+void TextBuffer::nextView() {
+	for (size_t i = 0; i < views.size(); i++) {
+		if (views[i].get() == view) {
+			activate(views[(i + 1) % views.size()].get());
+			return;
+		}
+	}
+}
+
+/*
+ * Closes the active view, giving its space to a view that shares a
+ * whole side with it. Splits can leave a view with no such neighbour,
+ * in which case it stays open.
+ */
+Result TextBuffer::closeView() {
+	if (views.size() == 1) {
+		Logger::warn("can't close the last view");
+		return INVALID_INPUT;
+	}
+	unsigned int x = view->number_column.x, y = view->number_column.y;
+	unsigned int width = view->number_column.width + view->text_area.width;
+	unsigned int height = view->text_area.height;
+	for (size_t i = 0; i < views.size(); i++) {
+		View &other = *views[i];
+		unsigned int other_x = other.number_column.x, other_y = other.number_column.y;
+		unsigned int other_width = other.number_column.width + other.text_area.width;
+		unsigned int other_height = other.text_area.height;
+		bool stacked = other_x == x && other_width == width && (other_y + other_height == y || y + height == other_y);
+		bool beside = other_y == y && other_height == height && (other_x + other_width == x || x + width == other_x);
+		if (&other == view || !(stacked || beside)) {
+			continue;
+		}
+		View *closing = view;
+		activate(&other);
+		if (stacked) {
+			place(other, x, std::min(y, other_y), width, height + other_height);
+		} else {
+			place(other, std::min(x, other_x), y, width + other_width, height);
+		}
+		views.erase(std::find_if(views.begin(), views.end(),
+			[&](const std::unique_ptr<View> &pointer) { return pointer.get() == closing; }));
+		redraw();
+		return SUCCESS;
+	}
+	Logger::warn("no view to give the space to, ':only' closes the others");
+	return FAILED_TO_FIND;
+}
+
+// closes every view but the active one, which gets the whole area
+void TextBuffer::onlyView() {
+	if (views.size() == 1) {
+		return;
+	}
+	for (size_t i = 0; i < views.size(); i++) {
+		if (views[i].get() == view) {
+			std::swap(views[0], views[i]);
+			break;
+		}
+	}
+	views.resize(1);
+	place(*view, area_x, area_y, area_width, area_height);
+	redraw();
+}
+
 void TextBuffer::getCursorPosition() {
-	printf("\033[%li;%liH", text_area.y + gap_buffer.pre_cursor_lines.size() - screen_start_line + 1, text_area.x + gap_buffer.get_line_index() + 1);
-	fflush(stdout);
+	if (Frame::held) {
+		return;
+	}
+	Trace::Scope scope(TRACE_WRITE);
+	Terminal::print("\033[%li;%liH", view->text_area.y + gap_buffer.pre_cursor_lines.size() - view->screen_start_line + 1, view->text_area.x + gap_buffer.get_line_index() + 1);
+	Terminal::flush();
 }
 
 size_t TextBuffer::advance(size_t distance) {
+	Trace::Scope scope(TRACE_STORAGE);
 	size_t result = gap_buffer.advance(distance);
-	if (gap_buffer.pre_cursor_lines.size() > text_area.height * 3 / 4 + screen_start_line) {
-		screen_start_line = gap_buffer.pre_cursor_lines.size() - text_area.height * 3 / 4;
+	followWindow();
+	if (gap_buffer.pre_cursor_lines.size() > view->text_area.height * 3 / 4 + view->screen_start_line) {
+		view->screen_start_line = gap_buffer.pre_cursor_lines.size() - view->text_area.height * 3 / 4;
 		updateFrame();
 	} else if (selection) {
 		updateFrame();
@@ -132,16 +705,23 @@ size_t TextBuffer::advance(size_t distance) {
 }
 
 size_t TextBuffer::end() {
+	Trace::Scope scope(TRACE_STORAGE);
 	size_t result = gap_buffer.end();
+	followWindow();
 	if (selection) updateFrame();
 	else getCursorPosition();
 	return result;
 }
 
 size_t TextBuffer::down(size_t distance) {
+	if (huge_file && distance > gap_buffer.post_cursor_lines.size() && window_start + window_length < huge_file->size()) {
+		return move(window_line + gap_buffer.pre_cursor_lines.size() + distance);
+	}
+	Trace::Scope scope(TRACE_STORAGE);
 	size_t result = gap_buffer.down(distance);
-	if (gap_buffer.pre_cursor_lines.size() > text_area.height * 3 / 4 + screen_start_line) {
-		screen_start_line = gap_buffer.pre_cursor_lines.size() - text_area.height * 3 / 4;
+	followWindow();
+	if (gap_buffer.pre_cursor_lines.size() > view->text_area.height * 3 / 4 + view->screen_start_line) {
+		view->screen_start_line = gap_buffer.pre_cursor_lines.size() - view->text_area.height * 3 / 4;
 		updateFrame();
 	} else if (selection) {
 		updateFrame();
@@ -152,15 +732,17 @@ size_t TextBuffer::down(size_t distance) {
 }
 
 size_t TextBuffer::retreat(size_t distance) {
+	Trace::Scope scope(TRACE_STORAGE);
 	size_t result = gap_buffer.retreat(distance);
+	followWindow();
 	bool redraw = false;
-	if (screen_start_line == 1) {
+	if (view->screen_start_line == 1) {
 		redraw = false;
-	} else if (gap_buffer.pre_cursor_lines.size() < text_area.height / 4) {
-		screen_start_line = 1;
+	} else if (gap_buffer.pre_cursor_lines.size() < view->text_area.height / 4) {
+		view->screen_start_line = 1;
 		redraw = true;
-	} else if (gap_buffer.pre_cursor_lines.size() < text_area.height / 4 + screen_start_line) {
-		screen_start_line = gap_buffer.pre_cursor_lines.size() - text_area.height / 4;
+	} else if (gap_buffer.pre_cursor_lines.size() < view->text_area.height / 4 + view->screen_start_line) {
+		view->screen_start_line = gap_buffer.pre_cursor_lines.size() - view->text_area.height / 4;
 		redraw = true;
 	}
 	if (selection) redraw = true;
@@ -170,22 +752,30 @@ size_t TextBuffer::retreat(size_t distance) {
 }
 
 size_t TextBuffer::home() {
+	Trace::Scope scope(TRACE_STORAGE);
 	size_t result = gap_buffer.home();
+	followWindow();
 	if (selection) updateFrame();
 	else getCursorPosition();
 	return result;
 }
 
 size_t TextBuffer::up(size_t distance) {
+	if (huge_file && distance >= gap_buffer.pre_cursor_lines.size() && window_start > 0) {
+		size_t line = window_line + gap_buffer.pre_cursor_lines.size();
+		return move(line > distance ? line - distance : 1);
+	}
+	Trace::Scope scope(TRACE_STORAGE);
 	size_t result = gap_buffer.up(distance);
+	followWindow();
 	bool redraw = false;
-	if (screen_start_line == 1) {
+	if (view->screen_start_line == 1) {
 		redraw = false;
-	} else if (gap_buffer.pre_cursor_lines.size() < text_area.height / 4) {
-		screen_start_line = 1;
+	} else if (gap_buffer.pre_cursor_lines.size() < view->text_area.height / 4) {
+		view->screen_start_line = 1;
 		redraw = true;
-	} else if (gap_buffer.pre_cursor_lines.size() < text_area.height / 4 + screen_start_line) {
-		screen_start_line = gap_buffer.pre_cursor_lines.size() - text_area.height / 4;
+	} else if (gap_buffer.pre_cursor_lines.size() < view->text_area.height / 4 + view->screen_start_line) {
+		view->screen_start_line = gap_buffer.pre_cursor_lines.size() - view->text_area.height / 4;
 		redraw = true;
 	}
 	if (selection) redraw = true;
@@ -196,6 +786,20 @@ size_t TextBuffer::up(size_t distance) {
 
 size_t TextBuffer::move(size_t line) {
 	size_t result = 0;
+	// lines of a huge file count from the start of the file, not the window
+	if (huge_file) {
+		size_t window_lines = gap_buffer.line_count();
+		if (line <= window_line || line > window_line + window_lines) {
+			// edits have to be in the file before its lines can be found
+			commitWindow();
+			loadWindow(huge_file->lineStart(line - 1));
+			view->screen_start_line = gap_buffer.pre_cursor_lines.size() > view->text_area.height / 4 ?
+				gap_buffer.pre_cursor_lines.size() - view->text_area.height / 4 : 1;
+			updateFrame();
+			return 1;
+		}
+		line -= window_line;
+	}
 	if (line > gap_buffer.pre_cursor_lines.size()) {
 		result = down(line - gap_buffer.pre_cursor_lines.size());
 	} else {
@@ -204,8 +808,32 @@ size_t TextBuffer::move(size_t line) {
 	return result;
 }
 
+/*
+ * Lets the line caches know that line changed, and how many lines
+ * were added or removed after it.
+ */
+void TextBuffer::lineEdited(size_t line, size_t old_line_count) {
+	long line_delta = (long)gap_buffer.line_count() - (long)old_line_count;
+	edit_count++;
+	editViews(line, line_delta);
+	highlighter.edit(line, line_delta);
+	bracket_index.edit(gap_buffer, line, line_delta);
+}
+
 size_t TextBuffer::insert(const char *data, size_t length) {
+	if (multipleCursors()) {
+		return editCursors(0, 0, data, length);
+	}
+	Trace::Scope scope(TRACE_STORAGE);
+	size_t line = gap_buffer.pre_cursor_lines.size() - 1;
+	size_t line_count = gap_buffer.line_count();
+	size_t offset = window_start + gap_buffer.pre_cursor_index;
+	markWindow();
 	size_t insert_count = gap_buffer.insert(data, length);
+	markWindow();
+	undo_journal.record(offset, nullptr, 0, insert_count);
+	swap_journal.record(offset, 0, data, insert_count, fileSize());
+	lineEdited(line, line_count);
 	/*
 	if (length == 1) {
 		switch (data[0]) {
@@ -215,45 +843,622 @@ size_t TextBuffer::insert(const char *data, size_t length) {
 				break;
 		}
 	}*/
-	if (gap_buffer.pre_cursor_lines.size() > text_area.height * 3 / 4 + screen_start_line)
-		screen_start_line += gap_buffer.pre_cursor_lines.size() - text_area.height * 3 / 4 - screen_start_line;
+	if (gap_buffer.pre_cursor_lines.size() > view->text_area.height * 3 / 4 + view->screen_start_line)
+		view->screen_start_line += gap_buffer.pre_cursor_lines.size() - view->text_area.height * 3 / 4 - view->screen_start_line;
 	updateFrame();
 	return insert_count;
 }
 
+/*
+ * Adds text that was appended to the file, leaving the cursor where
+ * it is unless it was at the end, in which case it follows the text
+ * and the screen scrolls along with it. Doesn't redraw, so a batch of
+ * appends can be drawn once.
+ */
+size_t TextBuffer::append(const char *data, size_t length) {
+	Trace::Scope scope(TRACE_STORAGE);
+	if (huge_file) {
+		bool window_at_end = window_start + window_length == huge_file->size();
+		Snapshot text;
+		text.data[0] = data;
+		text.length[0] = length;
+		huge_file->replace(huge_file->size(), 0, text);
+		if (!window_at_end) {
+			return length;
+		}
+		// the same bytes went on the end of both, so they don't count as an edit
+		if (window_prefix == window_length) {
+			window_prefix += length;
+		}
+		window_suffix += length;
+		window_length += length;
+	}
+	size_t line = gap_buffer.line_count() - 1;
+	size_t line_count = gap_buffer.line_count();
+	size_t result = gap_buffer.append(data, length);
+	lineEdited(line, line_count);
+	if (gap_buffer.pre_cursor_lines.size() > view->text_area.height * 3 / 4 + view->screen_start_line) {
+		view->screen_start_line = gap_buffer.pre_cursor_lines.size() - view->text_area.height * 3 / 4;
+	}
+	// a window that only ever grows at the end would hold the whole file in the end
+	if (huge_file && gap_buffer.length() > 2 * WINDOW_SIZE) {
+		loadWindow(window_start + gap_buffer.pre_cursor_index);
+	}
+	return result;
+}
+
+// what the buffer keeps in memory, the text along with its indexes, caches and history
+size_t TextBuffer::memoryUsage() {
+	size_t lines = gap_buffer.pre_cursor_lines.memoryUsage() + gap_buffer.post_cursor_lines.memoryUsage();
+	return gap_buffer.capacity + lines + highlighter.memoryUsage() + bracket_index.memoryUsage() +
+		undo_journal.memoryUsage();
+}
+
+size_t TextBuffer::fileSize() {
+	return huge_file ? huge_file->size() - window_length + gap_buffer.length() : gap_buffer.length();
+}
+
+size_t TextBuffer::jumpToEnd() {
+	if (huge_file && window_start + window_length < huge_file->size()) {
+		commitWindow();
+		loadWindow(huge_file->size());
+		view->screen_start_line = gap_buffer.pre_cursor_lines.size() > view->text_area.height * 3 / 4 ?
+			gap_buffer.pre_cursor_lines.size() - view->text_area.height * 3 / 4 : 1;
+		updateFrame();
+		return 1;
+	}
+	return advance(gap_buffer.length() - gap_buffer.pre_cursor_index);
+}
+
 size_t TextBuffer::removeFront(size_t length) {
+	if (multipleCursors()) {
+		return editCursors(0, length, nullptr, 0);
+	}
+	Trace::Scope scope(TRACE_STORAGE);
+	size_t line_count = gap_buffer.line_count();
+	length = std::min(length, gap_buffer.capacity - gap_buffer.post_cursor_index);
+	undo_journal.record(window_start + gap_buffer.pre_cursor_index, &gap_buffer.buffer[gap_buffer.post_cursor_index], length, 0);
+	markWindow();
 	size_t remove_count = gap_buffer.removeFront(length);
+	markWindow();
+	swap_journal.record(window_start + gap_buffer.pre_cursor_index, remove_count, nullptr, 0, fileSize());
+	lineEdited(gap_buffer.pre_cursor_lines.size() - 1, line_count);
 	updateFrame();
 	return remove_count;
 }
 
 size_t TextBuffer::removeBack(size_t length) {
+	if (multipleCursors()) {
+		return editCursors(length, 0, nullptr, 0);
+	}
+	Trace::Scope scope(TRACE_STORAGE);
+	size_t line_count = gap_buffer.line_count();
+	length = std::min(length, gap_buffer.pre_cursor_index);
+	undo_journal.record(window_start + gap_buffer.pre_cursor_index - length, &gap_buffer.buffer[gap_buffer.pre_cursor_index - length], length, 0);
+	markWindow();
 	size_t remove_count = gap_buffer.removeBack(length);
+	markWindow();
+	swap_journal.record(window_start + gap_buffer.pre_cursor_index, remove_count, nullptr, 0, fileSize());
+	lineEdited(gap_buffer.pre_cursor_lines.size() - 1, line_count);
 	updateFrame();
 	return remove_count;
 }
 
-void TextBuffer::saveFile(FILE *file) {
-	gap_buffer.print(file);
+Result TextBuffer::saveFile(SaveEngine &save_engine, const std::string &filename, bool sync) {
+	// edits from here on are still unsaved once the save is done
+	swap_journal.mark();
+	if (huge_file) {
+		commitWindow();
+		std::vector<iovec> segments;
+		huge_file->segments(segments);
+		return save_engine.start(filename, std::move(segments), huge_file, edit_count, sync);
+	}
+	return save_engine.start(filename, gap_buffer.snapshot(), edit_count, sync);
 }
 
 void TextBuffer::beginSelection() {
-	selection_start_index = gap_buffer.pre_cursor_index;
+	selection_anchor = window_start + gap_buffer.pre_cursor_index;
 	selection = true;
 }
 
 void TextBuffer::cancelSelection() {
-	selection_start_index = 0;
+	selection_anchor = 0;
 	selection = false;
 	updateFrame();
 }
 
+// where the selection was started, as an index into the window, or the end of the window it's past
+size_t TextBuffer::selectionIndex() {
+	if (selection_anchor < window_start) {
+		return 0;
+	}
+	return std::min(selection_anchor - window_start, gap_buffer.length());
+}
+
+// whether the selection fits in the window, a huge file's can run into windows the cursor has left
+bool TextBuffer::selectionInWindow() {
+	return selection_anchor >= window_start && selection_anchor - window_start <= gap_buffer.length();
+}
+
+// length bytes from offset into the file, copied out of however many windows they're spread over
+Snapshot TextBuffer::copyRange(size_t offset, size_t length) {
+	std::vector<iovec> segments;
+	std::shared_ptr<const void> keep_alive;
+	rangeSegments(offset, length, segments, keep_alive);
+	Snapshot result;
+	if (length == 0) {
+		return result;
+	}
+	std::shared_ptr<char[]> bytes(new char[length]);
+	size_t copied = 0;
+	for (const iovec &segment : segments) {
+		memcpy(bytes.get() + copied, segment.iov_base, segment.iov_len);
+		copied += segment.iov_len;
+	}
+	result.storage = bytes;
+	result.data[0] = bytes.get();
+	result.length[0] = copied;
+	return result;
+}
+
 void TextBuffer::deleteSelection() {
+	Trace::Scope scope(TRACE_STORAGE);
+	if (!selectionInWindow()) {
+		size_t cursor = window_start + gap_buffer.pre_cursor_index;
+		size_t start = std::min(cursor, selection_anchor);
+		removeAt(start, std::max(cursor, selection_anchor) - start);
+		return;
+	}
+	size_t selection_start_index = selectionIndex();
+	size_t line_count = gap_buffer.line_count();
+	markWindow();
 	if (selection_start_index > gap_buffer.pre_cursor_index) {
-		gap_buffer.removeFront(selection_start_index - gap_buffer.pre_cursor_index);
+		size_t length = selection_start_index - gap_buffer.pre_cursor_index;
+		undo_journal.record(window_start + gap_buffer.pre_cursor_index, &gap_buffer.buffer[gap_buffer.post_cursor_index], length, 0);
+		gap_buffer.removeFront(length);
+		swap_journal.record(window_start + gap_buffer.pre_cursor_index, length, nullptr, 0, fileSize());
 	} else if (selection_start_index < gap_buffer.pre_cursor_index) {
-		gap_buffer.removeBack(gap_buffer.pre_cursor_index - selection_start_index);
+		size_t length = gap_buffer.pre_cursor_index - selection_start_index;
+		undo_journal.record(window_start + selection_start_index, &gap_buffer.buffer[selection_start_index], length, 0);
+		gap_buffer.removeBack(length);
+		swap_journal.record(window_start + gap_buffer.pre_cursor_index, length, nullptr, 0, fileSize());
 	}
+	markWindow();
+	lineEdited(gap_buffer.pre_cursor_lines.size() - 1, line_count);
+}
+
+// whether edits go to every cursor, the extra ones are dropped once the main one moves
+bool TextBuffer::multipleCursors() {
+	if (!cursors.empty() && window_start + gap_buffer.pre_cursor_index != cursor_anchor) {
+		cursors.clear();
+	}
+	return !cursors.empty();
+}
+
+size_t TextBuffer::cursorCount() {
+	return multipleCursors() ? cursors.size() + 1 : 1;
+}
+
+void TextBuffer::clearCursors() {
+	cursors.clear();
+}
+
+// keeps the extra cursors in order and apart, and notes where the main one is
+void TextBuffer::sortCursors() {
+	std::sort(cursors.begin(), cursors.end());
+	cursors.erase(std::unique(cursors.begin(), cursors.end()), cursors.end());
+	cursor_anchor = window_start + gap_buffer.pre_cursor_index;
+	cursors.erase(std::remove(cursors.begin(), cursors.end(), cursor_anchor), cursors.end());
+}
+
+// adds a cursor on each of the next count lines, in the main cursor's column or at the end of shorter lines
+size_t TextBuffer::addCursorsBelow(size_t count) {
+	multipleCursors();
+	size_t line = gap_buffer.pre_cursor_lines.size() - 1;
+	size_t column = gap_buffer.pre_cursor_index - gap_buffer.pre_cursor_lines.back();
+	size_t end = std::min(gap_buffer.line_count(), line + 1 + std::min(count, gap_buffer.line_count()));
+	const char *data[2];
+	size_t length[2];
+	for (size_t i = line + 1; i < end; i++) {
+		int span_count = gap_buffer.get_line(i, data, length);
+		size_t line_length = length[0] + (span_count > 1 ? length[1] : 0);
+		cursors.push_back(window_start + gap_buffer.line_start(i) + std::min(column, line_length));
+	}
+	sortCursors();
+	return end - line - 1;
+}
+
+/*
+ * Adds a cursor at the start of every other whole word match of the
+ * word under the cursor, and moves the cursor to the start of its own.
+ * Returns how many were added.
+ */
+size_t TextBuffer::addCursorsAtMatches() {
+	multipleCursors();
+	auto word = [](char c) { return isalnum((unsigned char)c) || c == '_'; };
+	size_t start = gap_buffer.pre_cursor_index;
+	while (start > 0 && word(gap_buffer.buffer[start - 1])) {
+		start--;
+	}
+	// with the gap at the start of the word, no match can span it
+	gap_buffer.move_gap(start);
+	size_t gap = gap_buffer.post_cursor_index - gap_buffer.pre_cursor_index;
+	size_t end = gap_buffer.post_cursor_index;
+	while (end < gap_buffer.capacity && word(gap_buffer.buffer[end])) {
+		end++;
+	}
+	size_t length = end - gap_buffer.post_cursor_index;
+	if (length == 0) {
+		return 0;
+	}
+	const char *needle = &gap_buffer.buffer[gap_buffer.post_cursor_index];
+	size_t text_length = gap_buffer.length();
+	auto at = [&](size_t offset) {
+		return gap_buffer.buffer[offset < gap_buffer.pre_cursor_index ? offset : offset + gap];
+	};
+	size_t added = 0;
+	for (int side = 0; side < 2; side++) {
+		const char *text = side == 0 ? gap_buffer.buffer : needle;
+		const char *limit = side == 0 ? &gap_buffer.buffer[gap_buffer.pre_cursor_index] : &gap_buffer.buffer[gap_buffer.capacity];
+		size_t base = side == 0 ? 0 : gap_buffer.pre_cursor_index;
+		for (const char *found = text; (found = (const char *)memmem(found, limit - found, needle, length)) != nullptr; found++) {
+			size_t offset = base + (found - text);
+			if (offset != gap_buffer.pre_cursor_index && (offset == 0 || !word(at(offset - 1))) &&
+				(offset + length == text_length || !word(at(offset + length)))) {
+				cursors.push_back(window_start + offset);
+				added++;
+			}
+		}
+	}
+	sortCursors();
+	updateFrame();
+	return added;
+}
+
+/*
+ * Makes the same edit at every cursor, removing remove_back bytes
+ * before each and remove_front after, then inserting data. The edits
+ * go in one sweep in offset order, the gap growing once to fit them
+ * all, so the text between the cursors is only moved once however
+ * many there are. Each edit is still recorded on its own, so undo
+ * takes them all back as one step. Returns how many bytes changed.
+ */
+size_t TextBuffer::editCursors(size_t remove_back, size_t remove_front, const char *data, size_t length) {
+	Trace::Scope scope(TRACE_STORAGE);
+	size_t main = window_start + gap_buffer.pre_cursor_index;
+	size_t text_length = gap_buffer.length();
+	// cursors the window has moved away from can't be edited
+	cursors.erase(std::remove_if(cursors.begin(), cursors.end(), [&](size_t cursor) {
+		return cursor < window_start || cursor > window_start + text_length;
+	}), cursors.end());
+	cursors.insert(std::lower_bound(cursors.begin(), cursors.end(), main), main);
+	gap_buffer.reserve_gap(cursors.size() * length);
+	long shift = 0;
+	size_t previous_end = 0;
+	size_t changed = 0;
+	for (size_t &cursor : cursors) {
+		size_t offset = cursor - window_start;
+		// where edits would overlap, the earlier one has already taken the bytes
+		size_t start = std::max(offset > remove_back ? offset - remove_back : 0, previous_end);
+		size_t end = std::max(start, std::min(offset + remove_front, text_length));
+		previous_end = end;
+		bool is_main = cursor == main;
+		gap_buffer.move_gap(start + shift);
+		size_t line = gap_buffer.pre_cursor_lines.size() - 1;
+		size_t line_count = gap_buffer.line_count();
+		size_t edit_offset = window_start + gap_buffer.pre_cursor_index;
+		undo_journal.record(edit_offset, &gap_buffer.buffer[gap_buffer.post_cursor_index], end - start, length);
+		markWindow();
+		gap_buffer.removeFront(end - start);
+		if (length > 0) {
+			gap_buffer.insert(data, length);
+		}
+		markWindow();
+		swap_journal.record(edit_offset, end - start, data, length, fileSize());
+		// each edit only touches the caches from its own line, like an edit at a single cursor
+		lineEdited(line, line_count);
+		shift += (long)length - (long)(end - start);
+		changed += length + end - start;
+		cursor = window_start + gap_buffer.pre_cursor_index;
+		if (is_main) {
+			main = cursor;
+		}
+	}
+	gap_buffer.move_gap(main - window_start);
+	sortCursors();
+	showCursor();
+	return changed;
+}
+
+/*
+ * Deletes the selection, returning what it held as a slice of the
+ * storage. A selection behind the cursor is moved after it first, so
+ * the removed text ends up at the far end of the gap, where typing
+ * doesn't write over it and make the buffer detach.
+ */
+Snapshot TextBuffer::cutSelection() {
+	if (!selectionInWindow()) {
+		size_t cursor = window_start + gap_buffer.pre_cursor_index;
+		size_t start = std::min(cursor, selection_anchor);
+		Snapshot removed = copyRange(start, std::max(cursor, selection_anchor) - start);
+		deleteSelection();
+		return removed;
+	}
+	if (selection_anchor < window_start + gap_buffer.pre_cursor_index) {
+		size_t end = window_start + gap_buffer.pre_cursor_index;
+		gap_buffer.move_gap(selection_anchor - window_start);
+		selection_anchor = end;
+	}
+	Snapshot removed = gap_buffer.extract(gap_buffer.pre_cursor_index, selection_anchor - window_start - gap_buffer.pre_cursor_index);
+	deleteSelection();
+	return removed;
+}
+
+// the offset into the file that line, from 1, starts at, or the end of the file if it's past the last line
+size_t TextBuffer::lineOffset(size_t line) {
+	if (huge_file) {
+		commitWindow();
+		size_t offset = huge_file->lineStart(line - 1);
+		return huge_file->lineAt(offset) + 1 < line ? huge_file->size() : offset;
+	}
+	return line - 1 < gap_buffer.line_count() ? gap_buffer.line_start(line - 1) : gap_buffer.length();
+}
+
+/*
+ * The text from offset for length bytes, as spans that stay as they are
+ * for as long as keep_alive does, however the buffer is edited. In a
+ * huge file they point into the map and the blocks of added text.
+ */
+void TextBuffer::rangeSegments(size_t offset, size_t length, std::vector<iovec> &segments, std::shared_ptr<const void> &keep_alive) {
+	segments.clear();
+	if (!huge_file) {
+		Snapshot text = gap_buffer.extract(offset, length);
+		for (int i = 0; i < 2; i++) {
+			if (text.length[i] > 0) {
+				segments.push_back(iovec{(void *)text.data[i], text.length[i]});
+			}
+		}
+		keep_alive = text.storage;
+		return;
+	}
+	commitWindow();
+	std::vector<iovec> all;
+	huge_file->segments(all);
+	size_t position = 0;
+	for (const iovec &segment : all) {
+		size_t start = std::max(position, offset);
+		size_t end = std::min(position + segment.iov_len, offset + length);
+		if (start < end) {
+			segments.push_back(iovec{(char *)segment.iov_base + start - position, end - start});
+		}
+		position += segment.iov_len;
+	}
+	keep_alive = huge_file;
+}
+
+/*
+ * Puts length bytes of data at offset into the file, leaving the cursor
+ * on the same text. Doesn't draw, so text that comes in many pieces can
+ * be drawn once at the end.
+ */
+size_t TextBuffer::insertAt(size_t offset, const char *data, size_t length) {
+	Trace::Scope scope(TRACE_STORAGE);
+	size_t cursor = window_start + gap_buffer.pre_cursor_index;
+	seek(offset);
+	size_t line = gap_buffer.pre_cursor_lines.size() - 1;
+	size_t line_count = gap_buffer.line_count();
+	markWindow();
+	size_t insert_count = gap_buffer.insert(data, length);
+	markWindow();
+	undo_journal.record(offset, nullptr, 0, insert_count);
+	swap_journal.record(offset, 0, data, insert_count, fileSize());
+	lineEdited(line, line_count);
+	seek(cursor < offset ? cursor : cursor + insert_count);
+	return insert_count;
+}
+
+/*
+ * Removes length bytes at offset into the file, leaving the cursor on
+ * the same text, or where the text was if it was removed. A huge file
+ * has it removed a window at a time. Doesn't draw.
+ */
+size_t TextBuffer::removeAt(size_t offset, size_t length) {
+	Trace::Scope scope(TRACE_STORAGE);
+	size_t cursor = window_start + gap_buffer.pre_cursor_index;
+	size_t removed = cut(offset, length, true);
+	seek(cursor <= offset ? cursor : cursor - std::min(cursor - offset, removed));
+	return removed;
+}
+
+// removes length bytes at offset a window at a time, leaving the cursor at offset, and noting them for undo if undoable
+size_t TextBuffer::cut(size_t offset, size_t length, bool undoable) {
+	size_t removed = 0;
+	while (removed < length) {
+		seek(offset);
+		// a window that ends at offset has nothing left to remove
+		if (huge_file && gap_buffer.post_cursor_index == gap_buffer.capacity && offset < fileSize()) {
+			loadWindow(offset);
+		}
+		size_t count = std::min(length - removed, gap_buffer.capacity - gap_buffer.post_cursor_index);
+		if (count == 0) {
+			break;
+		}
+		size_t line_count = gap_buffer.line_count();
+		if (undoable) {
+			undo_journal.record(offset, &gap_buffer.buffer[gap_buffer.post_cursor_index], count, 0);
+		}
+		markWindow();
+		gap_buffer.removeFront(count);
+		markWindow();
+		swap_journal.record(offset, count, nullptr, 0, fileSize());
+		lineEdited(gap_buffer.pre_cursor_lines.size() - 1, line_count);
+		removed += count;
+	}
+	return removed;
+}
+
+/*
+ * Undoes the last step, putting back what each of its edits removed in
+ * place of what they added, last edit first. Leaves the cursor where
+ * the step started, and returns how many edits it undid.
+ */
+size_t TextBuffer::undo() {
+	Trace::Scope scope(TRACE_STORAGE);
+	selection = false;
+	size_t count = 0;
+	UndoJournal::Record *record;
+	while ((record = undo_journal.undo(count == 0)) != nullptr) {
+		seek(record->offset);
+		if (record->added == UndoJournal::NOWHERE && record->added_length > 0) {
+			record->added = saveText(record->added_length);
+			if (record->added == UndoJournal::NOWHERE) {
+				undo_journal.clear();
+				break;
+			}
+		}
+		rewrite(record->added_length, record->removed, record->removed_length);
+		seek(record->offset);
+		count++;
+	}
+	showCursor();
+	return count;
+}
+
+// does the last step undone again, first edit first
+size_t TextBuffer::redo() {
+	Trace::Scope scope(TRACE_STORAGE);
+	selection = false;
+	size_t count = 0;
+	UndoJournal::Record *record;
+	while ((record = undo_journal.redo(count == 0)) != nullptr) {
+		seek(record->offset);
+		rewrite(record->removed_length, record->added, record->added_length);
+		seek(record->offset);
+		count++;
+	}
+	showCursor();
+	return count;
+}
+
+/*
+ * Replays the edits left in the swap file by an editor that died
+ * before saving them, as one step that can be undone. Returns how
+ * many there were.
+ */
+size_t TextBuffer::recover() {
+	Trace::Scope scope(TRACE_STORAGE);
+	if (swap_journal.beginRecovery() == 0) {
+		return 0;
+	}
+	undo_journal.seal();
+	size_t count = 0;
+	SwapJournal::Edit edit;
+	bool replayed = true;
+	while (replayed && swap_journal.nextEdit(edit)) {
+		// a removal can run on past a huge file's window, so it's cut like rewrite does
+		replayed = edit.offset <= fileSize() && cut(edit.offset, edit.removed_length, true) == edit.removed_length;
+		if (!replayed) {
+			break;
+		}
+		if (edit.length > 0) {
+			seek(edit.offset);
+			size_t line = gap_buffer.pre_cursor_lines.size() - 1;
+			size_t line_count = gap_buffer.line_count();
+			undo_journal.record(edit.offset, nullptr, 0, edit.length);
+			markWindow();
+			gap_buffer.insert(edit.data, edit.length);
+			markWindow();
+			lineEdited(line, line_count);
+		}
+		count++;
+		replayed = edit.text_length == SIZE_MAX || edit.text_length == fileSize();
+	}
+	// the text isn't what the swap says it was, so none of the replay is trusted
+	if (!replayed) {
+		Logger::error("the swap file doesn't replay onto the file, not recovering it!");
+		undo_journal.seal();
+		undo();
+		undo_journal.clear();
+		swap_journal.abandonRecovery();
+		showCursor();
+		return 0;
+	}
+	swap_journal.endRecovery();
+	undo_journal.seal();
+	showCursor();
+	return count;
+}
+
+// puts the cursor at an offset into the file, moving a huge file's window to it if need be
+void TextBuffer::seek(size_t offset) {
+	if (huge_file && (offset < window_start || offset > window_start + gap_buffer.length())) {
+		loadWindow(offset);
+		return;
+	}
+	gap_buffer.move_gap(offset - window_start);
+}
+
+/*
+ * Keeps length bytes after the cursor in the undo journal, returning
+ * where they went. In a huge file they can run on past the window, and
+ * are saved from wherever the file keeps them.
+ */
+uint64_t TextBuffer::saveText(size_t length) {
+	if (length <= gap_buffer.capacity - gap_buffer.post_cursor_index) {
+		return undo_journal.save(&gap_buffer.buffer[gap_buffer.post_cursor_index], length);
+	}
+	std::vector<iovec> segments;
+	std::shared_ptr<const void> keep_alive;
+	rangeSegments(window_start + gap_buffer.pre_cursor_index, length, segments, keep_alive);
+	uint64_t position = UndoJournal::NOWHERE;
+	for (const iovec &segment : segments) {
+		// saves are appended, so the rest follows on from the first
+		uint64_t saved = undo_journal.save((const char *)segment.iov_base, segment.iov_len);
+		if (saved == UndoJournal::NOWHERE) {
+			return UndoJournal::NOWHERE;
+		}
+		if (position == UndoJournal::NOWHERE) {
+			position = saved;
+		}
+	}
+	return position;
+}
+
+// replaces remove_length bytes after the cursor with length bytes of the journal
+void TextBuffer::rewrite(size_t remove_length, uint64_t position, size_t length) {
+	// more than the rest of a huge file's window is cut a window at a time first
+	if (remove_length > gap_buffer.capacity - gap_buffer.post_cursor_index) {
+		cut(window_start + gap_buffer.pre_cursor_index, remove_length, false);
+		remove_length = 0;
+	}
+	size_t line = gap_buffer.pre_cursor_lines.size() - 1;
+	size_t line_count = gap_buffer.line_count();
+	markWindow();
+	size_t offset = window_start + gap_buffer.pre_cursor_index;
+	size_t removed = gap_buffer.removeFront(std::min(remove_length, gap_buffer.capacity - gap_buffer.post_cursor_index));
+	size_t start = gap_buffer.pre_cursor_index;
+	while (length > 0) {
+		const char *data;
+		size_t count = undo_journal.read(position, length, data);
+		if (count == 0) {
+			break;
+		}
+		gap_buffer.insert(data, count);
+		position += count;
+		length -= count;
+	}
+	markWindow();
+	swap_journal.record(offset, removed, &gap_buffer.buffer[start], gap_buffer.pre_cursor_index - start, fileSize());
+	lineEdited(line, line_count);
+}
+
+// scrolls the view to the cursor if it's gone off it, then redraws
+void TextBuffer::showCursor() {
+	size_t line = gap_buffer.pre_cursor_lines.size();
+	if (line < view->screen_start_line || line >= view->screen_start_line + view->text_area.height) {
+		view->screen_start_line = line > view->text_area.height / 4 ? line - view->text_area.height / 4 : 1;
+	}
+	updateFrame();
 }
 
 const char base_64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -265,13 +1470,15 @@ size_t toBase64(const char *bytes, size_t length, char *base_64) {
 		length = 3069;
 	}
 	for (; i < length; i++) {
+		// the last byte has nothing after it, and may be the last of its storage
+		char next = i + 1 < length ? bytes[i + 1] : '\0';
 		if (index % 4 == 0) {
 			base_64[index] = base_64_chars[(bytes[i] & 0b11111100) >> 2];
 			index++;
-			base_64[index] = base_64_chars[((bytes[i] & 0b00000011) << 4) + ((bytes[i + 1] & 0b11110000) >> 4)];
+			base_64[index] = base_64_chars[((bytes[i] & 0b00000011) << 4) + ((next & 0b11110000) >> 4)];
 			index++;
 		} else if (index % 4 == 2) {
-			base_64[index] = base_64_chars[((bytes[i] & 0b00001111) << 2) + ((bytes[i + 1] & 0b11000000) >> 6)];
+			base_64[index] = base_64_chars[((bytes[i] & 0b00001111) << 2) + ((next & 0b11000000) >> 6)];
 			index++;
 		} else if (index % 4 == 3) {
 			base_64[index] = base_64_chars[(bytes[i] & 0b00111111)];
@@ -282,46 +1489,169 @@ size_t toBase64(const char *bytes, size_t length, char *base_64) {
 	return i;
 }
 
+// the selected text, sharing the buffer's storage
+Snapshot TextBuffer::selectedText() {
+	if (!selectionInWindow()) {
+		size_t cursor = window_start + gap_buffer.pre_cursor_index;
+		if (selection_anchor > cursor) {
+			return copyRange(cursor, selection_anchor - cursor - 1);
+		}
+		return copyRange(selection_anchor, cursor - selection_anchor);
+	}
+	size_t selection_start_index = selectionIndex();
+	if (selection_start_index > gap_buffer.pre_cursor_index) {
+		return gap_buffer.extract(gap_buffer.pre_cursor_index, selection_start_index - gap_buffer.pre_cursor_index - 1);
+	}
+	return gap_buffer.extract(selection_start_index, gap_buffer.pre_cursor_index - selection_start_index);
+}
+
 void TextBuffer::getSelection() {
-	size_t buffer_length = 0;
+	Snapshot selected = selectedText();
 	char base_64[4096] = {0};
-	printf("\033]52;c;");
-	char *buffer;
-	if (selection_start_index >= gap_buffer.pre_cursor_index) {
-		buffer_length = selection_start_index - gap_buffer.pre_cursor_index - 1;
-		buffer = &gap_buffer.buffer[gap_buffer.post_cursor_index];
-	} else {
-		buffer_length = gap_buffer.pre_cursor_index - selection_start_index;
-		buffer = &gap_buffer.buffer[selection_start_index];
-	} 
+	Terminal::print("\033]52;c;");
+	// the selection is all on one side of the cursor, so it's one span
+	const char *buffer = selected.data[0];
+	size_t buffer_length = selected.length[0];
 	while (buffer_length > 0) {
 		size_t length = toBase64(buffer, buffer_length, base_64);
 		buffer_length -= length;
 		buffer += length;
-		fwrite(base_64, 1, strlen(base_64), stdout);
+		Terminal::write(base_64, strlen(base_64));
 	}
-	printf("\033\\");
-	fflush(stdout);
+	Terminal::print("\033\\");
+	Terminal::flush();
 }
 
+/*
+ * Works out how far a new line should be indented. Uses the bracket
+ * nesting depth at the cursor, falling back on the tabs of the
+ * current line when there are no brackets around to go by.
+ */
 size_t TextBuffer::scopeCount() {
-	size_t scope_count = 0;
-	size_t open_brace = 0;
-	for (size_t i = gap_buffer.pre_cursor_lines.back(); i < gap_buffer.pre_cursor_index; i++) {
+	size_t line_start = gap_buffer.pre_cursor_lines.back();
+	size_t tab_count = 0;
+	bool has_bracket = false;
+	char last = '\0';
+	for (size_t i = line_start; i < gap_buffer.pre_cursor_index; i++) {
 		switch (gap_buffer.buffer[i]) {
 			case '\t':
-				scope_count++;
+				tab_count++;
 				break;
+			case '(':
 			case '[':
 			case '{':
-			case ':':
-				open_brace = 1;
-				break;
-			case '}':
+			case ')':
 			case ']':
-				open_brace = 0;
+			case '}':
+				has_bracket = true;
 				break;
 		}
+		if (!isspace((unsigned char)gap_buffer.buffer[i])) {
+			last = gap_buffer.buffer[i];
+		}
+	}
+	int delta = 0, min = 0;
+	BracketIndex::summarize(&gap_buffer.buffer[line_start], gap_buffer.pre_cursor_index - line_start, delta, min);
+	long depth = bracket_index.depthAt(gap_buffer.pre_cursor_lines.size() - 1) + delta;
+
+	size_t scope_count = tab_count;
+	if (depth > 0 || has_bracket) {
+		scope_count = depth > 0 ? depth : 0;
+	}
+	if (last == ':') {
+		scope_count++;
+	}
+	return scope_count;
+}
+
+/*
+ * Jumps to the bracket matching the one under the cursor. The
+ * cursor line is scanned directly, and the bracket index finds
+ * the line holding the match when it's further away.
+ */
+size_t TextBuffer::matchBracket() {
+	if (gap_buffer.post_cursor_index >= gap_buffer.capacity) {
+		return 0;
+	}
+	bool forward;
+	switch (gap_buffer.buffer[gap_buffer.post_cursor_index]) {
+		case '(': case '[': case '{': forward = true; break;
+		case ')': case ']': case '}': forward = false; break;
+		default: return 0;
+	}
+
+	const char *data[2];
+	size_t length[2] = {0, 0};
+	auto loadLine = [&](size_t line) {
+		length[1] = 0;
+		gap_buffer.get_line(line, data, length);
+	};
+	auto at = [&](size_t i) {
+		return i < length[0] ? data[0][i] : data[1][i - length[0]];
+	};
+	auto isOpen = [](char c) { return c == '(' || c == '[' || c == '{'; };
+	auto isClose = [](char c) { return c == ')' || c == ']' || c == '}'; };
+
+	size_t line = gap_buffer.pre_cursor_lines.size() - 1;
+	size_t column = gap_buffer.pre_cursor_index - gap_buffer.pre_cursor_lines.back();
+	size_t target_line = line;
+	size_t target_column = BracketIndex::NOT_FOUND;
+	loadLine(line);
+	size_t line_length = length[0] + length[1];
+
+	long level = 0;
+	if (forward) {
+		for (size_t i = column + 1; i < line_length && target_column == BracketIndex::NOT_FOUND; i++) {
+			if (isOpen(at(i))) level++;
+			else if (isClose(at(i)) && level-- == 0) target_column = i;
+		}
+	} else {
+		for (size_t i = column; i > 0 && target_column == BracketIndex::NOT_FOUND; i--) {
+			if (isClose(at(i - 1))) level++;
+			else if (isOpen(at(i - 1)) && level-- == 0) target_column = i - 1;
+		}
+	}
+
+	if (target_column == BracketIndex::NOT_FOUND) {
+		long depth = bracket_index.depthAt(line);
+		for (size_t i = 0; i < column + forward; i++) {
+			if (isOpen(at(i))) depth++;
+			else if (isClose(at(i))) depth--;
+		}
+		if (forward) {
+			target_line = bracket_index.findForward(line + 1, depth);
+		} else {
+			target_line = line == 0 ? BracketIndex::NOT_FOUND : bracket_index.findBackward(line - 1, depth);
+		}
+		if (target_line == BracketIndex::NOT_FOUND) {
+			return 0;
+		}
+		loadLine(target_line);
+		line_length = length[0] + length[1];
+		long line_depth = bracket_index.depthAt(target_line);
+		for (size_t i = 0; i < line_length; i++) {
+			if (isOpen(at(i))) {
+				if (!forward && line_depth < depth) target_column = i;
+				line_depth++;
+			} else if (isClose(at(i))) {
+				line_depth--;
+				if (forward && line_depth < depth) {
+					target_column = i;
+					break;
+				}
+			}
+		}
+		if (target_column == BracketIndex::NOT_FOUND) {
+			Logger::error("bracket index is out of sync with the buffer!");
+			return 0;
+		}
+	}
+
+	size_t target = gap_buffer.line_start(target_line) + target_column;
+	if (target > gap_buffer.pre_cursor_index) {
+		advance(target - gap_buffer.pre_cursor_index);
+	} else {
+		retreat(gap_buffer.pre_cursor_index - target);
 	}
-	return scope_count + open_brace;
+	return 1;
 }
\ No newline at end of file
@@ -3,9 +3,17 @@
 #include "defines.hpp"
 #include "screen.hpp"
 #include "gap_buffer.hpp"
+#include "highlight.hpp"
+#include "huge_file.hpp"
+#include "bracket_index.hpp"
+#include "save.hpp"
+#include "swap.hpp"
+#include "undo.hpp"
 
 #include <cstdio>
+#include <memory>
 #include <string>
+#include <vector>
 
 struct TextBufferSettings {
 	unsigned int x = 0, y = 0;
@@ -19,13 +27,42 @@ struct TextBufferSettings {
 	char newline_char[4] = " ";
 };
 
+/* View
+ * One window onto a TextBuffer. Every view of a buffer shares its
+ * storage, line index and caches, and has its own place in it. Only
+ * the active view has the real cursor, the gap, so the others keep
+ * theirs as a line and a byte offset into it, which edits elsewhere
+ * move along with the text.
+ * text_area, number_column: where the view is drawn.
+ * screen_start_line: the line at the top of the view, from 1. Counted
+ *   from the start of the huge file's window while the view is active,
+ *   and from the start of the file otherwise.
+ * line, column: the cursor of a view that isn't active.
+ * dirty: whether an edit touched the lines the view shows since it
+ *   was last drawn.
+ * text: the lines of a huge file the view shows, when they aren't in
+ *   the window.
+ */
+struct View {
+	Frame text_area;
+	Frame number_column;
+	size_t screen_start_line = 1;
+	size_t line = 1;
+	size_t column = 0;
+	bool dirty = false;
+	std::string text;
+};
+
 class TextBuffer {
 public:
 	TextBuffer(const TextBufferSettings &settings);
 
 	Result loadBuffer(const std::string &filename);
+	Result reload(const std::string &filename);
+	Result loadStream(int fd);
 	size_t getBufferSize() { return gap_buffer.length(); }
 	void getCursorPosition();
+	void redraw();
 
 	size_t shiftUp();
 	size_t shiftDown();
@@ -37,21 +74,77 @@ public:
 	size_t up(size_t distance);
 	size_t move(size_t line);
 	size_t insert(const char *data, size_t length);
+	size_t append(const char *data, size_t length);
+	size_t jumpToEnd();
+	size_t fileSize();
 	size_t removeFront(size_t length);
 	size_t removeBack(size_t length);
 	long getCursorX() { return gap_buffer.line_index; }
-	void saveFile(FILE *file);
+	size_t getCursorLine() { return window_line + gap_buffer.pre_cursor_lines.size(); }
+	size_t memoryUsage();
+	Result saveFile(SaveEngine &save_engine, const std::string &filename, bool sync);
+	size_t getEditCount() { return edit_count; }
+	Snapshot snapshot() { return gap_buffer.snapshot(); }
 	
 	void beginSelection();
 	void cancelSelection();
 	void deleteSelection();
+	Snapshot cutSelection();
 	void getSelection();
+	Snapshot selectedText();
+
+	size_t lineOffset(size_t line);
+	void rangeSegments(size_t offset, size_t length, std::vector<iovec> &segments, std::shared_ptr<const void> &keep_alive);
+	size_t insertAt(size_t offset, const char *data, size_t length);
+	size_t removeAt(size_t offset, size_t length);
 	size_t scopeCount();
+	size_t matchBracket();
+
+	Result split(bool vertical);
+	void nextView();
+	Result closeView();
+	void onlyView();
+
+	size_t addCursorsBelow(size_t count);
+	size_t addCursorsAtMatches();
+	size_t cursorCount();
+	void clearCursors();
+
+	size_t undo();
+	size_t redo();
+	void sealUndo() { undo_journal.seal(); }
+	size_t recover();
+	void saved() { swap_journal.saved(); }
+	void flushSwap(uint64_t now) { swap_journal.tick(now); }
 	
 private:
 	void getChar(char buffer[5], unsigned int &i);
 	void updateFrame();
+	void drawViews();
+	void place(View &target, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+	void activate(View *next);
+	void jumpTo(size_t line, size_t column);
+	void editViews(size_t line, long line_delta);
+	void seek(size_t offset);
+	size_t selectionIndex();
+	bool selectionInWindow();
+	Snapshot copyRange(size_t offset, size_t length);
+	void rewrite(size_t remove_length, uint64_t position, size_t length);
+	uint64_t saveText(size_t length);
+	size_t cut(size_t offset, size_t length, bool undoable);
+	void showCursor();
+	void lineEdited(size_t line, size_t old_line_count);
+	void resetCaches();
+	bool multipleCursors();
+	void sortCursors();
+	size_t editCursors(size_t remove_back, size_t remove_front, const char *data, size_t length);
+	void loadWindow(size_t offset);
+	void commitWindow();
+	void followWindow();
+	void markWindow();
 	Result resizeBuffer(long length);
+	// how much more of a stream is read at a time
+	static constexpr size_t STREAM_READ_SIZE = 1 << 16;
 	// settings
 	unsigned int tab_width;
 	unsigned int scrolloff;
@@ -60,17 +153,48 @@ private:
 	char tab_char[4] = " ";
 	char newline_char[4] = " ";
 
-	// screen member variables
-	size_t screen_start_index = 0;
-	size_t screen_end_index = 0;
-	size_t screen_start_line = 1;
-	size_t cursor_y = 0;
-	Frame text_area;
-	Frame number_column;
+	// views, and the part of the screen they split between them
+	static constexpr unsigned int MIN_VIEW_WIDTH = 16;
+	static constexpr unsigned int MIN_VIEW_HEIGHT = 2;
+	unsigned int area_x = 0, area_y = 0;
+	unsigned int area_width = 80, area_height = 40;
+	std::vector<std::unique_ptr<View>> views;
+	View *view = nullptr;
 	
 	GapBuffer gap_buffer;
+	size_t edit_count = 0;
+	Highlighter highlighter;
+	BracketIndex bracket_index;
+	UndoJournal undo_journal;
+	SwapJournal swap_journal;
 	
-	// selection
-	size_t selection_start_index = 0;
+	// selection, from the offset into the file it was started at, which stays put when a huge file's window moves
+	size_t selection_anchor = 0;
 	bool selection = false;
+
+	/* multiple cursors
+	 * cursors: the offsets into the file of the cursors besides the
+	 *   main one, in order. Edits go to all of them, for as long as the
+	 *   main cursor stays where the last one left it.
+	 * cursor_anchor: the offset of the main cursor after the last edit.
+	 */
+	std::vector<size_t> cursors;
+	size_t cursor_anchor = 0;
+
+	/* huge files
+	 * Only a window of a huge file is loaded into the gap buffer at a
+	 * time, and moved along with the cursor. Edits go back into the
+	 * HugeFile when the window moves, or the file is saved.
+	 * window_start, window_length: the bytes of the file loaded.
+	 * window_line: the line of the file the window starts on.
+	 * window_prefix, window_suffix: how much of the start and end of
+	 *   the window hasn't been edited since it was loaded.
+	 */
+	static constexpr size_t WINDOW_SIZE = 4 << 20;
+	std::shared_ptr<HugeFile> huge_file;
+	size_t window_start = 0;
+	size_t window_length = 0;
+	size_t window_line = 0;
+	size_t window_prefix = 0;
+	size_t window_suffix = 0;
 }; 
\ No newline at end of file
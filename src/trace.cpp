@@ -0,0 +1,151 @@
+#include "trace.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+const char *TRACE_POINT_NAMES[TRACE_COUNT] = {
+	"parse",
+	"dispatch",
+	"storage",
+	"layout",
+	"compose",
+	"write",
+	"key",
+	"typing",
+};
+
+size_t Histogram::bucketOf(uint64_t value) {
+	if (value < 2 * SUB_BUCKETS) {
+		return value;
+	}
+	int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+	return SUB_BUCKETS * shift + (value >> shift);
+}
+
+// the highest value that lands in the bucket
+uint64_t Histogram::valueOf(size_t bucket) {
+	if (bucket < 2 * SUB_BUCKETS) {
+		return bucket;
+	}
+	int shift = bucket / SUB_BUCKETS - 1;
+	uint64_t sub_bucket = bucket - SUB_BUCKETS * shift;
+	return ((sub_bucket + 1) << shift) - 1;
+}
+
+void Histogram::record(uint64_t value) {
+	buckets[bucketOf(value)]++;
+	count++;
+	sum += value;
+	min = std::min(min, value);
+	max = std::max(max, value);
+}
+
+uint64_t Histogram::percentile(double p) const {
+	if (count == 0) {
+		return 0;
+	}
+	uint64_t target = std::max<uint64_t>(1, (uint64_t)std::ceil(p / 100.0 * count));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= target) {
+			return std::min(valueOf(i), max);
+		}
+	}
+	return max;
+}
+
+void Histogram::reset() {
+	*this = Histogram{};
+}
+
+Histogram Trace::histograms[TRACE_COUNT];
+uint64_t Trace::elapsed[TRACE_COUNT];
+unsigned int Trace::used = 0;
+bool Trace::active = false;
+TracePoint Trace::current = TRACE_PARSE;
+uint64_t Trace::key_start = 0;
+uint64_t Trace::point_start = 0;
+
+void Trace::beginKey() {
+	for (int i = 0; i < TRACE_COUNT; i++) {
+		elapsed[i] = 0;
+	}
+	used = 1 << TRACE_PARSE;
+	current = TRACE_PARSE;
+	key_start = Logger::now();
+	point_start = key_start;
+	active = true;
+}
+
+void Trace::endKey(bool typing) {
+	if (!active) {
+		return;
+	}
+	uint64_t time = Logger::now();
+	elapsed[current] += time - point_start;
+	active = false;
+	for (int i = 0; i < TRACE_KEY; i++) {
+		if (used & (1 << i)) {
+			histograms[i].record(elapsed[i]);
+		}
+	}
+	histograms[TRACE_KEY].record(time - key_start);
+	if (typing) {
+		histograms[TRACE_TYPING].record(time - key_start);
+	}
+}
+
+TracePoint Trace::enter(TracePoint point) {
+	TracePoint previous = current;
+	if (active) {
+		uint64_t time = Logger::now();
+		elapsed[current] += time - point_start;
+		point_start = time;
+		current = point;
+		used |= 1 << point;
+	}
+	return previous;
+}
+
+void Trace::leave(TracePoint previous) {
+	if (active) {
+		uint64_t time = Logger::now();
+		elapsed[current] += time - point_start;
+		point_start = time;
+		current = previous;
+	}
+}
+
+void Trace::reset() {
+	for (int i = 0; i < TRACE_COUNT; i++) {
+		histograms[i].reset();
+	}
+}
+
+Result Trace::writeJson(const char *file_name) {
+	FILE *file = fopen(file_name, "w");
+	if (file == nullptr) {
+		Logger::error("failed to open the stats file!");
+		return IO_ERROR;
+	}
+	const double PERCENTILES[] = {50, 90, 99, 99.9};
+	fprintf(file, "{\n\t\"unit\": \"ns\",\n\t\"histograms\": {");
+	for (int i = 0; i < TRACE_COUNT; i++) {
+		const Histogram &h = histograms[i];
+		fprintf(file, "%s\n\t\t\"%s\": {\"count\": %llu, \"min\": %llu, \"mean\": %.0f, \"max\": %llu",
+			i ? "," : "", TRACE_POINT_NAMES[i], (unsigned long long)h.count,
+			(unsigned long long)(h.count ? h.min : 0), h.mean(), (unsigned long long)h.max);
+		for (double p : PERCENTILES) {
+			fprintf(file, ", \"p%g\": %llu", p, (unsigned long long)h.percentile(p));
+		}
+		fprintf(file, "}");
+	}
+	fprintf(file, "\n\t}\n}\n");
+	if (fclose(file) != 0) {
+		return IO_ERROR;
+	}
+	return SUCCESS;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "defines.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+enum TracePoint {
+	TRACE_PARSE = 0,
+	TRACE_DISPATCH,
+	TRACE_STORAGE,
+	TRACE_LAYOUT,
+	TRACE_COMPOSE,
+	TRACE_WRITE,
+	TRACE_KEY,
+	TRACE_TYPING,
+	TRACE_COUNT,
+};
+
+extern const char *TRACE_POINT_NAMES[TRACE_COUNT];
+
+/* Histogram
+ * A log-linear latency histogram in the style of HdrHistogram.
+ * Values below 64ns get a bucket each, above that every power of two
+ * is split into 32 buckets, so any recorded value is off by at most
+ * ~3% and recording is a couple of shifts and an increment.
+ * record: adds a value in nanoseconds.
+ * percentile: the smallest value that at least p percent of the
+ *   recorded values are less than or equal to.
+ */
+class Histogram {
+public:
+	void record(uint64_t value);
+	uint64_t percentile(double p) const;
+	double mean() const { return count ? (double)sum / count : 0.0; }
+	void reset();
+
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	uint64_t min = UINT64_MAX;
+	uint64_t max = 0;
+
+private:
+	static constexpr int SUB_BUCKET_BITS = 5;
+	static constexpr size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+	static constexpr size_t BUCKETS = SUB_BUCKETS * (64 - SUB_BUCKET_BITS + 1);
+
+	static size_t bucketOf(uint64_t value);
+	static uint64_t valueOf(size_t bucket);
+
+	uint32_t buckets[BUCKETS] = {0};
+};
+
+/* Trace
+ * Per-keystroke latency tracing. beginKey is called once a read()
+ * returns input, and endKey once the last byte for it has been
+ * flushed to the terminal. In between, Scopes attribute the elapsed
+ * time to trace points. Scopes nest, and time spent in an inner scope
+ * is only counted there, so the points of a key add up to its total.
+ * Time outside any scope goes to TRACE_PARSE. Each point is recorded
+ * into its histogram once per key it was used in, and TRACE_KEY gets
+ * the total, as does TRACE_TYPING for keys typed in insert mode.
+ * writeJson: dumps all the histograms, returns IO_ERROR if the file
+ *   can't be written.
+ */
+class Trace {
+public:
+	class Scope {
+	public:
+		Scope(TracePoint point) { previous = Trace::enter(point); }
+		~Scope() { Trace::leave(previous); }
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+
+	private:
+		TracePoint previous;
+	};
+
+	static void beginKey();
+	static void endKey(bool typing);
+	static const Histogram &histogram(TracePoint point) { return histograms[point]; }
+	static void reset();
+	static Result writeJson(const char *file_name);
+
+private:
+	static TracePoint enter(TracePoint point);
+	static void leave(TracePoint previous);
+
+	static Histogram histograms[TRACE_COUNT];
+	static uint64_t elapsed[TRACE_COUNT];
+	static unsigned int used;
+	static bool active;
+	static TracePoint current;
+	static uint64_t key_start;
+	static uint64_t point_start;
+};
@@ -0,0 +1,216 @@
+#include "undo.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+UndoJournal::UndoJournal() : memory_budget(budget()) {
+	// so the first few edits after opening a file don't allocate
+	records.reserve(1024);
+	chunks.reserve(16);
+	spare = std::make_unique<char[]>(CHUNK_SIZE);
+}
+
+UndoJournal::~UndoJournal() {
+	if (spill_fd >= 0) {
+		close(spill_fd);
+	}
+}
+
+size_t UndoJournal::budget() {
+	const char *value = getenv("YADDA_UNDO_MEMORY");
+	if (value != nullptr) {
+		return strtoull(value, nullptr, 10);
+	}
+	return 64 << 20;
+}
+
+void UndoJournal::record(size_t offset, const char *removed, size_t removed_length, size_t added_length) {
+	if (removed_length == 0 && added_length == 0) {
+		return;
+	}
+	// whatever was undone can't be redone once the text has moved on
+	if (applied < records.size()) {
+		records.resize(applied);
+		sealed = true;
+	}
+	if (!sealed && !records.empty() && records.back().added == NOWHERE) {
+		Record &last = records.back();
+		size_t last_end = last.offset + last.added_length;
+		if (removed_length == 0 && offset == last_end) {
+			last.added_length += added_length;
+			return;
+		}
+		if (added_length == 0 && removed_length <= last.added_length && offset + removed_length == last_end) {
+			last.added_length -= removed_length;
+			if (last.added_length == 0 && last.removed_length == 0) {
+				sealed = !last.joined;
+				records.pop_back();
+				applied--;
+			}
+			return;
+		}
+		// deleting forward from the same place, the bytes carry on from the last ones saved
+		if (added_length == 0 && last.added_length == 0 && offset == last.offset &&
+			last.removed + last.removed_length == end) {
+			if (save(removed, removed_length) == NOWHERE) {
+				clear();
+				return;
+			}
+			last.removed_length += removed_length;
+			return;
+		}
+	}
+	uint64_t position = NOWHERE;
+	if (removed_length > 0) {
+		position = save(removed, removed_length);
+		if (position == NOWHERE) {
+			// an edit that can't be undone leaves nothing before it undoable either
+			clear();
+			return;
+		}
+	}
+	bool joined = !sealed && !records.empty();
+	records.push_back(Record{offset, removed_length, added_length, position, NOWHERE, joined});
+	applied = records.size();
+	sealed = false;
+}
+
+void UndoJournal::clear() {
+	records.clear();
+	applied = 0;
+	sealed = true;
+	if (!chunks.empty()) {
+		spare = std::move(chunks.front());
+	}
+	chunks.clear();
+	memory_start = end = 0;
+	if (spill_fd >= 0 && ftruncate(spill_fd, 0) != 0) {
+		Logger::warn("failed to truncate the undo spill file");
+	}
+}
+
+UndoJournal::Record *UndoJournal::undo(bool first) {
+	if (applied == 0 || (!first && !records[applied].joined)) {
+		return nullptr;
+	}
+	sealed = true;
+	return &records[--applied];
+}
+
+UndoJournal::Record *UndoJournal::redo(bool first) {
+	if (applied == records.size() || (!first && !records[applied].joined)) {
+		return nullptr;
+	}
+	sealed = true;
+	return &records[applied++];
+}
+
+static bool writeAll(int fd, const char *data, size_t length, uint64_t offset) {
+	while (length > 0) {
+		ssize_t written = pwrite(fd, data, length, offset);
+		if (written <= 0) {
+			return false;
+		}
+		data += written;
+		length -= written;
+		offset += written;
+	}
+	return true;
+}
+
+/*
+ * Makes room in memory for length more bytes, by spilling the oldest
+ * chunks. The spill file is opened the first time it's needed, and
+ * unlinked straight away so it goes when the editor does.
+ */
+bool UndoJournal::spill(size_t length) {
+	if (end - memory_start + length <= memory_budget) {
+		return true;
+	}
+	if (spill_fd < 0) {
+		const char *directory = getenv("TMPDIR");
+		std::string name = std::string(directory != nullptr ? directory : "/tmp") + "/yadda-undo-XXXXXX";
+		spill_fd = mkstemp(name.data());
+		if (spill_fd < 0) {
+			Logger::error("failed to open the undo spill file!");
+			return false;
+		}
+		unlink(name.c_str());
+	}
+	while (!chunks.empty() && end - memory_start + length > memory_budget) {
+		if (!spillChunk()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool UndoJournal::spillChunk() {
+	size_t length = std::min<uint64_t>(CHUNK_SIZE, end - memory_start);
+	if (!writeAll(spill_fd, chunks.front().get(), length, memory_start)) {
+		Logger::error("failed to write to the undo spill file!");
+		return false;
+	}
+	memory_start += length;
+	spare = std::move(chunks.front());
+	chunks.erase(chunks.begin());
+	return true;
+}
+
+uint64_t UndoJournal::save(const char *data, size_t length) {
+	uint64_t position = end;
+	if (!spill(length)) {
+		return NOWHERE;
+	}
+	// too big to keep, and everything before it is already on disk
+	if (end - memory_start + length > memory_budget) {
+		if (!writeAll(spill_fd, data, length, end)) {
+			Logger::error("failed to write to the undo spill file!");
+			return NOWHERE;
+		}
+		end += length;
+		memory_start = end;
+		return position;
+	}
+	while (length > 0) {
+		size_t used = end - memory_start;
+		size_t at = used % CHUNK_SIZE;
+		if (at == 0 && used / CHUNK_SIZE == chunks.size()) {
+			chunks.push_back(spare ? std::move(spare) : std::make_unique<char[]>(CHUNK_SIZE));
+		}
+		size_t count = std::min(length, CHUNK_SIZE - at);
+		memcpy(chunks[used / CHUNK_SIZE].get() + at, data, count);
+		data += count;
+		length -= count;
+		end += count;
+	}
+	return position;
+}
+
+size_t UndoJournal::read(uint64_t position, size_t length, const char *&data) {
+	if (position >= end) {
+		return 0;
+	}
+	if (position >= memory_start) {
+		size_t used = position - memory_start;
+		size_t at = used % CHUNK_SIZE;
+		data = chunks[used / CHUNK_SIZE].get() + at;
+		return std::min<uint64_t>({length, CHUNK_SIZE - at, end - position});
+	}
+	if (!scratch) {
+		scratch = std::make_unique<char[]>(CHUNK_SIZE);
+	}
+	size_t count = std::min<uint64_t>({length, CHUNK_SIZE, memory_start - position});
+	ssize_t result = pread(spill_fd, scratch.get(), count, position);
+	if (result <= 0) {
+		Logger::error("failed to read the undo spill file!");
+		return 0;
+	}
+	data = scratch.get();
+	return result;
+}
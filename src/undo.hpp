@@ -0,0 +1,85 @@
+#pragma once
+
+#include "defines.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/* UndoJournal
+ * The edits made to a buffer, so they can be undone and redone. Each
+ * edit is a record of where it happened and how many bytes it took out
+ * and put in. Bytes that are in the text don't need keeping, so a
+ * record only points at the ones that aren't: what the edit removed,
+ * and once it's been undone, what it added. Those go in an append-only
+ * journal of CHUNK_SIZE chunks, and past budget bytes the oldest of it
+ * is spilled to an unlinked temporary file, so deleting most of a big
+ * file costs disk rather than memory.
+ * budget: the journal bytes kept in memory. YADDA_UNDO_MEMORY bytes,
+ *   or 64MB.
+ * record: notes that removed_length bytes at offset, found at removed,
+ *   were replaced with added_length bytes. An insert that carries on
+ *   from the last one, or a backspace over what it inserted, grows or
+ *   shrinks that record instead, while the group is open.
+ * seal: closes the group, the next edit starts a new one. Every record
+ *   in a group is undone and redone as one step.
+ * undo, redo: the next record of the step, or nullptr once the step is
+ *   done. first starts a step. Undo goes back from the last record.
+ * save: adds bytes to the journal, returns where they went or NOWHERE.
+ * read: the span of the journal at position, up to length bytes. Spilled
+ *   bytes are read into scratch, so the span only lasts until the next
+ *   read.
+ * Record
+ * offset: where the edit happened in the text.
+ * removed, added: where the bytes taken out and put in are in the
+ *   journal, NOWHERE while they're in the text instead.
+ * joined: whether the record is part of the same step as the one
+ *   before it.
+ */
+class UndoJournal {
+public:
+	UndoJournal();
+	~UndoJournal();
+
+	static constexpr uint64_t NOWHERE = UINT64_MAX;
+	static constexpr size_t CHUNK_SIZE = 64 << 10;
+
+	struct Record {
+		size_t offset;
+		size_t removed_length;
+		size_t added_length;
+		uint64_t removed;
+		uint64_t added;
+		bool joined;
+	};
+
+	static size_t budget();
+
+	void record(size_t offset, const char *removed, size_t removed_length, size_t added_length);
+	void seal() { sealed = true; }
+	void clear();
+	Record *undo(bool first);
+	Record *redo(bool first);
+	uint64_t save(const char *data, size_t length);
+	size_t read(uint64_t position, size_t length, const char *&data);
+	size_t memoryUsage() const { return chunks.size() * CHUNK_SIZE + records.capacity() * sizeof(Record); }
+
+private:
+	bool spill(size_t length);
+	bool spillChunk();
+
+	std::vector<Record> records;
+	size_t applied = 0;
+	bool sealed = true;
+
+	// the journal, [memory_start, end) is in chunks and the rest in the spill file
+	std::vector<std::unique_ptr<char[]>> chunks;
+	uint64_t memory_start = 0;
+	uint64_t end = 0;
+	size_t memory_budget;
+	int spill_fd = -1;
+	// a chunk kept back from the last spill or clear, for the next one to reuse
+	std::unique_ptr<char[]> spare;
+	std::unique_ptr<char[]> scratch;
+};
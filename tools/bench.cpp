@@ -0,0 +1,377 @@
+#include "../src/gap_buffer.hpp"
+#include "../src/logger.hpp"
+#include "../src/save.hpp"
+#include "../src/screen.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * Microbenchmarks for the editor's core primitives. Generates
+ * synthetic files, times the GapBuffer, Frame and save paths over
+ * them, and prints one JSON object per result so runs can be diffed
+ * across commits:
+ *     yadda-bench [--max-size BYTES[K|M|G]] [--filter NAME] [--dir DIR] [--time SECONDS]
+ * Sizes past 64M are only generated when --max-size asks for them.
+ */
+
+struct Options {
+	size_t max_size = 64ull << 20;
+	std::string filter;
+	std::string dir;
+	double time = 0.2;
+};
+
+enum class Kind {
+	SHORT_LINES,
+	LONG_LINES,
+	UTF8,
+};
+
+const char *KIND_NAMES[] = {
+	"short_lines",
+	"long_lines",
+	"utf8",
+};
+
+const size_t SIZES[] = {
+	1ull << 10,
+	1ull << 20,
+	64ull << 20,
+	256ull << 20,
+	1ull << 30,
+	4ull << 30,
+};
+
+constexpr size_t BURST = 4096;
+constexpr unsigned int FRAME_WIDTH = 200;
+constexpr unsigned int FRAME_HEIGHT = 60;
+
+static Options options;
+
+static uint64_t now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// xorshift, so every run generates the same files
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+static uint64_t nextRandom(uint64_t bound) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state % bound;
+}
+
+static void appendLine(std::string &out, Kind kind) {
+	static const char *UTF8_CHARS[] = {"a", "e", " ", "\xC3\xA9", "\xD0\xB6", "\xE4\xB8\xAD", "\xE2\x80\x94", "\xF0\x9F\x98\x80"};
+	switch (kind) {
+		case Kind::SHORT_LINES: {
+			size_t length = nextRandom(41);
+			for (size_t i = 0; i < length; i++) {
+				out += i % 6 == 5 ? ' ' : (char)('a' + nextRandom(26));
+			}
+		} break;
+		case Kind::LONG_LINES: {
+			size_t length = 1000 + nextRandom(19000);
+			for (size_t i = 0; i < length; i++) {
+				out += i % 8 == 7 ? ' ' : (char)('a' + nextRandom(26));
+			}
+		} break;
+		case Kind::UTF8: {
+			if (nextRandom(4) == 0) out += '\t';
+			size_t length = 20 + nextRandom(100);
+			for (size_t i = 0; i < length; i++) {
+				out += UTF8_CHARS[nextRandom(sizeof(UTF8_CHARS) / sizeof(UTF8_CHARS[0]))];
+			}
+		} break;
+	}
+	out += '\n';
+}
+
+/*
+ * Writes exactly size bytes of whole lines, padding the end with
+ * blank lines so no UTF-8 sequence gets cut in half.
+ */
+static bool generate(const std::string &path, Kind kind, size_t size) {
+	FILE *file = fopen(path.c_str(), "wb");
+	if (file == nullptr) {
+		return false;
+	}
+	std::string chunk;
+	std::string line;
+	size_t written = 0;
+	for (;;) {
+		line.clear();
+		appendLine(line, kind);
+		if (written + chunk.size() + line.size() > size) {
+			break;
+		}
+		chunk += line;
+		if (chunk.size() >= (1 << 20)) {
+			fwrite(chunk.data(), 1, chunk.size(), file);
+			written += chunk.size();
+			chunk.clear();
+		}
+	}
+	chunk.append(size - written - chunk.size(), '\n');
+	fwrite(chunk.data(), 1, chunk.size(), file);
+	return fclose(file) == 0;
+}
+
+struct Samples {
+	std::vector<uint64_t> times;
+	uint64_t total = 0;
+	void add(uint64_t time) { times.push_back(time); total += time; }
+};
+
+/*
+ * Prints a result: the per-iteration times, and per-op and per-byte
+ * rates when an iteration does more than one op or touches bytes.
+ */
+static void report(const char *name, Kind kind, size_t size, Samples &samples, size_t ops, size_t bytes) {
+	if (samples.times.empty()) {
+		return;
+	}
+	std::sort(samples.times.begin(), samples.times.end());
+	double mean = (double)samples.total / samples.times.size();
+	char line[512];
+	int length = snprintf(line, sizeof(line),
+		"{\"bench\": \"%s\", \"kind\": \"%s\", \"size\": %zu, \"iterations\": %zu, \"ops\": %zu, "
+		"\"min_ns\": %llu, \"median_ns\": %llu, \"mean_ns\": %.0f, \"ns_per_op\": %.2f, \"mb_per_s\": %.2f}\n",
+		name, KIND_NAMES[(int)kind], size, samples.times.size(), ops,
+		(unsigned long long)samples.times.front(), (unsigned long long)samples.times[samples.times.size() / 2],
+		mean, mean / std::max<size_t>(ops, 1), bytes ? bytes / (mean / 1e9) / (1 << 20) : 0.0);
+	write(STDOUT_FILENO, line, length);
+}
+
+static bool selected(const char *name) {
+	return options.filter.empty() || strstr(name, options.filter.c_str()) != nullptr;
+}
+
+// runs body until options.time has passed, at least 3 and at most 1000 times
+static void repeat(Samples &samples, const std::function<void(Samples &)> &body) {
+	uint64_t start = now();
+	for (int i = 0; i < 1000; i++) {
+		if (i >= 3 && now() - start > options.time * 1e9) {
+			break;
+		}
+		body(samples);
+	}
+}
+
+static void benchLoad(const std::string &path, Kind kind, size_t size) {
+	if (!selected("load")) return;
+	Samples samples;
+	repeat(samples, [&](Samples &samples) {
+		GapBuffer gap_buffer;
+		uint64_t start = now();
+		gap_buffer.loadFile(path);
+		samples.add(now() - start);
+	});
+	report("load", kind, size, samples, 1, size);
+}
+
+static void benchEdits(GapBuffer &gap_buffer, Kind kind, size_t size) {
+	char typed[BURST];
+	for (size_t i = 0; i < BURST; i++) {
+		typed[i] = i % 40 == 39 ? '\n' : (char)('a' + i % 26);
+	}
+	if (!selected("insert_typed") && !selected("insert_chunks") && !selected("remove_back") && !selected("remove_front")) {
+		return;
+	}
+	gap_buffer.advance(gap_buffer.length() / 2);
+
+	Samples inserts, back_removes, front_removes, chunk_inserts;
+	repeat(inserts, [&](Samples &samples) {
+		uint64_t start = now();
+		for (size_t i = 0; i < BURST; i++) {
+			gap_buffer.insert(&typed[i], 1);
+		}
+		samples.add(now() - start);
+		start = now();
+		gap_buffer.removeBack(BURST);
+		back_removes.add(now() - start);
+
+		start = now();
+		for (size_t i = 0; i < BURST; i += 64) {
+			gap_buffer.insert(&typed[i], 64);
+		}
+		chunk_inserts.add(now() - start);
+		gap_buffer.retreat(BURST);
+		start = now();
+		gap_buffer.removeFront(BURST);
+		front_removes.add(now() - start);
+	});
+	if (selected("insert_typed")) report("insert_typed", kind, size, inserts, BURST, BURST);
+	if (selected("insert_chunks")) report("insert_chunks", kind, size, chunk_inserts, BURST / 64, BURST);
+	if (selected("remove_back")) report("remove_back", kind, size, back_removes, 1, BURST);
+	if (selected("remove_front")) report("remove_front", kind, size, front_removes, 1, BURST);
+	gap_buffer.retreat(gap_buffer.length());
+}
+
+static void benchMovement(GapBuffer &gap_buffer, Kind kind, size_t size) {
+	size_t length = gap_buffer.length();
+	if (selected("advance_jump") || selected("retreat_jump")) {
+		Samples advances, retreats;
+		repeat(advances, [&](Samples &samples) {
+			uint64_t start = now();
+			gap_buffer.advance(length);
+			samples.add(now() - start);
+			start = now();
+			gap_buffer.retreat(length);
+			retreats.add(now() - start);
+		});
+		report("advance_jump", kind, size, advances, 1, length);
+		report("retreat_jump", kind, size, retreats, 1, length);
+	}
+
+	if (selected("down_line") || selected("up_line")) {
+		size_t lines = std::min<size_t>(gap_buffer.line_count() - 1, 100000);
+		Samples downs, ups;
+		repeat(downs, [&](Samples &samples) {
+			uint64_t start = now();
+			for (size_t i = 0; i < lines; i++) {
+				gap_buffer.down(1);
+			}
+			samples.add(now() - start);
+			start = now();
+			for (size_t i = 0; i < lines; i++) {
+				gap_buffer.up(1);
+			}
+			ups.add(now() - start);
+		});
+		report("down_line", kind, size, downs, lines, 0);
+		report("up_line", kind, size, ups, lines, 0);
+	}
+}
+
+static void benchFrame(GapBuffer &gap_buffer, Kind kind, size_t size) {
+	Frame frame;
+	frame.width = FRAME_WIDTH;
+	frame.height = FRAME_HEIGHT;
+	frame.init();
+	const char *text = &gap_buffer.buffer[gap_buffer.post_cursor_index];
+	size_t length = gap_buffer.capacity - gap_buffer.post_cursor_index;
+
+	if (selected("load_string")) {
+		Samples samples;
+		repeat(samples, [&](Samples &samples) {
+			unsigned short x = 0, y = 0;
+			uint64_t start = now();
+			frame.loadString(text, length, x, y, CharColor::GREEN, CharColor::BLACK);
+			samples.add(now() - start);
+		});
+		report("load_string", kind, size, samples, 1, 0);
+	}
+
+	if (selected("draw")) {
+		// draw writes to stdout, so point it at /dev/null for a while
+		fflush(stdout);
+		int null_fd = open("/dev/null", O_WRONLY);
+		int stdout_fd = dup(STDOUT_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		Samples samples;
+		repeat(samples, [&](Samples &samples) {
+			uint64_t start = now();
+			frame.draw();
+			samples.add(now() - start);
+		});
+		fflush(stdout);
+		dup2(stdout_fd, STDOUT_FILENO);
+		close(stdout_fd);
+		close(null_fd);
+		report("draw", kind, size, samples, 1, 0);
+	}
+}
+
+static void benchSave(GapBuffer &gap_buffer, const std::string &path, Kind kind, size_t size) {
+	for (bool sync : {false, true}) {
+		const char *name = sync ? "save_sync" : "save";
+		if (!selected(name)) continue;
+		Samples samples;
+		repeat(samples, [&](Samples &samples) {
+			Snapshot snapshot = gap_buffer.snapshot();
+			std::vector<iovec> segments = {
+				{(void *)snapshot.data[0], snapshot.length[0]},
+				{(void *)snapshot.data[1], snapshot.length[1]},
+			};
+			uint64_t start = now();
+			SaveEngine::writeAtomic(path + ".saved", segments, sync, 022);
+			samples.add(now() - start);
+		});
+		report(name, kind, size, samples, 1, size);
+	}
+	unlink((path + ".saved").c_str());
+}
+
+static size_t parseSize(const char *string) {
+	char *end;
+	size_t size = strtoull(string, &end, 10);
+	switch (*end) {
+		case 'k': case 'K': return size << 10;
+		case 'm': case 'M': return size << 20;
+		case 'g': case 'G': return size << 30;
+		default: return size;
+	}
+}
+
+int main(int argc, char **argv) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+			options.max_size = parseSize(argv[++i]);
+		} else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			options.filter = argv[++i];
+		} else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+			options.dir = argv[++i];
+		} else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+			options.time = atof(argv[++i]);
+		} else {
+			fprintf(stderr, "usage: %s [--max-size BYTES[K|M|G]] [--filter NAME] [--dir DIR] [--time SECONDS]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (Logger::init("/dev/null") != SUCCESS) {
+		return 1;
+	}
+	bool own_dir = options.dir.empty();
+	if (own_dir) {
+		char dir[] = "/tmp/yadda-bench-XXXXXX";
+		if (mkdtemp(dir) == nullptr) {
+			fprintf(stderr, "failed to create a temporary directory\n");
+			return 1;
+		}
+		options.dir = dir;
+	}
+
+	for (size_t size : SIZES) {
+		if (size > options.max_size) break;
+		for (int k = 0; k < 3; k++) {
+			Kind kind = (Kind)k;
+			std::string path = options.dir + "/" + KIND_NAMES[k] + "-" + std::to_string(size);
+			if (!generate(path, kind, size)) {
+				fprintf(stderr, "failed to generate %s\n", path.c_str());
+				continue;
+			}
+			benchLoad(path, kind, size);
+			GapBuffer gap_buffer;
+			gap_buffer.loadFile(path);
+			benchMovement(gap_buffer, kind, size);
+			benchEdits(gap_buffer, kind, size);
+			benchFrame(gap_buffer, kind, size);
+			benchSave(gap_buffer, path, kind, size);
+			unlink(path.c_str());
+		}
+	}
+	if (own_dir) {
+		rmdir(options.dir.c_str());
+	}
+	Logger::deinit();
+	return 0;
+}
@@ -0,0 +1,117 @@
+#include "../src/logger.hpp"
+
+#include <string>
+#include <unordered_map>
+
+/*
+ * Renders a binary log written by Logger as text:
+ *     yadda-logdump [yadda.ylog]
+ */
+
+static const char *LEVEL_NAMES[] = {"DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
+
+// printf one conversion spec with the arg widened to what the record stores
+static void printArg(std::string spec, uint8_t type, uint64_t bits) {
+	char conversion = spec.back();
+	spec.pop_back();
+	while (!spec.empty() && strchr("hljztL", spec.back())) {
+		spec.pop_back();
+	}
+	if (type == LOG_DOUBLE) {
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		printf((spec + conversion).c_str(), value);
+	} else if (type == LOG_POINTER || conversion == 'p') {
+		printf((spec + 'p').c_str(), (void *)(uintptr_t)bits);
+	} else if (strchr("di", conversion)) {
+		printf((spec + "ll" + conversion).c_str(), (long long)bits);
+	} else if (strchr("uxXoc", conversion)) {
+		printf((spec + "ll" + (conversion == 'c' ? 'u' : conversion)).c_str(), (unsigned long long)bits);
+	} else {
+		printf("<%s?>", (spec + conversion).c_str());
+	}
+}
+
+static void printRecord(const char *format, const LogRecord &record) {
+	if (record.arg_count == LogRecord::LOG_TEXT) {
+		printf("%s: %.*s", format, (int)sizeof(record.text), record.text);
+		return;
+	}
+	size_t arg = 0;
+	for (const char *c = format; *c; c++) {
+		if (*c != '%') {
+			putchar(*c);
+			continue;
+		}
+		if (c[1] == '%') {
+			putchar('%');
+			c++;
+			continue;
+		}
+		const char *end = c + 1;
+		while (*end && !strchr("diuxXocsfFeEgGaAp", *end)) {
+			end++;
+		}
+		if (!*end) {
+			fputs(c, stdout);
+			break;
+		}
+		std::string spec(c, end + 1);
+		if (arg < record.arg_count) {
+			printArg(spec, record.arg_types[arg], record.args[arg]);
+			arg++;
+		} else {
+			fputs(spec.c_str(), stdout);
+		}
+		c = end;
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *file_name = argc > 1 ? argv[1] : "yadda.ylog";
+	FILE *file = fopen(file_name, "rb");
+	if (file == nullptr) {
+		fprintf(stderr, "can't open %s\n", file_name);
+		return 1;
+	}
+	LogFileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "YLOG", 4) != 0 || header.version != 1) {
+		fprintf(stderr, "%s isn't a yadda log\n", file_name);
+		return 1;
+	}
+
+	std::unordered_map<uint64_t, std::string> strings;
+	int tag;
+	while ((tag = fgetc(file)) != EOF) {
+		if (tag == 'S') {
+			uint64_t address;
+			uint32_t length;
+			if (fread(&address, sizeof(address), 1, file) != 1 || fread(&length, sizeof(length), 1, file) != 1) break;
+			std::string string(length, '\0');
+			if (fread(string.data(), 1, length, file) != length) break;
+			strings[address] = string;
+		} else if (tag == 'R') {
+			LogRecord record;
+			if (fread(&record, sizeof(record), 1, file) != 1) break;
+			uint64_t time = header.realtime_base + (record.timestamp - header.monotonic_base);
+			time_t seconds = time / 1000000000ull;
+			tm local;
+			localtime_r(&seconds, &local);
+			int level = std::min<int>((int)record.level, 4);
+			printf("%02d:%02d:%02d.%06llu [%s] ", local.tm_hour, local.tm_min, local.tm_sec,
+				(unsigned long long)(time % 1000000000ull / 1000), LEVEL_NAMES[level]);
+			auto string = strings.find((uintptr_t)record.format);
+			printRecord(string == strings.end() ? "<unknown format>" : string->second.c_str(), record);
+			putchar('\n');
+		} else if (tag == 'D') {
+			uint64_t count;
+			if (fread(&count, sizeof(count), 1, file) != 1) break;
+			printf("... %llu records dropped\n", (unsigned long long)count);
+		} else {
+			fprintf(stderr, "corrupt entry in %s\n", file_name);
+			return 1;
+		}
+	}
+	fclose(file);
+	return 0;
+}
@@ -0,0 +1,92 @@
+#!/bin/sh
+# Runs batch scripts against generated files and compares what they
+# leave with what they should. 'make test' builds bin/yadda and runs it.
+
+YADDA=${YADDA:-bin/yadda}
+YADDA=$(realpath "$YADDA")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+failed=0
+
+# check NAME EXPECTED ACTUAL
+check() {
+	if cmp -s "$2" "$3"; then
+		echo "ok   $1"
+	else
+		echo "FAIL $1"
+		failed=1
+	fi
+}
+
+# a file of numbered lines bigger than a window, opened as a huge file
+seq -f "line %06g of a file bigger than the window" 1 300000 > huge.txt
+HUGE="YADDA_HUGE_FILE_SIZE=1000000"
+
+# selecting from one window into another deletes everything in between
+cp huge.txt test.txt
+env $HUGE "$YADDA" -c 'd150000j<cr>' -c ':w' test.txt
+tail -n +150001 huge.txt > expected.txt
+check "delete a selection across windows" expected.txt test.txt
+
+cp huge.txt test.txt
+env $HUGE "$YADDA" -c '200001md150000k<cr>' -c ':w' test.txt
+{ head -n 50000 huge.txt; tail -n +200001 huge.txt; } > expected.txt
+check "delete a selection back across windows" expected.txt test.txt
+
+# undoing a filter of more than a window puts back every byte, and redo takes it out again
+cp huge.txt test.txt
+env $HUGE "$YADDA" -c ':%!tr a-z A-Z' -c 'u' -c ':w' test.txt
+check "undo a filter across windows" huge.txt test.txt
+
+env $HUGE "$YADDA" -c ':%!tr a-z A-Z' -c 'u' -c "$(printf '\022')" -c ':w' test.txt
+tr a-z A-Z < huge.txt > expected.txt
+check "redo a filter across windows" expected.txt test.txt
+
+# following a file leaves it read-only, selections included
+printf 'one\ntwo\nthree\n' > small.txt
+cp small.txt test.txt
+"$YADDA" -c ':follow' -c 'y1k<bs>' -c 'd1k<cr>' -c ':follow' -c ':w' test.txt
+check "follow mode refuses a selection delete" small.txt test.txt
+
+# a batch run records macros like the editor does
+printf 'x1\n2x\n3x\n4x\n5\n' > expected.txt
+printf '1\n2\n3\n4\n5\n' | "$YADDA" -c 'qaix<esc>jq3@a' > test.txt
+check "record and run a macro in a batch run" expected.txt test.txt
+
+# 'q' stops a recording straight away, rather than taking the next key with it
+printf '1\nX2\n3\n' > expected.txt
+printf '1\n2\n3\n' | "$YADDA" -c 'qaqjiX<esc>' > test.txt
+check "stop recording without eating a key" expected.txt test.txt
+
+# a filter that fails leaves the text alone and fails the run
+printf 'b\na\n' > small.txt
+if printf 'b\na\n' | "$YADDA" -c ':%!sort; exit 1' > test.txt 2> /dev/null; then
+	echo "FAIL a failed filter fails the batch run"
+	failed=1
+else
+	check "a failed filter fails the batch run" small.txt test.txt
+fi
+
+# session KEYS LAST: types KEYS into the editor on test.txt, in a terminal,
+# then LAST a second later, once the edits have gone to the swap file
+session() {
+	{ sleep 1; printf "$1"; sleep 1; printf "$2"; sleep 1; } |
+		script -qec "stty rows 30 cols 100; echo \$\$ > pid; exec env $HUGE '$YADDA' test.txt" /dev/null > /dev/null 2>&1
+}
+
+# an editor killed after deleting across windows leaves a swap that puts all of it back
+if command -v script > /dev/null; then
+	cp huge.txt test.txt
+	session 'd150000j\r' 'l' &
+	sleep 2.5
+	kill -9 "$(cat pid)"
+	wait
+	session ':w\r' ':q\r'
+	tail -n +150001 huge.txt > expected.txt
+	check "recover a delete across windows" expected.txt test.txt
+else
+	echo "skip recover a delete across windows, it needs script(1)"
+fi
+
+exit $failed